@@ -0,0 +1,167 @@
+#include "AllocProfiler.h"
+#include "State.h"
+#include "Function.h"
+#include "String.h"
+#include <algorithm>
+#include <stdio.h>
+
+namespace luna
+{
+    AllocProfiler::AllocProfiler(State *state)
+        : state_(state), running_(false), sample_bytes_(0)
+    {
+    }
+
+    AllocProfiler::~AllocProfiler()
+    {
+        state_->GetGC().SetAllocSampler(nullptr);
+    }
+
+    void AllocProfiler::Start(std::size_t sample_bytes)
+    {
+        running_ = true;
+        sample_bytes_ = std::max<std::size_t>(sample_bytes, 1);
+        state_->GetGC().SetAllocSampler(this, sample_bytes_);
+    }
+
+    void AllocProfiler::Stop()
+    {
+        // Keep tracking sampled objects until Reset, then alive and old
+        // counts of report are still right, and objects_ never keeps
+        // addresses of freed or moved objects
+        if (running_)
+        {
+            running_ = false;
+            state_->GetGC().SetAllocSampler(this, 0);
+        }
+    }
+
+    void AllocProfiler::Reset()
+    {
+        if (!running_)
+            state_->GetGC().SetAllocSampler(nullptr);
+
+        sites_.clear();
+        site_index_.clear();
+        objects_.clear();
+    }
+
+    void AllocProfiler::WriteReport(std::ostream &os, std::size_t top) const
+    {
+        std::size_t samples = 0;
+        std::size_t bytes = 0;
+        for (const auto &site : sites_)
+        {
+            samples += site.samples_;
+            bytes += site.bytes_;
+        }
+
+        os << "allocation profile: " << samples << " samples, about "
+           << bytes << " bytes, sample every " << sample_bytes_ << " bytes\n";
+
+        std::vector<const Site *> sites;
+        for (const auto &site : sites_)
+            sites.push_back(&site);
+
+        top = std::min(top, sites.size());
+        std::partial_sort(sites.begin(), sites.begin() + top, sites.end(),
+                          [](const Site *l, const Site *r) {
+                              return l->bytes_ > r->bytes_;
+                          });
+
+        char line[128];
+        snprintf(line, sizeof(line), "%12s %8s %8s %8s  %s\n",
+                 "bytes", "samples", "old", "alive", "site");
+        os << line;
+
+        for (std::size_t i = 0; i < top; ++i)
+        {
+            auto site = sites[i];
+            snprintf(line, sizeof(line), "%12zu %8zu %8zu %8zu  ",
+                     site->bytes_, site->samples_, site->old_, site->alive_);
+            os << line << site->stack_ << "\n";
+        }
+    }
+
+    void AllocProfiler::Sample(GCObject *obj, std::size_t bytes)
+    {
+        auto stack = GetCallStack();
+        auto it = site_index_.find(stack);
+        if (it == site_index_.end())
+        {
+            it = site_index_.insert(std::make_pair(stack, sites_.size())).first;
+            sites_.push_back(Site(stack));
+        }
+
+        auto &site = sites_[it->second];
+        ++site.samples_;
+        ++site.alive_;
+        site.bytes_ += bytes;
+        if (obj->GetGeneration() != GCGen0)
+            ++site.old_;
+
+        objects_[obj] = it->second;
+    }
+
+    void AllocProfiler::Move(GCObject *old_obj, GCObject *new_obj)
+    {
+        auto it = objects_.find(old_obj);
+        if (it == objects_.end())
+            return ;
+
+        auto index = it->second;
+        objects_.erase(it);
+        objects_[new_obj] = index;
+
+        // Promoted from nursery to GCGen1
+        if (new_obj->GetGeneration() != GCGen0)
+            ++sites_[index].old_;
+    }
+
+    void AllocProfiler::Free(GCObject *obj)
+    {
+        auto it = objects_.find(obj);
+        if (it == objects_.end())
+            return ;
+
+        --sites_[it->second].alive_;
+        objects_.erase(it);
+    }
+
+    std::string AllocProfiler::GetCallStack() const
+    {
+        std::string stack;
+        std::size_t depth = 0;
+
+        for (auto it = state_->calls_.rbegin();
+             it != state_->calls_.rend(); ++it, ++depth)
+        {
+            if (!stack.empty())
+                stack += " <- ";
+
+            if (depth == kMaxStackDepth)
+            {
+                stack += "...";
+                break;
+            }
+
+            const auto &call = *it;
+            if (call.func_->type_ != ValueT_Closure)
+            {
+                stack += "[C]";
+                continue;
+            }
+
+            auto proto = call.func_->closure_->GetPrototype();
+            auto index = call.instruction_ - proto->GetOpCodes() - 1;
+            if (index < 0)
+                index = 0;
+
+            auto module = proto->GetModule();
+            stack += module ? module->GetCStr() : "?";
+            stack += ":" + std::to_string(proto->GetInstructionLine(index));
+        }
+
+        return stack.empty() ? "[no call]" : stack;
+    }
+} // namespace luna
@@ -0,0 +1,84 @@
+#ifndef ALLOC_PROFILER_H
+#define ALLOC_PROFILER_H
+
+#include "GC.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <ostream>
+
+namespace luna
+{
+    class State;
+
+    // Sampling allocation profiler, attributes sampled GC objects to
+    // the call stack which allocated them, and tracks whether sampled
+    // objects survived to old generations
+    class AllocProfiler : public AllocSampler
+    {
+    public:
+        explicit AllocProfiler(State *state);
+        ~AllocProfiler();
+
+        AllocProfiler(const AllocProfiler&) = delete;
+        void operator = (const AllocProfiler&) = delete;
+
+        // Start sampling an object every sample_bytes allocated
+        void Start(std::size_t sample_bytes);
+
+        // Stop sampling, samples are kept for report, and sampled
+        // objects are tracked until Reset
+        void Stop();
+
+        bool IsRunning() const
+        { return running_; }
+
+        // Clear all samples, and stop tracking sampled objects when
+        // profiler is not running
+        void Reset();
+
+        // Write top allocation sites sorted by sampled bytes
+        void WriteReport(std::ostream &os, std::size_t top = 20) const;
+
+        virtual void Sample(GCObject *obj, std::size_t bytes);
+        virtual void Move(GCObject *old_obj, GCObject *new_obj);
+        virtual void Free(GCObject *obj);
+
+    private:
+        // Allocation site of sampled objects
+        struct Site
+        {
+            // Call stack, the innermost frame first
+            std::string stack_;
+            // Count of samples
+            std::size_t samples_;
+            // Estimated allocated bytes
+            std::size_t bytes_;
+            // Count of samples in GCGen1 or older generations
+            std::size_t old_;
+            // Count of samples still alive
+            std::size_t alive_;
+
+            explicit Site(const std::string &stack)
+                : stack_(stack), samples_(0), bytes_(0), old_(0), alive_(0) { }
+        };
+
+        // Get current call stack of state
+        std::string GetCallStack() const;
+
+        static const std::size_t kMaxStackDepth = 8;
+
+        State *state_;
+        bool running_;
+        // Bytes between two samples
+        std::size_t sample_bytes_;
+        // All allocation sites
+        std::vector<Site> sites_;
+        // Index of site by call stack
+        std::unordered_map<std::string, std::size_t> site_index_;
+        // Site index of alive sampled objects
+        std::unordered_map<GCObject *, std::size_t> objects_;
+    };
+} // namespace luna
+
+#endif // ALLOC_PROFILER_H
@@ -4,6 +4,7 @@
 #include "Function.h"
 #include "Exception.h"
 #include "Guard.h"
+#include <algorithm>
 #include <vector>
 #include <stack>
 #include <list>
@@ -16,6 +17,7 @@ namespace luna
 {
 #define MAX_FUNCTION_REGISTER_COUNT 250
 #define MAX_CLOSURE_UPVALUE_COUNT 250
+#define MAX_CONCAT_OPERAND_COUNT 32
 
 #define CHECK_UPVALUE_MAX_COUNT(index, function)                        \
     if (index >= MAX_CLOSURE_UPVALUE_COUNT)                             \
@@ -466,6 +468,10 @@ namespace luna
             }
         }
 
+        // Generate code of concat expressions chain
+        void GenerateConcat(BinaryExpression *bin_exp,
+                            int register_id, int end_register);
+
         template<typename StatementType>
         void IfStatementGenerateCode(StatementType *if_stmt);
 
@@ -971,6 +977,14 @@ namespace luna
             auto temp_state = GenerateRegisterId();
             auto temp_var = GenerateRegisterId();
 
+            // Iterate table directly when iterator is built-in iterator
+            // of pairs or ipairs, then jump over the call
+            auto instruction = Instruction::ABCCode(OpType_ForIter, func_register,
+                                                    name_start, name_end - name_start);
+            function->AddInstruction(instruction, line);
+            instruction = Instruction::AsBxCode(OpType_Jmp, 0, 0);
+            int iter_jmp_index = function->AddInstruction(instruction, line);
+
             // Call iterate function
             auto move = [=](int dst, int src) {
                 auto instruction = Instruction::ABCode(OpType_Move, dst, src);
@@ -980,15 +994,18 @@ namespace luna
             move(temp_state, state_register);
             move(temp_var, var_register);
 
-            auto instruction = Instruction::ABCCode(OpType_Call, temp_func,
-                                                    2 + 1,  // Two args
-                                                    name_end - name_start + 1);
+            instruction = Instruction::ABCCode(OpType_Call, temp_func,
+                                               2 + 1,  // Two args
+                                               name_end - name_start + 1);
             function->AddInstruction(instruction, line);
 
             // Copy results to registers of names
             for (auto name = name_start; name < name_end; ++name, ++temp_func)
                 move(name, temp_func);
 
+            int iter_end_index = function->OpCodeSize();
+            function->GetMutableInstruction(iter_jmp_index)->RefillsBx(iter_end_index - iter_jmp_index);
+
             // Break the loop when the first name value is nil
             instruction = Instruction::AsBxCode(OpType_JmpNil, name_start, 0);
             int index = function->AddInstruction(instruction, line);
@@ -1345,6 +1362,9 @@ namespace luna
             return FillRemainRegisterNil(register_id + 1, end_register, line);
         }
 
+        if (token == Token_Concat)
+            return GenerateConcat(bin_exp, register_id, end_register);
+
         int left_register = 0;
         // Generate code to calculate left expression
         {
@@ -1386,7 +1406,6 @@ namespace luna
             case '%': op_type = OpType_Mod; break;
             case '<': op_type = OpType_Less; break;
             case '>': op_type = OpType_Greater; break;
-            case Token_Concat: op_type = OpType_Concat; break;
             case Token_Equal: op_type = OpType_Equal; break;
             case Token_NotEqual: op_type = OpType_UnEqual; break;
             case Token_LessEqual: op_type = OpType_LessEqual; break;
@@ -1402,6 +1421,53 @@ namespace luna
         FillRemainRegisterNil(register_id, end_register, line);
     }
 
+    void CodeGenerateVisitor::GenerateConcat(BinaryExpression *bin_exp,
+                                             int register_id, int end_register)
+    {
+        // Concat is left associative, collect operands of left deep concat
+        // expressions, then concat all of them by one instruction
+        std::vector<SyntaxTree *> operands;
+        SyntaxTree *exp = bin_exp;
+        while (operands.size() + 1 < MAX_CONCAT_OPERAND_COUNT)
+        {
+            auto concat = dynamic_cast<BinaryExpression *>(exp);
+            if (!concat || concat->op_token_.token_ != Token_Concat)
+                break;
+            operands.push_back(concat->right_.get());
+            exp = concat->left_.get();
+        }
+        operands.push_back(exp);
+        std::reverse(operands.begin(), operands.end());
+
+        // Calculate operands in continuous registers
+        int first_register = 0;
+        {
+            REGISTER_GENERATOR_GUARD();
+            for (std::size_t i = 0; i < operands.size(); ++i)
+            {
+                auto operand_register = GenerateRegisterId();
+                if (i == 0)
+                    first_register = operand_register;
+            }
+
+            for (std::size_t i = 0; i < operands.size(); ++i)
+            {
+                int operand_register = first_register + static_cast<int>(i);
+                ExpVarData exp_var_data{ operand_register, operand_register + 1 };
+                operands[i]->Accept(this, &exp_var_data);
+            }
+        }
+
+        auto function = GetCurrentFunction();
+        auto line = bin_exp->op_token_.line_;
+        auto instruction = Instruction::ABCCode(OpType_Concat, register_id++,
+                                                first_register,
+                                                static_cast<int>(operands.size()));
+        function->AddInstruction(instruction, line);
+
+        FillRemainRegisterNil(register_id, end_register, line);
+    }
+
     void CodeGenerateVisitor::Visit(UnaryExpression *unexp, void *data)
     {
         auto exp_var_data = static_cast<ExpVarData *>(data);
@@ -1518,9 +1584,21 @@ namespace luna
         if (end_register != EXP_VALUE_COUNT_ANY && register_id >= end_register)
             return ;
 
+        // Array fields are in array part, and other fields are in hash
+        // part mostly, so reserve table by counts of them
+        std::size_t array_size = 0;
+        for (auto &field : table->fields_)
+        {
+            if (dynamic_cast<TableArrayField *>(field.get()))
+                ++array_size;
+        }
+        auto hash_size = table->fields_.size() - array_size;
+
         // New table
         auto function = GetCurrentFunction();
-        auto instruction = Instruction::ACode(OpType_NewTable, register_id);
+        auto instruction = Instruction::ABCCode(OpType_NewTable, register_id,
+                                                Instruction::EncodeSize(array_size),
+                                                Instruction::EncodeSize(hash_size));
         function->AddInstruction(instruction, table->line_);
 
         if (!table->fields_.empty())
@@ -141,6 +141,17 @@ namespace luna
                     v1->TypeName(), " with ", v2->TypeName());
         }
     };
+
+    // GC report heap bytes exceed the heap limit
+    class OutOfMemory : public Exception
+    {
+    public:
+        OutOfMemory(std::size_t heap_bytes, std::size_t heap_limit)
+        {
+            SetWhat("out of memory: heap ", heap_bytes,
+                    " bytes exceed limit ", heap_limit, " bytes");
+        }
+    };
 } // namespace luna
 
 #endif // EXCEPTION_H
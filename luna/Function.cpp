@@ -32,6 +32,35 @@ namespace luna
         }
     }
 
+    void Function::UpdateReferences()
+    {
+        UpdateReference(module_);
+        UpdateReference(superior_);
+
+        for (auto &value : const_values_)
+            value.UpdateReference();
+
+        for (auto &var : local_vars_)
+            UpdateReference(var.name_);
+
+        for (auto &child : child_funcs_)
+            UpdateReference(child);
+
+        for (auto &upvalue : upvalues_)
+            UpdateReference(upvalue.name_);
+    }
+
+    std::size_t Function::GetMemorySize() const
+    {
+        return sizeof(Function) +
+            opcodes_.capacity() * sizeof(Instruction) +
+            opcode_lines_.capacity() * sizeof(int) +
+            const_values_.capacity() * sizeof(Value) +
+            local_vars_.capacity() * sizeof(LocalVarInfo) +
+            child_funcs_.capacity() * sizeof(Function *) +
+            upvalues_.capacity() * sizeof(UpvalueInfo);
+    }
+
     const Instruction * Function::GetOpCodes() const
     {
         return opcodes_.empty() ? nullptr : &opcodes_[0];
@@ -195,6 +224,19 @@ namespace luna
         }
     }
 
+    void Closure::UpdateReferences()
+    {
+        UpdateReference(prototype_);
+
+        for (auto &upvalue : upvalues_)
+            UpdateReference(upvalue);
+    }
+
+    std::size_t Closure::GetMemorySize() const
+    {
+        return sizeof(Closure) + upvalues_.capacity() * sizeof(Upvalue *);
+    }
+
     Function * Closure::GetPrototype() const
     {
         return prototype_;
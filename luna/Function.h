@@ -15,6 +15,7 @@ namespace luna
     // parse.
     class Function : public GCObject
     {
+        friend class GC;
     public:
         struct UpvalueInfo
         {
@@ -38,8 +39,11 @@ namespace luna
         };
 
         Function();
+        Function(Function &&) = default;
 
         virtual void Accept(GCObjectVisitor *v);
+        virtual void UpdateReferences();
+        virtual std::size_t GetMemorySize() const;
 
         // Get function instructions and size
         const Instruction * GetOpCodes() const;
@@ -163,10 +167,14 @@ namespace luna
     // prototype Function object and its upvalues.
     class Closure : public GCObject
     {
+        friend class GC;
     public:
         Closure();
+        Closure(Closure &&) = default;
 
         virtual void Accept(GCObjectVisitor *v);
+        virtual void UpdateReferences();
+        virtual std::size_t GetMemorySize() const;
 
         // Get and set closure prototype Function
         Function * GetPrototype() const;
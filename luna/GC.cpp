@@ -4,13 +4,52 @@
 #include "Upvalue.h"
 #include "String.h"
 #include "UserData.h"
+#include "Exception.h"
+#include <algorithm>
+#include <chrono>
+#include <initializer_list>
+#include <new>
+#include <utility>
+#include <cstddef>
 #include <assert.h>
-#include <time.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LUNA_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define LUNA_PREFETCH(addr) ((void)(addr))
+#endif
+
+namespace
+{
+    // Alignment of objects in nursery
+    const std::size_t kNurseryAlign = alignof(std::max_align_t);
+
+    inline std::size_t AlignNurserySize(std::size_t size)
+    {
+        return (size + kNurseryAlign - 1) & ~(kNurseryAlign - 1);
+    }
+
+    // Mix bits of n, it is a bijection, so different counts get
+    // different hashes. Addresses are not used, because nursery
+    // addresses are reused by new objects after every minor GC.
+    inline unsigned int MixObjectHash(uint32_t n)
+    {
+        n ^= n >> 16;
+        n *= 0x85EBCA6BU;
+        n ^= n >> 13;
+        n *= 0xC2B2AE35U;
+        n ^= n >> 16;
+        return n;
+    }
+} // namespace
 
 namespace luna
 {
     GCObject::GCObject()
-        : next_(nullptr), generation_(GCGen0), gc_(0), gc_obj_type_(0)
+        : next_(nullptr), generation_(GCGen0), gc_(0), gc_obj_type_(0),
+          forwarded_(0), barriered_(0), age_(0), perm_written_(0), sampled_(0),
+          obj_hash_(0)
     {
     }
 
@@ -18,9 +57,13 @@ namespace luna
     {
     }
 
-    class MinorMarkVisitor : public GCObjectVisitor
+    // Mark root objects, members of root objects are marked by GC
+    // through gray stack
+    class MarkVisitor : public GCObjectVisitor
     {
     public:
+        explicit MarkVisitor(GC *gc) : gc_(gc) { }
+
         virtual bool Visit(Table *t) { return VisitObj(t); }
         virtual bool Visit(Function *f) { return VisitObj(f); }
         virtual bool Visit(Closure *c) { return VisitObj(c); }
@@ -31,18 +74,19 @@ namespace luna
     private:
         bool VisitObj(GCObject *obj)
         {
-            if (obj->generation_ == GCGen0 && obj->gc_ == GCFlag_White)
-            {
-                obj->gc_ = GCFlag_Black;
-                return true;
-            }
+            gc_->MarkObject(obj);
             return false;
         }
+
+        GC *gc_;
     };
 
-    class BarrieredMarkVisitor : public GCObjectVisitor
+    // Check whether an old object references objects in nursery
+    class YoungReferenceVisitor : public GCObjectVisitor
     {
     public:
+        YoungReferenceVisitor() : visited_(false), young_ref_(false) { }
+
         virtual bool Visit(Table *t) { return VisitObj(t); }
         virtual bool Visit(Function *f) { return VisitObj(f); }
         virtual bool Visit(Closure *c) { return VisitObj(c); }
@@ -50,49 +94,26 @@ namespace luna
         virtual bool Visit(String *s) { return VisitObj(s); }
         virtual bool Visit(UserData *u) { return VisitObj(u); }
 
+        bool HasYoungReference() const
+        { return young_ref_; }
+
     private:
         bool VisitObj(GCObject *obj)
         {
-            // Visit member GC objects of obj when it is barriered object
-            if (obj->generation_ != GCGen0 && obj->gc_ == GCFlag_Black)
+            // Only visit member GC objects of the first visited object
+            if (!visited_)
             {
-                obj->gc_ = GCFlag_White;
+                visited_ = true;
                 return true;
             }
 
-            // Visit GCGen0 generation object
-            if (obj->generation_ == GCGen0 && obj->gc_ == GCFlag_White)
-            {
-                obj->gc_ = GCFlag_Black;
-                return true;
-            }
+            if (obj->generation_ == GCGen0)
+                young_ref_ = true;
             return false;
         }
-    };
-
-    class MajorMarkVisitor : public GCObjectVisitor
-    {
-    public:
-        virtual bool Visit(Table *t) { return VisitObj(t); }
-        virtual bool Visit(Function *f) { return VisitObj(f); }
-        virtual bool Visit(Closure *c) { return VisitObj(c); }
-        virtual bool Visit(Upvalue *u) { return VisitObj(u); }
-        virtual bool Visit(String *s) { return VisitObj(s); }
-        virtual bool Visit(UserData *u) { return VisitObj(u); }
 
-    private:
-        bool VisitObj(GCObject *obj)
-        {
-            if (obj->gc_ == GCFlag_White)
-            {
-                obj->gc_ = GCFlag_Black;
-                return true;
-            }
-            else
-            {
-                return false;
-            }
-        }
+        bool visited_;
+        bool young_ref_;
     };
 
 #define GC_LOG(log)                             \
@@ -104,12 +125,138 @@ namespace luna
         }                                       \
     } while (0)
 
-    GC::GC(const GCObjectDeleter &obj_deleter, bool log)
-        : obj_deleter_(obj_deleter)
+    GC::NurseryRegion::NurseryRegion()
+        : buffer_(new char[kNurseryRegionSize]),
+          top_(buffer_.get())
+    {
+    }
+
+    template<typename T>
+    T * GC::NewObject(GCObjectType type, GCGeneration gen)
+    {
+        T *obj = nullptr;
+        if (gen == GCGen0)
+        {
+            void *mem = AllocNursery(sizeof(T));
+            obj = new (mem) T;
+            assert(static_cast<GCObject *>(obj) == mem);
+        }
+        else
+        {
+            obj = new T;
+        }
+
+        InitObject(obj, type, gen, sizeof(T));
+        return obj;
+    }
+
+    void GC::InitObject(GCObject *obj, GCObjectType type,
+                        GCGeneration gen, std::size_t bytes)
+    {
+        obj->gc_obj_type_ = type;
+        obj->obj_hash_ = MixObjectHash(++obj_hash_counter_);
+        SetObjectGen(obj, gen);
+
+        auto &stats = stats_.gens_[gen];
+        ++stats.alloc_objects_;
+        stats.alloc_bytes_ += bytes;
+
+        if (sampler_)
+            SampleAllocation(obj, bytes);
+
+        CheckAllocLimit();
+    }
+
+    void GC::SampleAllocation(GCObject *obj, std::size_t bytes)
+    {
+        // Sampler only tracks objects sampled before
+        if (sample_bytes_ == 0)
+            return ;
+
+        if (bytes < sample_countdown_)
+        {
+            sample_countdown_ -= bytes;
+            return ;
+        }
+
+        sample_countdown_ = sample_bytes_;
+        obj->sampled_ = 1;
+        sampler_->Sample(obj, std::max(bytes, sample_bytes_));
+    }
+
+    void * GC::AllocNursery(std::size_t size)
+    {
+        return AllocRegion(nursery_, nursery_index_, size);
+    }
+
+    void * GC::AllocRegion(std::vector<NurseryRegion> &regions,
+                           std::size_t &index, std::size_t size)
+    {
+        size = AlignNurserySize(size);
+        assert(size <= kNurseryRegionSize);
+
+        for (;;)
+        {
+            // New region when all regions are full
+            if (index == regions.size())
+                regions.push_back(NurseryRegion());
+
+            auto &region = regions[index];
+            auto end = region.buffer_.get() + kNurseryRegionSize;
+            if (static_cast<std::size_t>(end - region.top_) >= size)
+            {
+                void *mem = region.top_;
+                region.top_ += size;
+                return mem;
+            }
+
+            ++index;
+        }
+    }
+
+    void GC::ResetRegions(std::vector<NurseryRegion> &regions,
+                          std::size_t &index)
     {
-        gen0_.threshold_count_ = kGen0InitThresholdCount;
-        gen1_.threshold_count_ = kGen1InitThresholdCount;
+        for (auto &region : regions)
+            region.top_ = region.buffer_.get();
+        index = 0;
+    }
 
+    template<typename Op>
+    void GC::ForEachNurseryObject(const Op &op)
+    {
+        for (auto &region : nursery_)
+        {
+            auto mem = region.buffer_.get();
+            while (mem < region.top_)
+            {
+                auto obj = reinterpret_cast<GCObject *>(mem);
+                mem += AlignNurserySize(NurseryObjectSize(obj));
+                op(obj);
+            }
+        }
+    }
+
+    GC::GC(const GCObjectFinalizer &obj_finalizer, bool log)
+        : gen0_threshold_bytes_(kGen0MinThresholdBytes),
+          gen0_trigger_bytes_(kGen0MinThresholdBytes),
+          step_multiplier_(100),
+          running_(true),
+          major_threshold_bytes_(kMajorMinThresholdBytes),
+          growth_factor_(2.0),
+          heap_limit_(0),
+          limit_trigger_bytes_(0),
+          promotion_age_(2),
+          nursery_index_(0),
+          survivor_index_(0),
+          minor_mark_(false),
+          obj_finalizer_(obj_finalizer),
+          obj_mover_(DefaultMover()),
+          sampler_(nullptr),
+          sample_bytes_(0),
+          sample_countdown_(0),
+          obj_hash_counter_(0)
+    {
         if (log)
         {
             log_stream_.open("gc.log");
@@ -118,9 +265,17 @@ namespace luna
 
     GC::~GC()
     {
-        DestroyGeneration(gen0_);
+        ForEachNurseryObject([this](GCObject *obj) { DestroyObject(obj); });
         DestroyGeneration(gen1_);
         DestroyGeneration(gen2_);
+        DestroyGeneration(perm_);
+    }
+
+    void GC::SetAllocSampler(AllocSampler *sampler, std::size_t sample_bytes)
+    {
+        sampler_ = sampler;
+        sample_bytes_ = sample_bytes;
+        sample_countdown_ = sample_bytes_;
     }
 
     void GC::SetRootTraveller(const RootTravelType &minor, const RootTravelType &major)
@@ -129,96 +284,205 @@ namespace luna
         major_traveller_ = major;
     }
 
+    void GC::SetRootUpdater(const RootUpdateType &updater)
+    {
+        root_updater_ = updater;
+    }
+
     Table * GC::NewTable(GCGeneration gen)
     {
-        auto t = new Table;
-        t->gc_obj_type_ = GCObjectType_Table;
-        SetObjectGen(t, gen);
+        auto t = NewObject<Table>(GCObjectType_Table, gen);
+        t->SetGC(this);
         return t;
     }
 
     Function * GC::NewFunction(GCGeneration gen)
     {
-        auto f = new Function;
-        f->gc_obj_type_ = GCObjectType_Function;
-        SetObjectGen(f, gen);
-        return f;
+        return NewObject<Function>(GCObjectType_Function, gen);
     }
 
     Closure * GC::NewClosure(GCGeneration gen)
     {
-        auto c = new Closure;
-        c->gc_obj_type_ = GCObjectType_Closure;
-        SetObjectGen(c, gen);
-        return c;
+        return NewObject<Closure>(GCObjectType_Closure, gen);
     }
 
     Upvalue * GC::NewUpvalue(GCGeneration gen)
     {
-        auto u = new Upvalue;
-        u->gc_obj_type_ = GCObjectType_Upvalue;
-        SetObjectGen(u, gen);
-        return u;
+        return NewObject<Upvalue>(GCObjectType_Upvalue, gen);
     }
 
-    String * GC::NewString(GCGeneration gen)
+    String * GC::NewString(GCGeneration gen, std::size_t length)
     {
-        auto s = new String;
-        s->gc_obj_type_ = GCObjectType_String;
-        SetObjectGen(s, gen);
+        // Content of string is stored after String object in one memory
+        // block, except too long string in nursery, it is stored in heap,
+        // then GC does not copy it when moves the string
+        std::size_t inline_size = length + 1;
+        if (gen == GCGen0 && inline_size > kMaxNurseryInlineSize)
+            inline_size = 1;
+
+        auto size = sizeof(String) + inline_size;
+        void *mem = gen == GCGen0 ? AllocNursery(size) : ::operator new(size);
+        auto s = String::ConstructInline(mem, inline_size);
+
+        InitObject(s, GCObjectType_String, gen, size);
         return s;
     }
 
     UserData * GC::NewUserData(GCGeneration gen)
     {
-        auto u = new UserData;
-        u->gc_obj_type_ = GCObjectType_UserData;
-        SetObjectGen(u, gen);
-        return u;
+        return NewObject<UserData>(GCObjectType_UserData, gen);
     }
 
     void GC::SetBarrier(GCObject *obj)
     {
         assert(obj->generation_ != GCGen0);
-        barriered_.push_back(obj);
+        if (!obj->barriered_)
+        {
+            obj->barriered_ = 1;
+            barriered_.push_back(obj);
+            ++stats_.barrier_count_;
+        }
+
+        // Permanent objects are not traced by major GC, except the
+        // written ones
+        if (obj->generation_ == GCGenPerm && !obj->perm_written_)
+        {
+            obj->perm_written_ = 1;
+            perm_written_.push_back(obj);
+        }
+    }
+
+    void GC::SetGrowthFactor(double factor)
+    {
+        growth_factor_ = std::max(factor, 1.0);
+    }
+
+    void GC::SetStepMultiplier(unsigned int multiplier)
+    {
+        step_multiplier_ = std::max(multiplier, 1u);
+        gen0_trigger_bytes_ = gen0_threshold_bytes_ * 100 / step_multiplier_;
+    }
+
+    void GC::SetHeapLimit(std::size_t limit)
+    {
+        heap_limit_ = limit;
+        AdjustLimitTrigger();
+    }
+
+    void GC::SetPromotionAge(unsigned int age)
+    {
+        if (age < 1)
+            age = 1;
+        else if (age > kMaxPromotionAge)
+            age = kMaxPromotionAge;
+        promotion_age_ = age;
+    }
+
+    unsigned int GC::GetObjectCount(GCGeneration gen) const
+    {
+        return GetGenInfo(gen).count_;
+    }
+
+    std::size_t GC::GetObjectBytes(GCGeneration gen) const
+    {
+        return GetGenInfo(gen).bytes_;
     }
 
     void GC::CheckGC()
     {
-        if (gen0_.count_ >= gen0_.threshold_count_)
+        bool exceed_limit = heap_limit_ != 0 &&
+            GetHeapBytes() > limit_trigger_bytes_;
+        if (!running_ && !exceed_limit)
+            return ;
+
+        bool major = exceed_limit || GetOldBytes() >= major_threshold_bytes_;
+        if (major || gen0_.bytes_ >= gen0_trigger_bytes_)
         {
-            unsigned int gen0_count = gen0_.count_;
-            unsigned int gen0_threshold = gen0_.threshold_count_;
-            unsigned int gen1_count = gen1_.count_;
-            unsigned int gen1_threshold = gen1_.threshold_count_;
-            unsigned int gen2_count = gen2_.count_;
-            unsigned int gen2_threshold = gen2_.threshold_count_;
+            RunGC(major);
+            CheckHeapLimit(major);
+        }
+    }
 
-            const char *gc_name = "";
-            clock_t start = clock();
-            if (gen1_.count_ >= gen1_.threshold_count_)
-            {
-                gc_name = "major";
-                MajorGC();
-            }
-            else
-            {
-                gc_name = "minor";
-                MinorGC();
-            }
+    void GC::FullGC()
+    {
+        RunGC(true);
+    }
 
-            clock_t duration = clock() - start;
-            unsigned int microseconds = duration * 1000000 / CLOCKS_PER_SEC;
-            GC_LOG(gc_name << "[" << microseconds << " microseconds]: " <<
-                   gen0_count << " " << gen0_threshold << " | " <<
-                   gen1_count << " " << gen1_threshold << " | " <<
-                   gen2_count << " " << gen2_threshold << " - " <<
-                   gen0_.count_ << " " << gen0_.threshold_count_ << " | " <<
-                   gen1_.count_ << " " << gen1_.threshold_count_ << " | " <<
-                   gen2_.count_ << " " << gen2_.threshold_count_);
+    void GC::ForEachObject(const GCObjectOperation &op)
+    {
+        ForEachNurseryObject(op);
+
+        for (auto gen : { &gen1_, &gen2_, &perm_ })
+        {
+            for (auto obj = gen->gen_; obj; obj = obj->next_)
+                op(obj);
         }
     }
 
+    void GC::Freeze()
+    {
+        // Promote all alived objects in nursery by a full GC, then
+        // nursery is empty and no object is barriered
+        auto promotion_age = promotion_age_;
+        promotion_age_ = 1;
+        RunGC(true);
+        promotion_age_ = promotion_age;
+        assert(gen0_.count_ == 0 && barriered_.empty());
+
+        FreezeGeneration(gen1_);
+        FreezeGeneration(gen2_);
+
+        // All alived objects are permanent now, written permanent objects
+        // do not reference any object outside GCGenPerm
+        for (auto obj : perm_written_)
+            obj->perm_written_ = 0;
+        perm_written_.clear();
+
+        AdjustMajorThreshold();
+    }
+
+    bool GC::StepGC()
+    {
+        bool major = GetOldBytes() >= major_threshold_bytes_;
+        RunGC(major);
+        return major;
+    }
+
+    void GC::RunGC(bool major)
+    {
+        std::size_t gen0_bytes = gen0_.bytes_;
+        std::size_t gen1_bytes = gen1_.bytes_;
+        std::size_t gen2_bytes = gen2_.bytes_;
+
+        auto start = std::chrono::steady_clock::now();
+        if (major)
+            MajorGC();
+        else
+            MinorGC();
+        auto duration = std::chrono::steady_clock::now() - start;
+
+        auto nanoseconds = std::chrono::duration_cast<
+            std::chrono::nanoseconds>(duration).count();
+        if (major)
+        {
+            ++stats_.major_count_;
+            stats_.major_pause_.Record(nanoseconds);
+        }
+        else
+        {
+            ++stats_.minor_count_;
+            stats_.minor_pause_.Record(nanoseconds);
+        }
+
+        GC_LOG((major ? "major" : "minor") << "[" << nanoseconds / 1000 <<
+               " microseconds]: " << gen0_bytes << " | " << gen1_bytes <<
+               " | " << gen2_bytes << " - " << gen0_.bytes_ << " " <<
+               gen0_trigger_bytes_ << " | " << gen1_.bytes_ << " | " <<
+               gen2_.bytes_ << " " << major_threshold_bytes_);
+
+        AdjustLimitTrigger();
+    }
+
     void GC::SetObjectGen(GCObject *obj, GCGeneration gen)
     {
         GenInfo *gen_info = nullptr;
@@ -234,135 +498,521 @@ namespace luna
             case GCGen2:
                 gen_info = &gen2_;
                 break;
+            case GCGenPerm:
+                gen_info = &perm_;
+                break;
         }
 
         assert(gen_info);
 
+        // Objects in nursery are not linked, GC travels nursery regions
         obj->generation_ = gen;
-        obj->next_ = gen_info->gen_;
-        gen_info->gen_ = obj;
+
+        // Permanent objects are always black, so GC never marks them
+        if (gen == GCGenPerm)
+            obj->gc_ = GCFlag_Black;
+        if (gen != GCGen0)
+        {
+            obj->next_ = gen_info->gen_;
+            gen_info->gen_ = obj;
+        }
         gen_info->count_++;
+        gen_info->bytes_ += obj->GetMemorySize();
     }
 
     void GC::MinorGC()
     {
-        unsigned int old_gen1_count = gen1_.count_;
-
         MinorGCMark();
-        MinorGCSweep();
 
-        barriered_.clear();
-
-        // Caculate objects count from gen0_ to gen1_, which is how
-        // many alived objects in gen0_ after mark-sweep, and adjust
-        // gen0_'s threshold count by the alived_gen0_count
-        unsigned int alived_gen0_count = gen1_.count_ - old_gen1_count;
-        AdjustThreshold(alived_gen0_count, gen0_, kGen0InitThresholdCount,
-                        kGen0MaxThresholdCount);
+        // Adjust gen0_'s threshold bytes by alived bytes in gen0_
+        AdjustGen0Threshold(MinorGCSweep());
     }
 
     void GC::MajorGC()
     {
         MajorGCMark();
         MajorGCSweep();
-
-        barriered_.clear();
     }
 
     void GC::MinorGCMark()
     {
         assert(minor_traveller_);
 
-        // Visit all minor GC root objects
-        MinorMarkVisitor marker;
+        // Mark all minor GC root objects
+        minor_mark_ = true;
+        MarkVisitor marker(this);
         minor_traveller_(&marker);
 
-        // Visit all barriered GC objects
-        BarrieredMarkVisitor barriered_maker;
+        // Mark members of all barriered GC objects
         for (auto obj : barriered_)
         {
             // All barriered objects must be GCGen1 or GCGen2.
             assert(obj->generation_ != GCGen0);
+            MarkMembers(obj);
+        }
 
-            // Mark barriered objects, and visitor can visit
-            // member GC objects of barriered objects.
-            obj->gc_ = GCFlag_Black;
-            obj->Accept(&barriered_maker);
+        PropagateMark();
+        ConvergeEphemerons();
+        ClearWeakTables();
+    }
+
+    std::size_t GC::MinorGCSweep()
+    {
+        return EvacuateNursery();
+    }
+
+    void GC::MajorGCMark()
+    {
+        assert(major_traveller_);
+
+        // Mark all major GC root objects
+        minor_mark_ = false;
+        MarkVisitor marker(this);
+        major_traveller_(&marker);
+
+        // Written permanent objects are roots of major GC
+        for (auto obj : perm_written_)
+            MarkMembers(obj);
+
+        PropagateMark();
+        ConvergeEphemerons();
+        ClearWeakTables();
+    }
+
+    void GC::MarkObject(GCObject *obj)
+    {
+        if (obj->gc_ != GCFlag_White)
+            return ;
+        if (minor_mark_ && obj->generation_ != GCGen0)
+            return ;
+
+        obj->gc_ = GCFlag_Black;
+
+        // String has no member GC objects except rope and slice
+        if (obj->gc_obj_type_ != GCObjectType_String ||
+            static_cast<String *>(obj)->HasReferences())
+            gray_stack_.push_back(obj);
+    }
+
+    void GC::MarkValue(const Value &value)
+    {
+        if (value.IsGCObject())
+            MarkObject(value.obj_);
+    }
+
+    void GC::PropagateMark()
+    {
+        while (!gray_stack_.empty())
+        {
+            GCObject *obj = gray_stack_.back();
+            gray_stack_.pop_back();
+
+            // Prefetch next gray object while marking current object
+            if (!gray_stack_.empty())
+                LUNA_PREFETCH(gray_stack_.back());
+
+            MarkMembers(obj);
         }
     }
 
-    void GC::MinorGCSweep()
+    void GC::MarkMembers(GCObject *obj)
     {
-        // Sweep GCGen0
-        while (gen0_.gen_)
+        switch (obj->gc_obj_type_)
         {
-            GCObject *obj = gen0_.gen_;
-            gen0_.gen_ = gen0_.gen_->next_;
+            case GCObjectType_Table:
+                MarkTableMembers(static_cast<Table *>(obj));
+                break;
+            case GCObjectType_Function:
+                MarkFunctionMembers(static_cast<Function *>(obj));
+                break;
+            case GCObjectType_Closure:
+                MarkClosureMembers(static_cast<Closure *>(obj));
+                break;
+            case GCObjectType_Upvalue:
+                MarkUpvalueMembers(static_cast<Upvalue *>(obj));
+                break;
+            case GCObjectType_String:
+                MarkStringMembers(static_cast<String *>(obj));
+                break;
+            case GCObjectType_UserData:
+                MarkUserDataMembers(static_cast<UserData *>(obj));
+                break;
+        }
+    }
 
-            // Move object to GCGen1 generation when object is black
-            if (obj->gc_ == GCFlag_Black)
+    void GC::MarkTableMembers(Table *t)
+    {
+        if (t->mode_ != TableMode_Strong)
+        {
+            MarkWeakTableMembers(t);
+            return ;
+        }
+
+        if (t->array_)
+        {
+            for (const auto &value : *t->array_)
+                MarkValue(value);
+        }
+
+        if (t->hash_)
+        {
+            // Keys of dead nodes are not marked, they are cleared when
+            // the key objects are dead
+            for (const auto &node : *t->hash_)
             {
-                obj->gc_ = GCFlag_White;
-                obj->generation_ = GCGen1;
-                obj->next_ = gen1_.gen_;
-                gen1_.gen_ = obj;
-                gen1_.count_++;
+                if (!node.value_.IsNil())
+                {
+                    MarkValue(node.key_);
+                    MarkValue(node.value_);
+                }
             }
-            else
+
+            if (t->hash_->HasDeadNodes())
+                dead_key_tables_.push_back(t);
+        }
+    }
+
+    void GC::MarkWeakTableMembers(Table *t)
+    {
+        weak_tables_.push_back(t);
+
+        bool weak_key = (t->mode_ & (TableMode_WeakKey | TableMode_Ephemeron)) != 0;
+        bool weak_value = (t->mode_ & TableMode_WeakValue) != 0;
+        bool ephemeron = (t->mode_ & TableMode_Ephemeron) != 0;
+
+        // Keys of array part are numbers
+        if (t->array_ && !weak_value)
+        {
+            for (const auto &value : *t->array_)
+                MarkValue(value);
+        }
+
+        if (t->hash_)
+        {
+            for (const auto &node : *t->hash_)
             {
-                obj_deleter_(obj, obj->gc_obj_type_);
+                if (node.value_.IsNil())
+                    continue;
+
+                // Strings are not weak, mark them always
+                if (!weak_key || node.key_.type_ == ValueT_String)
+                    MarkValue(node.key_);
+
+                if (weak_value && node.value_.type_ != ValueT_String)
+                    continue;
+
+                // Value of ephemeron is marked when key is alive,
+                // otherwise it is marked by ConvergeEphemerons later
+                if (!ephemeron || !IsWeakDead(node.key_))
+                    MarkValue(node.value_);
             }
         }
+    }
 
-        gen0_.count_ = 0;
+    bool GC::IsWeakDead(const Value &value) const
+    {
+        return value.IsGCObject() && value.type_ != ValueT_String &&
+            !IsMarked(value.obj_);
     }
 
-    void GC::MajorGCMark()
+    void GC::ConvergeEphemerons()
     {
-        assert(major_traveller_);
+        bool marked = true;
+        while (marked)
+        {
+            marked = false;
 
-        // Visit all major GC root objects
-        MajorMarkVisitor marker;
-        major_traveller_(&marker);
+            // Marking may find new weak tables, so iterate by index
+            for (std::size_t i = 0; i < weak_tables_.size(); ++i)
+            {
+                auto t = weak_tables_[i];
+                if (t->mode_ != TableMode_Ephemeron || !t->hash_)
+                    continue;
+
+                for (const auto &node : *t->hash_)
+                {
+                    if (!IsWeakDead(node.key_) && IsWeakDead(node.value_))
+                    {
+                        MarkValue(node.value_);
+                        marked = true;
+                    }
+                }
+            }
+
+            PropagateMark();
+        }
+    }
+
+    void GC::ClearWeakTables()
+    {
+        for (auto t : weak_tables_)
+        {
+            bool weak_key = (t->mode_ & (TableMode_WeakKey | TableMode_Ephemeron)) != 0;
+            bool weak_value = (t->mode_ & TableMode_WeakValue) != 0;
+
+            if (t->array_ && weak_value)
+            {
+                for (auto &value : *t->array_)
+                {
+                    if (IsWeakDead(value))
+                        value.SetNil();
+                }
+            }
+
+            // Nodes are kept as dead nodes, so traversal of the table
+            // is not broken by GC
+            if (t->hash_)
+            {
+                auto &hash = *t->hash_;
+                for (std::size_t i = 0; i < hash.GetNodeCount(); ++i)
+                {
+                    const auto &node = hash.GetNode(i);
+                    if ((weak_key && IsWeakDead(node.key_)) ||
+                        (weak_value && IsWeakDead(node.value_)))
+                        hash.SetNodeValue(i, Value());
+                }
+                ClearDeadKeys(t);
+            }
+        }
+
+        weak_tables_.clear();
+
+        for (auto t : dead_key_tables_)
+            ClearDeadKeys(t);
+        dead_key_tables_.clear();
+    }
+
+    void GC::ClearDeadKeys(Table *t)
+    {
+        t->hash_->ClearDeadKeys([this](const Value &key) {
+            return key.IsGCObject() && !IsMarked(key.obj_);
+        });
+    }
+
+    void GC::MarkFunctionMembers(Function *f)
+    {
+        if (f->module_)
+            MarkObject(f->module_);
+        if (f->superior_)
+            MarkObject(f->superior_);
+
+        for (const auto &value : f->const_values_)
+            MarkValue(value);
+
+        for (const auto &var : f->local_vars_)
+            MarkObject(var.name_);
+
+        for (auto child : f->child_funcs_)
+            MarkObject(child);
+
+        for (const auto &upvalue : f->upvalues_)
+            MarkObject(upvalue.name_);
+    }
+
+    void GC::MarkClosureMembers(Closure *c)
+    {
+        MarkObject(c->prototype_);
+
+        for (auto upvalue : c->upvalues_)
+            MarkObject(upvalue);
+    }
+
+    void GC::MarkUpvalueMembers(Upvalue *u)
+    {
+        MarkValue(u->value_);
+    }
+
+    void GC::MarkStringMembers(String *s)
+    {
+        if (s->IsRope())
+        {
+            auto children = s->GetRopeChildren();
+            MarkObject(children[0]);
+            MarkObject(children[1]);
+        }
+        else if (s->IsSlice())
+        {
+            MarkObject(s->GetSlice()->str_);
+        }
+    }
+
+    void GC::MarkUserDataMembers(UserData *u)
+    {
+        if (u->metatable_)
+            MarkObject(u->metatable_);
     }
 
     void GC::MajorGCSweep()
     {
-        // Sweep all generations
+        // Dead barriered objects will be deleted by sweeping, remove them
+        // from barriered list before that
+        auto dead = std::remove_if(barriered_.begin(), barriered_.end(),
+                                   [](GCObject *obj) { return obj->gc_ == GCFlag_White; });
+        barriered_.erase(dead, barriered_.end());
+
+        // Sweep old generations
         SweepGeneration(gen2_);
         SweepGeneration(gen1_);
-        SweepGeneration(gen0_);
 
-        // Move all GCGen0 objects to GCGen1
-        while (gen0_.gen_)
+        // Sweep GCGen0, and move all alived objects to GCGen1
+        AdjustGen0Threshold(EvacuateNursery());
+        AdjustMajorThreshold();
+    }
+
+    std::size_t GC::EvacuateNursery()
+    {
+        GCObject *new_gen1_end = gen1_.gen_;
+        gen0_.count_ = 0;
+        gen0_.bytes_ = 0;
+
+        std::size_t alived_bytes = 0;
+        ForEachNurseryObject([this, &alived_bytes](GCObject *obj) {
+            if (obj->gc_ == GCFlag_Black)
+            {
+                // Promote object when it survived enough GCs
+                auto gen = obj->age_ + 1u >= promotion_age_ ? GCGen1 : GCGen0;
+                alived_bytes += MoveObject(obj, gen)->GetMemorySize();
+            }
+            else
+            {
+                DestroyObject(obj);
+            }
+        });
+
+        // Survivor regions become nursery, the old nursery regions are
+        // reused as survivor regions in next GC
+        std::swap(nursery_, survivor_);
+        std::swap(nursery_index_, survivor_index_);
+
+        // Update references to new addresses before old nursery reused
+        UpdateReferences(new_gen1_end);
+        UpdateBarriered(new_gen1_end);
+
+        ResetRegions(survivor_, survivor_index_);
+        return alived_bytes;
+    }
+
+    template<typename T>
+    T * GC::NewMovedObject(T *obj, GCGeneration gen)
+    {
+        if (gen == GCGen0)
         {
-            GCObject *obj = gen0_.gen_;
-            gen0_.gen_ = gen0_.gen_->next_;
+            void *mem = AllocRegion(survivor_, survivor_index_, sizeof(T));
+            return new (mem) T(std::move(*obj));
+        }
+        else
+        {
+            return new T(std::move(*obj));
+        }
+    }
 
-            obj->generation_ = GCGen1;
-            obj->next_ = gen1_.gen_;
-            gen1_.gen_ = obj;
+    String * GC::NewMovedString(String *s, GCGeneration gen)
+    {
+        auto size = s->GetAllocSize();
+        void *mem = gen == GCGen0 ?
+            AllocRegion(survivor_, survivor_index_, size) : ::operator new(size);
+        return String::ConstructMoved(mem, s);
+    }
+
+    GCObject * GC::MoveObject(GCObject *obj, GCGeneration gen)
+    {
+        GCObject *new_obj = nullptr;
+        switch (obj->gc_obj_type_)
+        {
+            case GCObjectType_Table:
+                new_obj = NewMovedObject(static_cast<Table *>(obj), gen);
+                break;
+            case GCObjectType_Function:
+                new_obj = NewMovedObject(static_cast<Function *>(obj), gen);
+                break;
+            case GCObjectType_Closure:
+                new_obj = NewMovedObject(static_cast<Closure *>(obj), gen);
+                break;
+            case GCObjectType_Upvalue:
+                new_obj = NewMovedObject(static_cast<Upvalue *>(obj), gen);
+                break;
+            case GCObjectType_String:
+                new_obj = NewMovedString(static_cast<String *>(obj), gen);
+                break;
+            case GCObjectType_UserData:
+                new_obj = NewMovedObject(static_cast<UserData *>(obj), gen);
+                break;
         }
 
-        // Adjust GCGen0 threshold count
-        AdjustThreshold(gen0_.count_, gen0_, kGen0InitThresholdCount,
-                        kGen0MaxThresholdCount);
+        assert(new_obj);
 
-        gen1_.count_ += gen0_.count_;
-        gen0_.count_ = 0;
+        // The old object is forwarded to new object, it is not destroyed,
+        // all resources of it have been moved to new object
+        obj->forwarded_ = 1;
+        obj->next_ = new_obj;
+
+        new_obj->gc_ = GCFlag_White;
+        new_obj->age_ = gen == GCGen0 ? obj->age_ + 1 : 0;
+        SetObjectGen(new_obj, gen);
 
-        // Adjust GCGen1 threshold count
-        AdjustThreshold(gen1_.count_, gen1_, kGen1InitThresholdCount,
-                        kGen1MaxThresholdCount);
-        if (gen1_.count_ >= kGen1MaxThresholdCount)
+        if (gen == GCGen1)
         {
-            gen1_.threshold_count_ = gen1_.count_ + kGen1MaxThresholdCount;
+            ++stats_.promoted_objects_;
+            stats_.promoted_bytes_ += new_obj->GetMemorySize();
         }
+
+        obj_mover_(obj, new_obj, new_obj->gc_obj_type_);
+        if (new_obj->sampled_ && sampler_)
+            sampler_->Move(obj, new_obj);
+        return new_obj;
+    }
+
+    void GC::UpdateReferences(GCObject *new_gen1_end)
+    {
+        assert(root_updater_);
+
+        // Only roots, barriered objects and objects moved by GC can
+        // reference objects moved by GC
+        root_updater_();
+
+        for (auto obj : barriered_)
+            obj->UpdateReferences();
+
+        for (auto obj = gen1_.gen_; obj != new_gen1_end; obj = obj->next_)
+            obj->UpdateReferences();
+
+        ForEachNurseryObject([](GCObject *obj) { obj->UpdateReferences(); });
+    }
+
+    void GC::UpdateBarriered(GCObject *new_gen1_end)
+    {
+        std::deque<GCObject *> barriered;
+        barriered.swap(barriered_);
+
+        for (auto obj : barriered)
+            obj->barriered_ = 0;
+
+        // No old object references nursery when nursery is empty
+        if (gen0_.count_ == 0)
+            return ;
+
+        auto remember = [this](GCObject *obj) {
+            YoungReferenceVisitor visitor;
+            obj->Accept(&visitor);
+            if (visitor.HasYoungReference())
+            {
+                obj->barriered_ = 1;
+                barriered_.push_back(obj);
+                ++stats_.remembered_count_;
+            }
+        };
+
+        for (auto obj : barriered)
+            remember(obj);
+
+        for (auto obj = gen1_.gen_; obj != new_gen1_end; obj = obj->next_)
+            remember(obj);
     }
 
     void GC::SweepGeneration(GenInfo &gen)
     {
         GCObject *alived = nullptr;
+        gen.bytes_ = 0;
 
         while (gen.gen_)
         {
@@ -374,10 +1024,11 @@ namespace luna
                 obj->gc_ = GCFlag_White;
                 obj->next_ = alived;
                 alived = obj;
+                gen.bytes_ += obj->GetMemorySize();
             }
             else
             {
-                obj_deleter_(obj, obj->gc_obj_type_);
+                DestroyObject(obj);
                 gen.count_--;
             }
         }
@@ -385,22 +1036,96 @@ namespace luna
         gen.gen_ = alived;
     }
 
-    void GC::AdjustThreshold(unsigned int alived_count, GenInfo &gen,
-                             unsigned int min_threshold,
-                             unsigned int max_threshold)
+    void GC::FreezeGeneration(GenInfo &gen)
     {
-        if (alived_count != 0)
+        while (gen.gen_)
         {
-            while (gen.threshold_count_ < 2 * alived_count)
-                gen.threshold_count_ *= 2;
-            while (gen.threshold_count_ >= 4 * alived_count)
-                gen.threshold_count_ /= 2;
+            GCObject *obj = gen.gen_;
+            gen.gen_ = obj->next_;
+
+            obj->generation_ = GCGenPerm;
+            obj->gc_ = GCFlag_Black;
+            obj->next_ = perm_.gen_;
+            perm_.gen_ = obj;
         }
 
-        if (gen.threshold_count_ < min_threshold)
-            gen.threshold_count_ = min_threshold;
-        else if (gen.threshold_count_ > max_threshold)
-            gen.threshold_count_ = max_threshold;
+        perm_.count_ += gen.count_;
+        perm_.bytes_ += gen.bytes_;
+        gen.count_ = 0;
+        gen.bytes_ = 0;
+    }
+
+    void GC::DestroyObject(GCObject *obj)
+    {
+        auto &stats = stats_.gens_[obj->generation_];
+        ++stats.freed_objects_;
+        stats.freed_bytes_ += obj->GetMemorySize();
+
+        obj_finalizer_(obj, obj->gc_obj_type_);
+        if (obj->sampled_ && sampler_)
+            sampler_->Free(obj);
+
+        // Object in nursery just call destructor, nursery own the memory
+        if (obj->generation_ == GCGen0)
+            obj->~GCObject();
+        else
+            delete obj;
+    }
+
+    void GC::AdjustGen0Threshold(std::size_t alived_bytes)
+    {
+        if (alived_bytes != 0)
+        {
+            while (gen0_threshold_bytes_ < 2 * alived_bytes)
+                gen0_threshold_bytes_ *= 2;
+            while (gen0_threshold_bytes_ >= 4 * alived_bytes)
+                gen0_threshold_bytes_ /= 2;
+        }
+
+        if (gen0_threshold_bytes_ < kGen0MinThresholdBytes)
+            gen0_threshold_bytes_ = kGen0MinThresholdBytes;
+        else if (gen0_threshold_bytes_ > kGen0MaxThresholdBytes)
+            gen0_threshold_bytes_ = kGen0MaxThresholdBytes;
+
+        gen0_trigger_bytes_ = gen0_threshold_bytes_ * 100 / step_multiplier_;
+    }
+
+    void GC::AdjustMajorThreshold()
+    {
+        auto threshold = static_cast<std::size_t>(GetOldBytes() * growth_factor_);
+        if (threshold < kMajorMinThresholdBytes)
+            threshold = kMajorMinThresholdBytes;
+        major_threshold_bytes_ = threshold;
+    }
+
+    void GC::CheckHeapLimit(bool major_done)
+    {
+        if (heap_limit_ == 0 || GetHeapBytes() <= heap_limit_)
+            return ;
+
+        // Emergency full GC to free all dead objects
+        if (!major_done)
+        {
+            GC_LOG("emergency major: " << GetHeapBytes() << " " << heap_limit_);
+            RunGC(true);
+        }
+
+        if (GetHeapBytes() > heap_limit_)
+            ThrowOutOfMemory();
+    }
+
+    void GC::ThrowOutOfMemory() const
+    {
+        throw OutOfMemory(GetHeapBytes(), heap_limit_);
+    }
+
+    void GC::AdjustLimitTrigger()
+    {
+        auto heap_bytes = GetHeapBytes();
+        if (heap_bytes < heap_limit_)
+            limit_trigger_bytes_ = heap_bytes + (heap_limit_ - heap_bytes) / 2;
+        else
+            limit_trigger_bytes_ = heap_limit_;
     }
 
     void GC::DestroyGeneration(GenInfo &gen)
@@ -409,8 +1134,26 @@ namespace luna
         {
             GCObject *obj = gen.gen_;
             gen.gen_ = gen.gen_->next_;
-            obj_deleter_(obj, obj->gc_obj_type_);
+            DestroyObject(obj);
         }
         gen.count_ = 0;
+        gen.bytes_ = 0;
+    }
+
+    std::size_t GC::NurseryObjectSize(const GCObject *obj)
+    {
+        switch (obj->gc_obj_type_)
+        {
+            case GCObjectType_Table: return sizeof(Table);
+            case GCObjectType_Function: return sizeof(Function);
+            case GCObjectType_Closure: return sizeof(Closure);
+            case GCObjectType_Upvalue: return sizeof(Upvalue);
+            case GCObjectType_String:
+                return static_cast<const String *>(obj)->GetAllocSize();
+            case GCObjectType_UserData: return sizeof(UserData);
+        }
+
+        assert(0);
+        return 0;
     }
 } // namespace luna
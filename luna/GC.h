@@ -1,7 +1,11 @@
 #ifndef GC_OBJECT_H
 #define GC_OBJECT_H
 
+#include "GCStatistics.h"
 #include <functional>
+#include <cstddef>
+#include <memory>
+#include <vector>
 #include <deque>
 #include <fstream>
 
@@ -13,6 +17,7 @@ namespace luna
         GCGen0,         // Youngest generation
         GCGen1,         // Mesozoic generation
         GCGen2,         // Oldest generation
+        GCGenPerm,      // Permanent generation, never traced or swept
     };
 
     // GC flag for mark GC object
@@ -39,6 +44,7 @@ namespace luna
     class Upvalue;
     class String;
     class UserData;
+    struct Value;
 
     // Visitor for visit all GC objects
     class GCObjectVisitor
@@ -58,18 +64,46 @@ namespace luna
     class GCObject
     {
         friend class GC;
-        friend class MinorMarkVisitor;
-        friend class BarrieredMarkVisitor;
-        friend class MajorMarkVisitor;
+        friend class YoungReferenceVisitor;
         friend bool CheckBarrier(GCObject *);
     public:
         GCObject();
+        GCObject(const GCObject &) = default;
         virtual ~GCObject() = 0;
 
         virtual void Accept(GCObjectVisitor *) = 0;
 
+        // Update addresses of member GC objects which have been moved
+        // out of nursery by GC
+        virtual void UpdateReferences() = 0;
+
+        // Estimated memory size of this object, including the memory
+        // owned by this object, such as array and hash part of table
+        virtual std::size_t GetMemorySize() const = 0;
+
+        // Return true when this object has been moved by GC
+        bool IsForwarded() const
+        { return forwarded_ != 0; }
+
+        // Get new address of this object after it has been moved by GC
+        GCObject * GetForwarded() const
+        { return next_; }
+
+        // Identity hash of object, it is not changed when object moved
+        std::size_t GetObjectHash() const
+        { return obj_hash_; }
+
+        // Get GCGeneration of object
+        unsigned int GetGeneration() const
+        { return generation_; }
+
+        // Get GCObjectType of object
+        unsigned int GetObjectType() const
+        { return gc_obj_type_; }
+
     private:
-        // Pointing next GCObject in current generation
+        // Pointing next GCObject in current generation, or pointing to
+        // the new address of the object when it is forwarded
         GCObject *next_;
         // Generation flag
         unsigned int generation_ : 2;
@@ -77,51 +111,196 @@ namespace luna
         unsigned int gc_ : 2;
         // GCObjectType
         unsigned int gc_obj_type_ : 4;
+        // Object has been moved, next_ is the new address
+        unsigned int forwarded_ : 1;
+        // Object is in barriered list
+        unsigned int barriered_ : 1;
+        // Count of minor GCs which object survived in nursery
+        unsigned int age_ : 4;
+        // Permanent object has been written after it was frozen
+        unsigned int perm_written_ : 1;
+        // Object is sampled by allocation sampler
+        unsigned int sampled_ : 1;
+        // Identity hash of object, assigned by GC when allocated
+        unsigned int obj_hash_;
     };
 
+    // Update obj to the new address when it has been moved by GC
+    template<typename T>
+    inline void UpdateReference(T *&obj)
+    {
+        if (obj && obj->IsForwarded())
+            obj = static_cast<T *>(obj->GetForwarded());
+    }
+
     // GC object barrier checker
     inline bool CheckBarrier(GCObject *obj) { return obj->generation_ != GCGen0; }
     #define CHECK_BARRIER(gc, obj) \
         do { if (luna::CheckBarrier(obj)) gc.SetBarrier(obj); } while (0)
 
+    // Sampler of GC allocations, GC samples an object every sample
+    // bytes allocated, then notifies the sampler when the sampled
+    // object moved or freed
+    class AllocSampler
+    {
+    public:
+        virtual ~AllocSampler() { }
+
+        // obj is sampled, it represents bytes allocated
+        virtual void Sample(GCObject *obj, std::size_t bytes) = 0;
+        // Sampled object moved from old_obj to new_obj
+        virtual void Move(GCObject *old_obj, GCObject *new_obj) = 0;
+        // Sampled object is freed
+        virtual void Free(GCObject *obj) = 0;
+    };
+
     class GC
     {
+        friend class MarkVisitor;
     public:
         typedef std::function<void (GCObjectVisitor *)> RootTravelType;
-        typedef std::function<void (GCObject *, unsigned int)> GCObjectDeleter;
+        typedef std::function<void ()> RootUpdateType;
+        // Finalizer is called before GC destroy the dead object
+        typedef std::function<void (GCObject *, unsigned int)> GCObjectFinalizer;
+        // Mover is called after GC moved the object from the old address
+        // to the new address
+        typedef std::function<void (GCObject *, GCObject *, unsigned int)> GCObjectMover;
+        // Operation on each GC object
+        typedef std::function<void (GCObject *)> GCObjectOperation;
+
+        struct DefaultFinalizer
+        {
+            inline void operator () (GCObject *, unsigned int) const { }
+        };
 
-        struct DefaultDeleter
+        struct DefaultMover
         {
-            inline void operator () (GCObject *obj, unsigned int) const
-            { delete obj; }
+            inline void operator () (GCObject *, GCObject *, unsigned int) const { }
         };
 
-        explicit GC(const GCObjectDeleter &obj_deleter = DefaultDeleter(), bool log = false);
+        explicit GC(const GCObjectFinalizer &obj_finalizer = DefaultFinalizer(),
+                    bool log = false);
         ~GC();
 
         GC(const GC&) = delete;
         void operator = (const GC&) = delete;
 
-        void ResetDeleter(const GCObjectDeleter &obj_deleter = DefaultDeleter())
-        { obj_deleter_ = obj_deleter; }
+        void ResetFinalizer(const GCObjectFinalizer &obj_finalizer = DefaultFinalizer())
+        { obj_finalizer_ = obj_finalizer; }
+
+        void SetMover(const GCObjectMover &obj_mover = DefaultMover())
+        { obj_mover_ = obj_mover; }
+
+        // Set allocation sampler which samples an object every
+        // sample_bytes allocated. When sample_bytes is 0, no object is
+        // sampled, and sampler still tracks moved and freed objects which
+        // were sampled. nullptr removes sampler.
+        void SetAllocSampler(AllocSampler *sampler, std::size_t sample_bytes = 0);
 
         // Set minor and major root travel functions
         void SetRootTraveller(const RootTravelType &minor, const RootTravelType &major);
 
+        // Set root update function, GC calls it to update all root
+        // references after objects moved out of nursery
+        void SetRootUpdater(const RootUpdateType &updater);
+
         // Alloc GC objects
         Table * NewTable(GCGeneration gen = GCGen0);
         Function * NewFunction(GCGeneration gen = GCGen2);
         Closure * NewClosure(GCGeneration gen = GCGen0);
         Upvalue * NewUpvalue(GCGeneration gen = GCGen0);
-        String * NewString(GCGeneration gen = GCGen0);
+        // New empty string which has inline storage for length bytes
+        String * NewString(GCGeneration gen = GCGen0, std::size_t length = 0);
         UserData * NewUserData(GCGeneration gen = GCGen0);
 
         // Set GC object barrier
         void SetBarrier(GCObject *obj);
 
+        // Owned memory of obj is increased(or decreased when delta is
+        // negative) delta bytes after it was allocated
+        void ChangeObjectMemory(const GCObject *obj, std::ptrdiff_t delta)
+        {
+            GetGenInfo(obj->generation_).bytes_ += delta;
+            auto &stats = stats_.gens_[obj->generation_];
+            if (delta > 0)
+            {
+                stats.alloc_bytes_ += delta;
+                CheckAllocLimit();
+            }
+            else
+                stats.freed_bytes_ += -delta;
+        }
+
+        // Set heap growth factor, major GC runs when heap bytes of old
+        // generations grow to factor times of alived bytes after the
+        // last major GC
+        void SetGrowthFactor(double factor);
+        double GetGrowthFactor() const
+        { return growth_factor_; }
+
+        // Set step multiplier in percent, minor GC runs more frequently
+        // when multiplier is larger, nursery threshold bytes is scaled by
+        // 100 / multiplier, default multiplier is 100
+        void SetStepMultiplier(unsigned int multiplier);
+        unsigned int GetStepMultiplier() const
+        { return step_multiplier_; }
+
+        // Set hard heap limit bytes, 0 means no limit. GC runs a full GC
+        // before heap bytes reach the limit, and throws OutOfMemory when
+        // heap bytes still exceed the limit after the full GC, or when an
+        // allocation makes heap bytes exceed the limit
+        void SetHeapLimit(std::size_t limit);
+
+        // Set how many GCs objects need to survive in nursery before
+        // they are promoted to GCGen1, age is in [1, kMaxPromotionAge]
+        void SetPromotionAge(unsigned int age);
+
+        // Get current heap bytes of all generations
+        std::size_t GetHeapBytes() const
+        { return gen0_.bytes_ + gen1_.bytes_ + gen2_.bytes_ + perm_.bytes_; }
+
+        // Get current objects count and bytes of generation
+        unsigned int GetObjectCount(GCGeneration gen) const;
+        std::size_t GetObjectBytes(GCGeneration gen) const;
+
+        // Get statistics of GC
+        const GCStatistics & GetStatistics() const
+        { return stats_; }
+
+        // Reset all statistics of GC
+        void ResetStatistics()
+        { stats_ = GCStatistics(); }
+
         // Check run GC
         void CheckGC();
 
+        // Run a full GC now
+        void FullGC();
+
+        // Run a GC step now, it is a major GC when old generations reach
+        // the major GC threshold, otherwise it is a minor GC.
+        // Return true when the step is a major GC
+        bool StepGC();
+
+        // Call op for each object of all generations, op must not
+        // allocate GC objects
+        void ForEachObject(const GCObjectOperation &op);
+
+        // Freeze all alived objects into GCGenPerm, frozen objects are
+        // never traced or swept again and live until GC destroyed.
+        // Usually called after startup data(libraries, modules and
+        // constant tables) loaded
+        void Freeze();
+
+        // Stop and restart automatic GC of CheckGC, heap limit is still
+        // checked when automatic GC is stopped
+        void Stop()
+        { running_ = false; }
+        void Restart()
+        { running_ = true; }
+        bool IsRunning() const
+        { return running_; }
+
     private:
         struct GenInfo
         {
@@ -129,38 +308,191 @@ namespace luna
             GCObject *gen_;
             // Count of GC objects
             unsigned int count_;
-            // Current threshold count of GC objects
-            unsigned int threshold_count_;
+            // Bytes of GC objects
+            std::size_t bytes_;
+
+            GenInfo() : gen_(nullptr), count_(0), bytes_(0) { }
+        };
+
+        GenInfo & GetGenInfo(unsigned int gen)
+        { return const_cast<GenInfo &>(static_cast<const GC *>(this)->GetGenInfo(gen)); }
+
+        const GenInfo & GetGenInfo(unsigned int gen) const
+        {
+            switch (gen)
+            {
+                case GCGen0: return gen0_;
+                case GCGen1: return gen1_;
+                case GCGen2: return gen2_;
+                default: return perm_;
+            }
+        }
+
+        // Bytes of old generations
+        std::size_t GetOldBytes() const
+        { return gen1_.bytes_ + gen2_.bytes_; }
+
+        // Nursery region, GCGen0 objects are bump allocated in regions
+        struct NurseryRegion
+        {
+            // Region memory
+            std::unique_ptr<char[]> buffer_;
+            // Bump pointer of free memory
+            char *top_;
 
-            GenInfo() : gen_(nullptr), count_(0), threshold_count_(0) { }
+            NurseryRegion();
         };
 
+        // Allocate GC object of type T in generation gen
+        template<typename T>
+        T * NewObject(GCObjectType type, GCGeneration gen);
+
+        // Set type, generation and identity hash of new obj, and count
+        // bytes of it
+        void InitObject(GCObject *obj, GCObjectType type,
+                        GCGeneration gen, std::size_t bytes);
+
+        // Allocate memory from nursery
+        void * AllocNursery(std::size_t size);
+
+        // Count bytes of new obj, and sample it when reach sample bytes
+        void SampleAllocation(GCObject *obj, std::size_t bytes);
+
+        // Allocate memory from regions, index is the current allocating
+        // region index of regions
+        static void * AllocRegion(std::vector<NurseryRegion> &regions,
+                                  std::size_t &index, std::size_t size);
+
+        // Reset all regions to empty
+        static void ResetRegions(std::vector<NurseryRegion> &regions,
+                                 std::size_t &index);
+
+        // Call op for each object in nursery
+        template<typename Op>
+        void ForEachNurseryObject(const Op &op);
+
         void SetObjectGen(GCObject *obj, GCGeneration gen);
 
+        // Run major GC when major is true, otherwise run minor GC,
+        // and record statistics of the GC
+        void RunGC(bool major);
+
         // Run minor and major GC
         void MinorGC();
         void MajorGC();
 
         void MinorGCMark();
-        void MinorGCSweep();
+        std::size_t MinorGCSweep();
 
         void MajorGCMark();
         void MajorGCSweep();
 
+        // Mark obj black and push it to gray stack when it is white,
+        // minor GC only marks objects in GCGen0
+        void MarkObject(GCObject *obj);
+        void MarkValue(const Value &value);
+
+        // Mark members of gray objects until gray stack is empty
+        void PropagateMark();
+
+        // Object is alive after marking or not, objects not in
+        // GCGen0 are alive in minor GC
+        bool IsMarked(const GCObject *obj) const
+        { return obj->gc_ == GCFlag_Black || (minor_mark_ && obj->generation_ != GCGen0); }
+
+        // Value is weak referenced by weak tables and not alive
+        bool IsWeakDead(const Value &value) const;
+
+        // Mark values of ephemeron tables which keys are alive, until
+        // no more value is marked
+        void ConvergeEphemerons();
+
+        // Remove entries of dead weak keys or values from weak tables,
+        // and clear dead keys of tables found in marking
+        void ClearWeakTables();
+
+        // Clear keys of dead nodes in table which key objects are not
+        // marked, they are freed after marking
+        void ClearDeadKeys(Table *t);
+
+        // Mark members of obj by its type
+        void MarkMembers(GCObject *obj);
+        void MarkTableMembers(Table *t);
+        void MarkWeakTableMembers(Table *t);
+        void MarkFunctionMembers(Function *f);
+        void MarkClosureMembers(Closure *c);
+        void MarkUpvalueMembers(Upvalue *u);
+        void MarkStringMembers(String *s);
+        void MarkUserDataMembers(UserData *u);
+
+        // Copy black objects to survivor regions of nursery, or move them
+        // to GCGen1 when they are old enough, and destroy all white objects
+        // in nursery, then update references and barriered objects.
+        // Return alived bytes of nursery
+        std::size_t EvacuateNursery();
+
+        // Move obj to survivor regions(GCGen0) or GCGen1, return the
+        // new address
+        GCObject * MoveObject(GCObject *obj, GCGeneration gen);
+
+        // Construct a new object of type T from obj in generation gen
+        template<typename T>
+        T * NewMovedObject(T *obj, GCGeneration gen);
+        String * NewMovedString(String *s, GCGeneration gen);
+
+        // Update references of roots, barriered objects and objects
+        // moved by GC, new_gen1_end is the first old object in GCGen1
+        // before nursery evacuated
+        void UpdateReferences(GCObject *new_gen1_end);
+
+        // Rebuild barriered objects list, only keep the old objects which
+        // still reference objects in nursery
+        void UpdateBarriered(GCObject *new_gen1_end);
+
+        // Sweep dead objects of gen, and recount bytes of alived objects
         void SweepGeneration(GenInfo &gen);
 
-        // Adjust GenInfo's threshold_count_ by alived_count
-        void AdjustThreshold(unsigned int alived_count, GenInfo &gen,
-                             unsigned int min_threshold,
-                             unsigned int max_threshold);
+        // Move all objects of gen to GCGenPerm
+        void FreezeGeneration(GenInfo &gen);
+
+        // Destroy the dead object
+        void DestroyObject(GCObject *obj);
+
+        // Adjust nursery threshold bytes by alived bytes of nursery
+        void AdjustGen0Threshold(std::size_t alived_bytes);
+
+        // Adjust major GC threshold bytes by alived bytes of old
+        // generations
+        void AdjustMajorThreshold();
+
+        // Run full GC when heap bytes exceed heap limit, throw
+        // OutOfMemory when heap bytes still exceed the limit
+        void CheckHeapLimit(bool major_done);
+
+        // Objects can not be moved or freed while allocating, so throw
+        // OutOfMemory when allocation makes heap bytes exceed the limit
+        void CheckAllocLimit()
+        {
+            if (heap_limit_ != 0 && GetHeapBytes() > heap_limit_)
+                ThrowOutOfMemory();
+        }
+        void ThrowOutOfMemory() const;
+
+        // Adjust heap bytes to run full GC before heap limit is reached
+        void AdjustLimitTrigger();
 
         // Delete generation all objects
         void DestroyGeneration(GenInfo &gen);
 
-        static const unsigned int kGen0InitThresholdCount = 512;
-        static const unsigned int kGen1InitThresholdCount = 512;
-        static const unsigned int kGen0MaxThresholdCount = 2048;
-        static const unsigned int kGen1MaxThresholdCount = 102400;
+        // Get allocated size of object in nursery
+        static std::size_t NurseryObjectSize(const GCObject *obj);
+
+        static const std::size_t kGen0MinThresholdBytes = 64 * 1024;
+        static const std::size_t kGen0MaxThresholdBytes = 1024 * 1024;
+        static const std::size_t kMajorMinThresholdBytes = 1024 * 1024;
+        static const std::size_t kNurseryRegionSize = 64 * 1024;
+        static const std::size_t kMaxNurseryInlineSize = 4 * 1024;
+        static const unsigned int kMaxPromotionAge = 15;
 
         // Youngest generation
         GenInfo gen0_;
@@ -168,17 +500,78 @@ namespace luna
         GenInfo gen1_;
         // Oldest generation
         GenInfo gen2_;
+        // Permanent generation
+        GenInfo perm_;
+
+        // Threshold bytes of GCGen0 adjusted by alived bytes
+        std::size_t gen0_threshold_bytes_;
+        // Bytes of GCGen0 to run minor GC, it is gen0_threshold_bytes_
+        // scaled by step multiplier
+        std::size_t gen0_trigger_bytes_;
+        // Step multiplier in percent
+        unsigned int step_multiplier_;
+        // Automatic GC is running or not
+        bool running_;
+        // Threshold bytes of old generations to run major GC
+        std::size_t major_threshold_bytes_;
+        // Heap growth factor of old generations
+        double growth_factor_;
+        // Hard limit bytes of heap, 0 means no limit
+        std::size_t heap_limit_;
+        // Heap bytes to run full GC, it keeps half of free bytes under
+        // heap limit for allocations between two checks of GC
+        std::size_t limit_trigger_bytes_;
+        // Age of objects promoted to GCGen1
+        unsigned int promotion_age_;
 
         // Minor root traveller
         RootTravelType minor_traveller_;
         // Major root traveller
         RootTravelType major_traveller_;
+        // Root updater
+        RootUpdateType root_updater_;
+
+        // Nursery regions of GCGen0
+        std::vector<NurseryRegion> nursery_;
+        // Current allocating region index of nursery
+        std::size_t nursery_index_;
+        // Survivor regions which survived objects are copied to,
+        // it is swapped with nursery_ after GC
+        std::vector<NurseryRegion> survivor_;
+        // Current allocating region index of survivor regions
+        std::size_t survivor_index_;
 
         // Barriered GC objects
         std::deque<GCObject *> barriered_;
-
-        // GC object Deleter
-        GCObjectDeleter obj_deleter_;
+        // Permanent objects written after frozen, they may reference
+        // objects which are not permanent, so major GC marks members
+        // of them
+        std::vector<GCObject *> perm_written_;
+        // Gray objects which members are not marked yet
+        std::vector<GCObject *> gray_stack_;
+        // Weak tables found in marking
+        std::vector<Table *> weak_tables_;
+        // Tables which have dead nodes found in marking
+        std::vector<Table *> dead_key_tables_;
+        // Marking for minor GC or major GC
+        bool minor_mark_;
+
+        // Statistics of GC
+        GCStatistics stats_;
+
+        // GC object finalizer
+        GCObjectFinalizer obj_finalizer_;
+        // GC object mover
+        GCObjectMover obj_mover_;
+        // Allocation sampler
+        AllocSampler *sampler_;
+        // Bytes between two samples
+        std::size_t sample_bytes_;
+        // Remain bytes to allocate before next sample
+        std::size_t sample_countdown_;
+        // Count of allocated objects, identity hash of objects is mixed
+        // from it
+        unsigned int obj_hash_counter_;
         // Log file
         std::ofstream log_stream_;
     };
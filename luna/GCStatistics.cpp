@@ -0,0 +1,111 @@
+#include "GCStatistics.h"
+#include <math.h>
+
+namespace luna
+{
+    PauseHistogram::PauseHistogram()
+    {
+        Reset();
+    }
+
+    void PauseHistogram::Record(unsigned long long nanoseconds)
+    {
+        ++buckets_[BucketIndex(nanoseconds)];
+
+        if (count_ == 0 || nanoseconds < min_)
+            min_ = nanoseconds;
+        if (nanoseconds > max_)
+            max_ = nanoseconds;
+
+        ++count_;
+        total_ += nanoseconds;
+    }
+
+    void PauseHistogram::Reset()
+    {
+        for (auto &bucket : buckets_)
+            bucket = 0;
+        count_ = 0;
+        total_ = 0;
+        min_ = 0;
+        max_ = 0;
+    }
+
+    double PauseHistogram::GetMin() const
+    {
+        return min_ / 1000.0;
+    }
+
+    double PauseHistogram::GetMax() const
+    {
+        return max_ / 1000.0;
+    }
+
+    double PauseHistogram::GetAverage() const
+    {
+        return count_ == 0 ? 0.0 : static_cast<double>(total_) / count_ / 1000.0;
+    }
+
+    double PauseHistogram::GetPercentile(double p) const
+    {
+        if (count_ == 0)
+            return 0.0;
+
+        auto rank = static_cast<unsigned long long>(ceil(p * count_));
+        if (rank < 1)
+            rank = 1;
+
+        unsigned long long count = 0;
+        for (std::size_t i = 0; i < kBucketCount; ++i)
+        {
+            count += buckets_[i];
+            if (count >= rank)
+            {
+                // Bucket value is not less than min_ and not greater
+                // than max_
+                auto value = BucketValue(i);
+                if (value < min_)
+                    value = min_;
+                else if (value > max_)
+                    value = max_;
+                return value / 1000.0;
+            }
+        }
+
+        return GetMax();
+    }
+
+    std::size_t PauseHistogram::BucketIndex(unsigned long long nanoseconds)
+    {
+        if (nanoseconds < kSubBuckets)
+            return static_cast<std::size_t>(nanoseconds);
+
+        // Position of the highest bit, it is not less than 3
+        std::size_t bit = 0;
+        while ((nanoseconds >> bit) > 1)
+            ++bit;
+
+        auto shift = bit - 3;
+        auto sub = static_cast<std::size_t>(nanoseconds >> shift) - kSubBuckets;
+        return kSubBuckets + shift * kSubBuckets + sub;
+    }
+
+    unsigned long long PauseHistogram::BucketValue(std::size_t index)
+    {
+        if (index < kSubBuckets)
+            return index;
+
+        auto shift = (index - kSubBuckets) / kSubBuckets;
+        auto sub = (index - kSubBuckets) % kSubBuckets;
+        auto low = static_cast<unsigned long long>(kSubBuckets + sub) << shift;
+        auto width = 1ull << shift;
+        return low + width / 2;
+    }
+
+    double GCStatistics::GetPromotionRate() const
+    {
+        auto alloc_bytes = gens_[0].alloc_bytes_;
+        return alloc_bytes == 0 ?
+            0.0 : static_cast<double>(promoted_bytes_) / alloc_bytes;
+    }
+} // namespace luna
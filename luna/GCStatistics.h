@@ -0,0 +1,93 @@
+#ifndef GC_STATISTICS_H
+#define GC_STATISTICS_H
+
+#include <cstddef>
+
+namespace luna
+{
+    // Histogram of GC pause times. Percentiles are approximate, relative
+    // error of them is less than 1/16, min, max and average are exact.
+    class PauseHistogram
+    {
+    public:
+        PauseHistogram();
+
+        // Record a pause time
+        void Record(unsigned long long nanoseconds);
+
+        // Clear all records
+        void Reset();
+
+        // Get count of records
+        unsigned long long GetCount() const
+        { return count_; }
+
+        // Get pause times in microseconds, all of them return 0
+        // when there is no record
+        double GetMin() const;
+        double GetMax() const;
+        double GetAverage() const;
+
+        // Get pause time of percentile p in [0, 1], e.g. 0.99 is p99
+        double GetPercentile(double p) const;
+
+    private:
+        // Get bucket index of the pause time
+        static std::size_t BucketIndex(unsigned long long nanoseconds);
+
+        // Get middle pause time of the bucket
+        static unsigned long long BucketValue(std::size_t index);
+
+        // Each power of two range is divided into kSubBuckets buckets
+        static const std::size_t kSubBuckets = 8;
+        static const std::size_t kBucketCount = 64 * kSubBuckets;
+
+        unsigned long long buckets_[kBucketCount];
+        unsigned long long count_;
+        unsigned long long total_;
+        unsigned long long min_;
+        unsigned long long max_;
+    };
+
+    // Statistics of a generation
+    struct GCGenStatistics
+    {
+        // Objects and bytes allocated in this generation, bytes include
+        // memory growth of objects, objects promoted in are not counted
+        unsigned long long alloc_objects_ = 0;
+        unsigned long long alloc_bytes_ = 0;
+        // Objects and bytes freed in this generation
+        unsigned long long freed_objects_ = 0;
+        unsigned long long freed_bytes_ = 0;
+    };
+
+    // Statistics of GC since GC created or statistics reset
+    struct GCStatistics
+    {
+        // Statistics of GCGen0, GCGen1, GCGen2 and GCGenPerm
+        GCGenStatistics gens_[4];
+
+        // Count of minor and major GCs
+        unsigned long long minor_count_ = 0;
+        unsigned long long major_count_ = 0;
+
+        // Objects and bytes promoted from GCGen0 to GCGen1
+        unsigned long long promoted_objects_ = 0;
+        unsigned long long promoted_bytes_ = 0;
+
+        // Count of old objects recorded by write barrier
+        unsigned long long barrier_count_ = 0;
+        // Count of old objects kept in barriered list after GCs, because
+        // they still reference objects in nursery
+        unsigned long long remembered_count_ = 0;
+
+        // Wall clock pause times of minor and major GCs
+        PauseHistogram minor_pause_;
+        PauseHistogram major_pause_;
+
+        // Ratio of bytes promoted to GCGen1 to bytes allocated in GCGen0
+        double GetPromotionRate() const;
+    };
+} // namespace luna
+
+#endif // GC_STATISTICS_H
@@ -0,0 +1,95 @@
+#include "HeapSnapshot.h"
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace
+{
+    struct TypeSummary
+    {
+        std::size_t count_ = 0;
+        std::size_t bytes_ = 0;
+    };
+
+    void PrintSummary(const luna::HeapGraph &graph)
+    {
+        std::map<std::string, TypeSummary> types;
+        TypeSummary total;
+        TypeSummary unreachable;
+
+        for (const auto &node : graph.GetNodes())
+        {
+            auto &type = types[node.type_];
+            ++type.count_;
+            type.bytes_ += node.size_;
+            ++total.count_;
+            total.bytes_ += node.size_;
+
+            if (node.idom_ == luna::HeapGraph::kNoNode)
+            {
+                ++unreachable.count_;
+                unreachable.bytes_ += node.size_;
+            }
+        }
+
+        printf("%-12s %10s %12s\n", "type", "objects", "bytes");
+        for (const auto &type : types)
+        {
+            printf("%-12s %10zu %12zu\n", type.first.c_str(),
+                   type.second.count_, type.second.bytes_);
+        }
+        printf("%-12s %10zu %12zu\n", "total", total.count_, total.bytes_);
+        printf("%-12s %10zu %12zu\n\n", "unreachable",
+               unreachable.count_, unreachable.bytes_);
+    }
+
+    void PrintTopRetained(const luna::HeapGraph &graph, std::size_t top)
+    {
+        const auto &nodes = graph.GetNodes();
+        std::vector<std::size_t> order;
+        for (std::size_t i = 0; i < nodes.size(); ++i)
+        {
+            if (nodes[i].idom_ != luna::HeapGraph::kNoNode)
+                order.push_back(i);
+        }
+
+        top = std::min(top, order.size());
+        std::partial_sort(order.begin(), order.begin() + top, order.end(),
+                          [&nodes](std::size_t l, std::size_t r) {
+                              return nodes[l].retained_size_ > nodes[r].retained_size_;
+                          });
+
+        printf("%12s %10s %-10s %8s  %s\n", "retained", "self", "type", "id", "path");
+        for (std::size_t i = 0; i < top; ++i)
+        {
+            const auto &node = nodes[order[i]];
+            printf("%12zu %10zu %-10s %8zu  %s\n", node.retained_size_,
+                   node.size_, node.type_.c_str(), order[i],
+                   graph.GetRootPath(order[i]).c_str());
+        }
+    }
+} // namespace
+
+int main(int argc, const char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s snapshot [top]\n", argv[0]);
+        return 1;
+    }
+
+    luna::HeapGraph graph;
+    if (!graph.Load(argv[1]))
+    {
+        printf("%s: can not load heap snapshot %s\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    std::size_t top = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20;
+
+    graph.Analyze();
+    PrintSummary(graph);
+    PrintTopRetained(graph, top);
+    return 0;
+}
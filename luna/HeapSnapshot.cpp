@@ -0,0 +1,452 @@
+#include "HeapSnapshot.h"
+#include "Table.h"
+#include "Function.h"
+#include "Upvalue.h"
+#include "String.h"
+#include "UserData.h"
+#include "Value.h"
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <stdio.h>
+
+namespace
+{
+    const char *kSnapshotHeader = "luna-heap-snapshot 1";
+    const std::size_t kMaxLabelLength = 64;
+
+    const char * ObjectTypeName(unsigned int type)
+    {
+        switch (type)
+        {
+            case luna::GCObjectType_Table: return "table";
+            case luna::GCObjectType_Function: return "function";
+            case luna::GCObjectType_Closure: return "closure";
+            case luna::GCObjectType_Upvalue: return "upvalue";
+            case luna::GCObjectType_String: return "string";
+            case luna::GCObjectType_UserData: return "userdata";
+            default: return "unknown";
+        }
+    }
+
+    // Label is the rest of line, so escape line breaks in it
+    std::string EscapeLabel(const char *str, std::size_t len)
+    {
+        std::string label;
+        for (std::size_t i = 0; i < len && label.size() < kMaxLabelLength; ++i)
+        {
+            switch (str[i])
+            {
+                case '\n': label += "\\n"; break;
+                case '\r': label += "\\r"; break;
+                case '\\': label += "\\\\"; break;
+                default: label += str[i]; break;
+            }
+        }
+
+        if (len > kMaxLabelLength)
+            label += "...";
+        return label;
+    }
+
+    // Label of table value by its key
+    std::string KeyLabel(const luna::Value &key)
+    {
+        char buffer[64] = { 0 };
+        switch (key.type_)
+        {
+            case luna::ValueT_String:
+                return EscapeLabel(key.str_->GetCStr(), key.str_->GetLength());
+            case luna::ValueT_Number:
+                snprintf(buffer, sizeof(buffer), "[%.14g]", key.num_);
+                return buffer;
+            case luna::ValueT_Bool:
+                return key.bvalue_ ? "[true]" : "[false]";
+            default:
+                return std::string("[") + key.TypeName() + "]";
+        }
+    }
+
+    // Collect member GC objects of the first visited object
+    class MemberVisitor : public luna::GCObjectVisitor
+    {
+    public:
+        MemberVisitor() : visited_(false) { }
+
+        virtual bool Visit(luna::Table *t) { return VisitObj(t); }
+        virtual bool Visit(luna::Function *f) { return VisitObj(f); }
+        virtual bool Visit(luna::Closure *c) { return VisitObj(c); }
+        virtual bool Visit(luna::Upvalue *u) { return VisitObj(u); }
+        virtual bool Visit(luna::String *s) { return VisitObj(s); }
+        virtual bool Visit(luna::UserData *u) { return VisitObj(u); }
+
+        const std::vector<luna::GCObject *> & GetMembers() const
+        { return members_; }
+
+    private:
+        bool VisitObj(luna::GCObject *obj)
+        {
+            if (!visited_)
+            {
+                visited_ = true;
+                return true;
+            }
+
+            members_.push_back(obj);
+            return false;
+        }
+
+        bool visited_;
+        std::vector<luna::GCObject *> members_;
+    };
+} // namespace
+
+namespace luna
+{
+    const std::size_t HeapGraph::kNoNode;
+
+    HeapSnapshot::HeapSnapshot(GC &gc)
+        : gc_(gc)
+    {
+    }
+
+    void HeapSnapshot::AddRoot(const std::string &name, const Value &value)
+    {
+        if (value.IsGCObject())
+            roots_.push_back(std::make_pair(value.obj_, name));
+    }
+
+    bool HeapSnapshot::Write(const std::string &file)
+    {
+        std::ofstream ofs(file.c_str());
+        if (!ofs.is_open())
+            return false;
+
+        Write(ofs);
+        return ofs.good();
+    }
+
+    void HeapSnapshot::Write(std::ostream &os)
+    {
+        // Number all objects first, then references can be written by ids
+        std::vector<GCObject *> objects;
+        ids_.clear();
+        gc_.ForEachObject([&](GCObject *obj) {
+            ids_[obj] = objects.size();
+            objects.push_back(obj);
+        });
+
+        os << kSnapshotHeader << "\n";
+        for (std::size_t id = 0; id < objects.size(); ++id)
+        {
+            auto obj = objects[id];
+            os << "o " << id << " " << ObjectTypeName(obj->GetObjectType())
+               << " " << obj->GetGeneration() << " " << obj->GetMemorySize() << "\n";
+            WriteEdges(os, obj);
+        }
+
+        for (const auto &root : roots_)
+        {
+            auto it = ids_.find(root.first);
+            if (it != ids_.end())
+                os << "r " << it->second << " " << root.second << "\n";
+        }
+    }
+
+    void HeapSnapshot::WriteEdges(std::ostream &os, GCObject *obj)
+    {
+        if (obj->GetObjectType() == GCObjectType_Table)
+        {
+            // Label table references by keys
+            auto t = static_cast<Table *>(obj);
+            Value key;
+            Value value;
+            bool has = t->FirstKeyValue(key, value);
+            while (has)
+            {
+                if (key.IsGCObject())
+                    WriteEdge(os, key.obj_, "(key)");
+                if (value.IsGCObject())
+                    WriteEdge(os, value.obj_, KeyLabel(key));
+
+                Value next_key;
+                has = t->NextKeyValue(key, next_key, value);
+                key = next_key;
+            }
+
+            return ;
+        }
+
+        MemberVisitor visitor;
+        obj->Accept(&visitor);
+        for (auto member : visitor.GetMembers())
+            WriteEdge(os, member, "");
+    }
+
+    void HeapSnapshot::WriteEdge(std::ostream &os, GCObject *to,
+                                 const std::string &label)
+    {
+        auto it = ids_.find(to);
+        if (it == ids_.end())
+            return ;
+
+        os << "e " << it->second;
+        if (!label.empty())
+            os << " " << label;
+        os << "\n";
+    }
+
+    bool HeapGraph::Load(const std::string &file)
+    {
+        std::ifstream ifs(file.c_str());
+        if (!ifs.is_open())
+            return false;
+
+        return Load(ifs);
+    }
+
+    bool HeapGraph::Load(std::istream &is)
+    {
+        nodes_.clear();
+        roots_.clear();
+
+        std::string line;
+        if (!std::getline(is, line) || line != kSnapshotHeader)
+            return false;
+
+        // Edges reference objects after them, so check them after loaded
+        while (std::getline(is, line))
+        {
+            if (line.empty())
+                continue;
+
+            std::istringstream iss(line);
+            std::string tag;
+            iss >> tag;
+
+            if (tag == "o")
+            {
+                std::size_t id = 0;
+                Node node;
+                if (!(iss >> id >> node.type_ >> node.generation_ >> node.size_) ||
+                    id != nodes_.size())
+                    return false;
+                nodes_.push_back(node);
+            }
+            else if (tag == "e" || tag == "r")
+            {
+                std::size_t id = 0;
+                if (!(iss >> id))
+                    return false;
+
+                // Rest of line is the label or root name
+                std::string rest;
+                iss.get();
+                std::getline(iss, rest);
+
+                if (tag == "e")
+                {
+                    if (nodes_.empty())
+                        return false;
+                    Edge edge;
+                    edge.to_ = id;
+                    edge.label_ = rest;
+                    nodes_.back().edges_.push_back(edge);
+                }
+                else
+                {
+                    Root root;
+                    root.node_ = id;
+                    root.name_ = rest;
+                    roots_.push_back(root);
+                }
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        for (const auto &node : nodes_)
+        {
+            for (const auto &edge : node.edges_)
+            {
+                if (edge.to_ >= nodes_.size())
+                    return false;
+            }
+        }
+
+        for (const auto &root : roots_)
+        {
+            if (root.node_ >= nodes_.size())
+                return false;
+        }
+
+        return true;
+    }
+
+    void HeapGraph::Analyze()
+    {
+        auto count = nodes_.size();
+        auto root_node = GetRootNode();
+
+        // Successors of node, virtual root node references all roots
+        auto for_each_succ = [this, root_node](std::size_t n, const std::function<void (std::size_t)> &op) {
+            if (n == root_node)
+            {
+                for (const auto &root : roots_)
+                    op(root.node_);
+            }
+            else
+            {
+                for (const auto &edge : nodes_[n].edges_)
+                    op(edge.to_);
+            }
+        };
+
+        // Post order of depth first search from virtual root node
+        std::vector<std::size_t> post_order;
+        std::vector<std::size_t> post_index(count + 1, kNoNode);
+        std::vector<bool> visited(count + 1, false);
+        std::vector<std::pair<std::size_t, std::vector<std::size_t>>> dfs;
+        auto push = [&](std::size_t n) {
+            visited[n] = true;
+            std::vector<std::size_t> succ;
+            for_each_succ(n, [&](std::size_t s) { succ.push_back(s); });
+            dfs.push_back(std::make_pair(n, std::move(succ)));
+        };
+
+        push(root_node);
+        while (!dfs.empty())
+        {
+            auto &top = dfs.back();
+            if (top.second.empty())
+            {
+                post_index[top.first] = post_order.size();
+                post_order.push_back(top.first);
+                dfs.pop_back();
+                continue;
+            }
+
+            auto next = top.second.back();
+            top.second.pop_back();
+            if (!visited[next])
+                push(next);
+        }
+
+        // Predecessors of reachable nodes
+        std::vector<std::vector<std::size_t>> preds(count + 1);
+        for (auto n : post_order)
+            for_each_succ(n, [&](std::size_t s) { preds[s].push_back(n); });
+
+        // Iterative dominator algorithm of Cooper, Harvey and Kennedy
+        std::vector<std::size_t> idom(count + 1, kNoNode);
+        idom[root_node] = root_node;
+
+        auto intersect = [&](std::size_t a, std::size_t b) {
+            while (a != b)
+            {
+                while (post_index[a] < post_index[b])
+                    a = idom[a];
+                while (post_index[b] < post_index[a])
+                    b = idom[b];
+            }
+            return a;
+        };
+
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+
+            // Reverse post order, skip virtual root node
+            for (std::size_t i = post_order.size() - 1; i-- > 0; )
+            {
+                auto n = post_order[i];
+                auto new_idom = kNoNode;
+                for (auto p : preds[n])
+                {
+                    if (idom[p] == kNoNode)
+                        continue;
+                    new_idom = new_idom == kNoNode ? p : intersect(p, new_idom);
+                }
+
+                if (idom[n] != new_idom)
+                {
+                    idom[n] = new_idom;
+                    changed = true;
+                }
+            }
+        }
+
+        // Dominators are after objects in post order, so accumulate
+        // retained sizes to dominators in post order
+        for (std::size_t n = 0; n < count; ++n)
+        {
+            nodes_[n].idom_ = idom[n];
+            nodes_[n].retained_size_ = nodes_[n].size_;
+        }
+
+        for (auto n : post_order)
+        {
+            if (n != root_node && idom[n] != root_node)
+                nodes_[idom[n]].retained_size_ += nodes_[n].retained_size_;
+        }
+
+        // Shortest paths from roots by breadth first search
+        path_parent_.assign(count, kNoNode);
+        path_edge_.assign(count, nullptr);
+        path_root_.assign(count, nullptr);
+
+        std::deque<std::size_t> queue;
+        for (const auto &root : roots_)
+        {
+            if (!path_root_[root.node_])
+            {
+                path_root_[root.node_] = &root;
+                path_parent_[root.node_] = root_node;
+                queue.push_back(root.node_);
+            }
+        }
+
+        while (!queue.empty())
+        {
+            auto n = queue.front();
+            queue.pop_front();
+
+            for (const auto &edge : nodes_[n].edges_)
+            {
+                if (path_parent_[edge.to_] == kNoNode)
+                {
+                    path_parent_[edge.to_] = n;
+                    path_edge_[edge.to_] = &edge;
+                    queue.push_back(edge.to_);
+                }
+            }
+        }
+    }
+
+    std::string HeapGraph::GetRootPath(std::size_t node) const
+    {
+        if (node >= path_parent_.size() || path_parent_[node] == kNoNode)
+            return std::string();
+
+        std::vector<std::size_t> path;
+        for (auto n = node; n != GetRootNode(); n = path_parent_[n])
+            path.push_back(n);
+
+        std::string result = path_root_[path.back()]->name_;
+        for (auto it = path.rbegin() + 1; it != path.rend(); ++it)
+        {
+            const auto &label = path_edge_[*it]->label_;
+            if (label.empty())
+                result += ".<" + nodes_[*it].type_ + ">";
+            else if (label[0] == '[')
+                result += label;
+            else
+                result += "." + label;
+        }
+
+        return result;
+    }
+} // namespace luna
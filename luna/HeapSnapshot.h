@@ -0,0 +1,122 @@
+#ifndef HEAP_SNAPSHOT_H
+#define HEAP_SNAPSHOT_H
+
+#include "GC.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <istream>
+#include <ostream>
+
+namespace luna
+{
+    struct Value;
+
+    // Heap snapshot writes the object graph of all generations to a
+    // line based text file:
+    //   luna-heap-snapshot 1
+    //   o <id> <type> <generation> <size>      an object
+    //   e <to id> [label]                      reference of the last object
+    //   r <id> <root name>                     a root object
+    // Labels of table references are the keys, such as name or [1].
+    class HeapSnapshot
+    {
+    public:
+        explicit HeapSnapshot(GC &gc);
+
+        HeapSnapshot(const HeapSnapshot&) = delete;
+        void operator = (const HeapSnapshot&) = delete;
+
+        // Add a root value with root name
+        void AddRoot(const std::string &name, const Value &value);
+
+        // Write snapshot to file, return false when open file failed
+        bool Write(const std::string &file);
+
+        // Write snapshot to stream
+        void Write(std::ostream &os);
+
+    private:
+        // Write references of obj
+        void WriteEdges(std::ostream &os, GCObject *obj);
+        void WriteEdge(std::ostream &os, GCObject *to, const std::string &label);
+
+        GC &gc_;
+        // Roots and names of them
+        std::vector<std::pair<GCObject *, std::string>> roots_;
+        // Id of each object
+        std::unordered_map<GCObject *, std::size_t> ids_;
+    };
+
+    // Object graph loaded from heap snapshot, computes dominator tree and
+    // retained sizes of objects
+    class HeapGraph
+    {
+    public:
+        static const std::size_t kNoNode = static_cast<std::size_t>(-1);
+
+        struct Edge
+        {
+            std::size_t to_;
+            std::string label_;
+        };
+
+        struct Node
+        {
+            std::string type_;
+            unsigned int generation_;
+            std::size_t size_;
+            std::vector<Edge> edges_;
+
+            // Immediate dominator, kNoNode when object is unreachable
+            // from roots, GetRootNode() when dominated by roots only
+            std::size_t idom_;
+            // Size of objects which are only reachable through this object
+            std::size_t retained_size_;
+
+            Node() : generation_(0), size_(0), idom_(kNoNode), retained_size_(0) { }
+        };
+
+        struct Root
+        {
+            std::size_t node_;
+            std::string name_;
+        };
+
+        // Load snapshot file, return false when open file failed or
+        // file format is invalid
+        bool Load(const std::string &file);
+
+        // Load snapshot from stream
+        bool Load(std::istream &is);
+
+        // Compute dominator tree and retained sizes
+        void Analyze();
+
+        const std::vector<Node> & GetNodes() const
+        { return nodes_; }
+
+        const std::vector<Root> & GetRoots() const
+        { return roots_; }
+
+        // Virtual root node which references all roots, it is the
+        // dominator of all root objects
+        std::size_t GetRootNode() const
+        { return nodes_.size(); }
+
+        // Get the shortest reference path from roots to node, such as
+        // global.config[3], returns empty string when node unreachable
+        std::string GetRootPath(std::size_t node) const;
+
+    private:
+        std::vector<Node> nodes_;
+        std::vector<Root> roots_;
+        // Parent node and edge in shortest path from roots, root objects'
+        // parent is GetRootNode()
+        std::vector<std::size_t> path_parent_;
+        std::vector<const Edge *> path_edge_;
+        std::vector<const Root *> path_root_;
+    };
+} // namespace luna
+
+#endif // HEAP_SNAPSHOT_H
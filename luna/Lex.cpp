@@ -1,6 +1,7 @@
 #include "Lex.h"
 #include "State.h"
 #include "Exception.h"
+#include "Number.h"
 #include <assert.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -36,6 +37,18 @@ namespace
                (c >= 'a' && c <= 'f') ||
                (c >= 'A' && c <= 'F');
     }
+
+    // Digit of number, hexadecimal digit when hex is true
+    inline bool IsNumberChar(int c, bool hex)
+    {
+        return hex ? IsHexChar(c) : (c >= '0' && c <= '9');
+    }
+
+    // Exponent mark of number, hexadecimal number's is 'p'
+    inline bool IsExponent(int c, bool hex)
+    {
+        return hex ? (c == 'p' || c == 'P') : (c == 'e' || c == 'E');
+    }
 } // namespace
 
 namespace luna
@@ -142,9 +155,7 @@ namespace luna
                         token_buffer_.clear();
                         token_buffer_.push_back(current_);
                         current_ = next;
-                        return LexNumberXFractional(detail, false, true,
-                                                    [](int c) { return isdigit(c) != 0; },
-                                                    [](int c) { return c == 'e' || c == 'E'; });
+                        return LexNumberXFractional(detail, false, true, false);
                     }
                     else
                     {
@@ -264,8 +275,7 @@ namespace luna
                 token_buffer_.push_back(next);
                 current_ = Next();
 
-                return LexNumberX(detail, false, IsHexChar,
-                                  [](int c) { return c == 'p' || c == 'P'; });
+                return LexNumberX(detail, false, true);
             }
             else
             {
@@ -275,16 +285,12 @@ namespace luna
             }
         }
 
-        return LexNumberX(detail, integer_part,
-                          [](int c) { return isdigit(c) != 0; },
-                          [](int c) { return c == 'e' || c == 'E'; });
+        return LexNumberX(detail, integer_part, false);
     }
 
-    int Lexer::LexNumberX(TokenDetail *detail, bool integer_part,
-                          const std::function<bool (int)> &is_number_char,
-                          const std::function<bool (int)> &is_exponent)
+    int Lexer::LexNumberX(TokenDetail *detail, bool integer_part, bool hex)
     {
-        while (is_number_char(current_))
+        while (IsNumberChar(current_, hex))
         {
             token_buffer_.push_back(current_);
             current_ = Next();
@@ -299,17 +305,14 @@ namespace luna
             point = true;
         }
 
-        return LexNumberXFractional(detail, integer_part, point,
-                                    is_number_char, is_exponent);
+        return LexNumberXFractional(detail, integer_part, point, hex);
     }
 
     int Lexer::LexNumberXFractional(TokenDetail *detail,
-                                    bool integer_part, bool point,
-                                    const std::function<bool (int)> &is_number_char,
-                                    const std::function<bool (int)> &is_exponent)
+                                    bool integer_part, bool point, bool hex)
     {
         bool fractional_part = false;
-        while (is_number_char(current_))
+        while (IsNumberChar(current_, hex))
         {
             token_buffer_.push_back(current_);
             current_ = Next();
@@ -323,7 +326,7 @@ namespace luna
             throw LexException(module_->GetCStr(), line_, column_,
                     "unexpect incomplete number '", token_buffer_, "'");
 
-        if (is_exponent(current_))
+        if (IsExponent(current_, hex))
         {
             token_buffer_.push_back(current_);
             current_ = Next();
@@ -344,7 +347,10 @@ namespace luna
             }
         }
 
-        double number = strtod(token_buffer_.c_str(), nullptr);
+        double number = 0;
+        if (!StringToNumber(token_buffer_.data(), token_buffer_.size(), number))
+            throw LexException(module_->GetCStr(), line_, column_,
+                    "invalid number '", token_buffer_, "'");
         RETURN_NUMBER_TOKEN_DETAIL(detail, number);
     }
 
@@ -527,6 +533,11 @@ namespace luna
         int token = 0;
         if (!IsKeyWord(token_buffer_, &token))
             token = Token_Id;
-        RETURN_TOKEN_DETAIL(detail, token_buffer_, token);
+
+        // Names are compared by address in semantic analysis and code
+        // generation, so intern them even when they are long
+        detail->str_ = state_->GetInternedString(token_buffer_.c_str(),
+                                                 token_buffer_.size());
+        RETURN_NORMAL_TOKEN_DETAIL(detail, token);
     }
 } // namespace luna
@@ -44,13 +44,9 @@ namespace luna
         void LexSingleLineComment();
 
         int LexNumber(TokenDetail *detail);
-        int LexNumberX(TokenDetail *detail, bool integer_part,
-                       const std::function<bool (int)> &is_number_char,
-                       const std::function<bool (int)> &is_exponent);
+        int LexNumberX(TokenDetail *detail, bool integer_part, bool hex);
         int LexNumberXFractional(TokenDetail *detail,
-                                 bool integer_part, bool point,
-                                 const std::function<bool (int)> &is_number_char,
-                                 const std::function<bool (int)> &is_exponent);
+                                 bool integer_part, bool point, bool hex);
 
         int LexXEqual(TokenDetail *detail, int equal_token);
 
@@ -2,6 +2,8 @@
 #include "State.h"
 #include "Runtime.h"
 #include "Table.h"
+#include "VM.h"
+#include "Exception.h"
 #include <assert.h>
 
 namespace luna
@@ -113,6 +115,22 @@ namespace luna
             return v;
     }
 
+    bool StackAPI::SetTableMode(int index, TableMode mode)
+    {
+        if (!IsTable(index))
+            return false;
+
+        GetTable(index)->SetMode(mode);
+        return true;
+    }
+
+    TableMode StackAPI::GetTableMode(int index)
+    {
+        if (!IsTable(index))
+            return TableMode_Strong;
+        return GetTable(index)->GetMode();
+    }
+
     void StackAPI::PushNil()
     {
         PushValue()->type_ = ValueT_Nil;
@@ -146,6 +164,14 @@ namespace luna
         v->str_ = state_->GetString(str);
     }
 
+    void StackAPI::PushSubString(int index, std::size_t offset, std::size_t len)
+    {
+        auto str = state_->GetSubString(GetValue(index)->str_, offset, len);
+        Value *v = PushValue();
+        v->type_ = ValueT_String;
+        v->str_ = str;
+    }
+
     void StackAPI::PushBool(bool value)
     {
         Value *v = PushValue();
@@ -199,6 +225,24 @@ namespace luna
         return stack_->top_++;
     }
 
+    void StackAPI::Call(int arg_count, int expect_result)
+    {
+        Value *f = stack_->top_ - arg_count - 1;
+        if (f->type_ != ValueT_Closure && f->type_ != ValueT_CFunction)
+            throw CallCFuncException("attempt to call a ", f->TypeName(), " value");
+
+        if (state_->CallFunction(f, arg_count, expect_result))
+        {
+            VM vm(state_);
+            vm.Execute();
+        }
+    }
+
+    void StackAPI::Pop(int count)
+    {
+        stack_->SetNewTop(stack_->top_ - count);
+    }
+
     Library::Library(State *state)
         : state_(state),
           global_(state->global_.table_)
@@ -222,6 +266,7 @@ namespace luna
         v.type_ = ValueT_Table;
         v.table_ = t;
         global_->SetValue(k, v);
+        CHECK_BARRIER(state_->GetGC(), global_);
 
         RegisterToTable(t, table, size);
     }
@@ -264,6 +309,7 @@ namespace luna
         v.type_ = ValueT_CFunction;
         v.cfunc_ = func;
         table->SetValue(k, v);
+        CHECK_BARRIER(state_->GetGC(), table);
     }
 
     void Library::RegisterNumber(Table *table, const char *name, double number)
@@ -276,6 +322,7 @@ namespace luna
         v.type_ = ValueT_Number;
         v.num_ = number;
         table->SetValue(k, v);
+        CHECK_BARRIER(state_->GetGC(), table);
     }
 
     void Library::RegisterString(Table *table, const char *name, const char *str)
@@ -288,5 +335,6 @@ namespace luna
         v.type_ = ValueT_String;
         v.str_ = state_->GetString(str);
         table->SetValue(k, v);
+        CHECK_BARRIER(state_->GetGC(), table);
     }
 } // namespace luna
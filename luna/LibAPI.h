@@ -2,6 +2,7 @@
 #define LIB_API_H
 
 #include "Value.h"
+#include "Table.h"
 #include <string>
 
 namespace luna
@@ -94,18 +95,35 @@ namespace luna
         CFunctionType GetCFunction(int index);
         Value * GetValue(int index);
 
+        // Set and get weak mode of table by index of stack,
+        // SetTableMode returns false when the value is not a table
+        bool SetTableMode(int index, TableMode mode);
+        TableMode GetTableMode(int index);
+
         // Push value to stack
         void PushNil();
         void PushNumber(double num);
         void PushString(const char *string);
         void PushString(const char *str, std::size_t len);
         void PushString(const std::string &str);
+        // Push substring of len bytes from offset of the string by index
+        // of stack, long substring may reference content of the string
+        void PushSubString(int index, std::size_t offset, std::size_t len);
         void PushBool(bool value);
         void PushTable(Table *table);
         void PushUserData(UserData *user_data);
         void PushCFunction(CFunctionType function);
         void PushValue(const Value &value);
 
+        // Call the function which is below arg_count arguments on the top
+        // of stack, then expect_result results replace the function and
+        // arguments. GC may run in the call, so get GC objects from
+        // stack again after it.
+        void Call(int arg_count, int expect_result);
+
+        // Pop count values from the top of stack
+        void Pop(int count);
+
         // For report argument error
         void ArgCountError(int expect_count);
         void ArgTypeError(int arg_index, ValueT expect_type);
@@ -3,50 +3,70 @@
 #include "Upvalue.h"
 #include "State.h"
 #include "String.h"
+#include "GC.h"
+#include "AllocProfiler.h"
+#include "Number.h"
 #include <string>
+#include <sstream>
 #include <iostream>
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 
 namespace lib {
 namespace base {
 
+    // Convert value which is not a string to string into buffer, which
+    // has kBufferSize bytes, return length of the string
+    const std::size_t kBufferSize = 64;
+    std::size_t ValueToString(luna::StackAPI &api, int index, char *buffer)
+    {
+        int len = 0;
+        switch (api.GetValueType(index)) {
+            case luna::ValueT_Nil:
+                len = snprintf(buffer, kBufferSize, "nil");
+                break;
+            case luna::ValueT_Bool:
+                len = snprintf(buffer, kBufferSize, "%s",
+                               api.GetBool(index) ? "true" : "false");
+                break;
+            case luna::ValueT_Number:
+                return luna::NumberToString(api.GetNumber(index), buffer);
+            case luna::ValueT_Closure:
+                len = snprintf(buffer, kBufferSize, "function:\t%p", api.GetClosure(index));
+                break;
+            case luna::ValueT_Table:
+                len = snprintf(buffer, kBufferSize, "table:\t%p", api.GetTable(index));
+                break;
+            case luna::ValueT_UserData:
+                len = snprintf(buffer, kBufferSize, "userdata:\t%p", api.GetUserData(index));
+                break;
+            case luna::ValueT_CFunction:
+                len = snprintf(buffer, kBufferSize, "function:\t%p", api.GetCFunction(index));
+                break;
+            default:
+                break;
+        }
+        return len;
+    }
+
     int Print(luna::State *state)
     {
         luna::StackAPI api(state);
         int params = api.GetStackSize();
 
+        char buffer[kBufferSize];
         for (int i = 0; i < params; ++i)
         {
-            luna::ValueT type = api.GetValueType(i);
-
-            switch (type) {
-                case luna::ValueT_Nil:
-                    printf("nil");
-                    break;
-                case luna::ValueT_Bool:
-                    printf("%s", api.GetBool(i) ? "true" : "false");
-                    break;
-                case luna::ValueT_Number:
-                    printf("%.14g", api.GetNumber(i));
-                    break;
-                case luna::ValueT_String:
-                    printf("%s", api.GetCString(i));
-                    break;
-                case luna::ValueT_Closure:
-                    printf("function:\t%p", api.GetClosure(i));
-                    break;
-                case luna::ValueT_Table:
-                    printf("table:\t%p", api.GetTable(i));
-                    break;
-                case luna::ValueT_UserData:
-                    printf("userdata:\t%p", api.GetUserData(i));
-                    break;
-                case luna::ValueT_CFunction:
-                    printf("function:\t%p", api.GetCFunction(i));
-                    break;
-                default:
-                    break;
+            if (api.IsString(i))
+            {
+                auto str = api.GetString(i);
+                fwrite(str->GetData(), 1, str->GetLength(), stdout);
+            }
+            else
+            {
+                auto len = ValueToString(api, i, buffer);
+                fwrite(buffer, 1, len, stdout);
             }
 
             if (i != params - 1)
@@ -107,6 +127,78 @@ namespace base {
         return 1;
     }
 
+    int ToString(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1))
+            return 0;
+
+        if (api.IsString(0))
+        {
+            api.PushValue(*api.GetValue(0));
+            return 1;
+        }
+
+        char buffer[kBufferSize];
+        auto len = ValueToString(api, 0, buffer);
+        api.PushString(buffer, len);
+        return 1;
+    }
+
+    int ToNumber(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1))
+            return 0;
+
+        // Convert string in base 2 to 36 to integer
+        if (api.GetStackSize() > 1)
+        {
+            if (!api.CheckArgs(2, luna::ValueT_String, luna::ValueT_Number))
+                return 0;
+
+            auto base = static_cast<int>(api.GetNumber(1));
+            auto str = api.GetString(0);
+            auto p = str->GetData();
+            auto end = p + str->GetLength();
+            while (p < end && isspace(static_cast<unsigned char>(*p)))
+                ++p;
+            while (end > p && isspace(static_cast<unsigned char>(end[-1])))
+                --end;
+
+            bool negative = p < end && *p == '-';
+            if (negative)
+                ++p;
+
+            double num = 0;
+            bool valid = base >= 2 && base <= 36 && p < end;
+            for (; valid && p < end; ++p)
+            {
+                int digit = isdigit(static_cast<unsigned char>(*p)) ? *p - '0' :
+                    isalpha(static_cast<unsigned char>(*p)) ? tolower(*p) - 'a' + 10 : base;
+                valid = digit < base;
+                num = num * base + digit;
+            }
+
+            if (valid)
+                api.PushNumber(negative ? -num : num);
+            else
+                api.PushNil();
+            return 1;
+        }
+
+        double num = 0;
+        if (api.IsNumber(0))
+            api.PushNumber(api.GetNumber(0));
+        else if (api.IsString(0) &&
+                 luna::StringToNumber(api.GetString(0)->GetData(),
+                                      api.GetString(0)->GetLength(), num))
+            api.PushNumber(num);
+        else
+            api.PushNil();
+        return 1;
+    }
+
     int DoIPairs(luna::State *state)
     {
         luna::StackAPI api(state);
@@ -142,21 +234,24 @@ namespace base {
         return 3;
     }
 
-    int DoPairs(luna::State *state)
+    int Next(luna::State *state)
     {
         luna::StackAPI api(state);
-        if (!api.CheckArgs(2, luna::ValueT_Table))
+        if (!api.CheckArgs(1, luna::ValueT_Table))
             return 0;
 
         luna::Table *t = api.GetTable(0);
-        luna::Value *last_key = api.GetValue(1);
 
+        // Key is nil when it is omitted
+        luna::Value last_key;
+        if (api.GetStackSize() > 1)
+            last_key = *api.GetValue(1);
+
+        // Table searches the last key only when it is not the key
+        // returned last time
         luna::Value key;
         luna::Value value;
-        if (last_key->type_ == luna::ValueT_Nil)
-            t->FirstKeyValue(key, value);
-        else
-            t->NextKeyValue(*last_key, key, value);
+        t->NextKeyValue(last_key, key, value);
 
         api.PushValue(key);
         api.PushValue(value);
@@ -170,7 +265,7 @@ namespace base {
             return 0;
 
         luna::Table *t = api.GetTable(0);
-        api.PushCFunction(DoPairs);
+        api.PushCFunction(Next);
         api.PushTable(t);
         api.PushNil();
         return 3;
@@ -198,6 +293,186 @@ namespace base {
         return 0;
     }
 
+    // Set table[name] = value
+    template<typename T>
+    void SetField(luna::State *state, luna::Table *table,
+                  const char *name, T value)
+    {
+        luna::Value k(state->GetString(name));
+        luna::Value v(value);
+        table->SetValue(k, v);
+    }
+
+    luna::Table * PauseStatistics(luna::State *state,
+                                  const luna::PauseHistogram &pause)
+    {
+        auto t = state->NewTable();
+        SetField(state, t, "count", static_cast<double>(pause.GetCount()));
+        SetField(state, t, "min", pause.GetMin());
+        SetField(state, t, "avg", pause.GetAverage());
+        SetField(state, t, "p50", pause.GetPercentile(0.5));
+        SetField(state, t, "p99", pause.GetPercentile(0.99));
+        SetField(state, t, "max", pause.GetMax());
+        return t;
+    }
+
+    luna::Table * GenStatistics(luna::State *state, luna::GCGeneration gen)
+    {
+        auto &gc = state->GetGC();
+        auto &stats = gc.GetStatistics().gens_[gen];
+
+        auto t = state->NewTable();
+        SetField(state, t, "objects", static_cast<double>(gc.GetObjectCount(gen)));
+        SetField(state, t, "bytes", static_cast<double>(gc.GetObjectBytes(gen)));
+        SetField(state, t, "alloc_objects", static_cast<double>(stats.alloc_objects_));
+        SetField(state, t, "alloc_bytes", static_cast<double>(stats.alloc_bytes_));
+        SetField(state, t, "freed_objects", static_cast<double>(stats.freed_objects_));
+        SetField(state, t, "freed_bytes", static_cast<double>(stats.freed_bytes_));
+        return t;
+    }
+
+    luna::Table * GCStatistics(luna::State *state)
+    {
+        auto &gc = state->GetGC();
+        auto &stats = gc.GetStatistics();
+
+        auto t = state->NewTable();
+        SetField(state, t, "heap_bytes", static_cast<double>(gc.GetHeapBytes()));
+        SetField(state, t, "minor_count", static_cast<double>(stats.minor_count_));
+        SetField(state, t, "major_count", static_cast<double>(stats.major_count_));
+        SetField(state, t, "minor_pause", PauseStatistics(state, stats.minor_pause_));
+        SetField(state, t, "major_pause", PauseStatistics(state, stats.major_pause_));
+        SetField(state, t, "gen0", GenStatistics(state, luna::GCGen0));
+        SetField(state, t, "gen1", GenStatistics(state, luna::GCGen1));
+        SetField(state, t, "gen2", GenStatistics(state, luna::GCGen2));
+        SetField(state, t, "perm", GenStatistics(state, luna::GCGenPerm));
+        SetField(state, t, "promoted_objects", static_cast<double>(stats.promoted_objects_));
+        SetField(state, t, "promoted_bytes", static_cast<double>(stats.promoted_bytes_));
+        SetField(state, t, "promotion_rate", stats.GetPromotionRate());
+        SetField(state, t, "barrier_count", static_cast<double>(stats.barrier_count_));
+        SetField(state, t, "remembered_count", static_cast<double>(stats.remembered_count_));
+        return t;
+    }
+
+    // collectgarbage([option [, arg]]), option could be:
+    // "collect": run a full GC, it is the default option
+    // "step": run a GC step, returns true when the step is a major GC
+    // "stop": stop automatic GC
+    // "restart": restart automatic GC
+    // "isrunning": returns true when automatic GC is running
+    // "count": returns heap size in Kbytes
+    // "setpause": set arg as pause(heap growth factor in percent),
+    //             returns the previous pause
+    // "setstepmul": set arg as step multiplier in percent,
+    //               returns the previous step multiplier
+    // "stats": returns a table of GC statistics
+    // "freeze": freeze all alived objects, they are never collected
+    // "snapshot": write heap snapshot to file arg, returns true when
+    //             success
+    // "profile": start allocation profiler which samples an object every
+    //            arg bytes allocated, stop it when arg is 0
+    // "report": returns report of allocation profiler
+    int CollectGarbage(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(0, luna::ValueT_String))
+            return 0;
+
+        std::string option = "collect";
+        if (api.GetStackSize() > 0)
+            option = api.GetCString(0);
+
+        auto &gc = state->GetGC();
+        if (option == "collect")
+        {
+            gc.FullGC();
+            api.PushNumber(0);
+        }
+        else if (option == "step")
+        {
+            api.PushBool(gc.StepGC());
+        }
+        else if (option == "stop")
+        {
+            gc.Stop();
+            api.PushNumber(0);
+        }
+        else if (option == "restart")
+        {
+            gc.Restart();
+            api.PushNumber(0);
+        }
+        else if (option == "isrunning")
+        {
+            api.PushBool(gc.IsRunning());
+        }
+        else if (option == "count")
+        {
+            api.PushNumber(gc.GetHeapBytes() / 1024.0);
+        }
+        else if (option == "setpause" || option == "setstepmul")
+        {
+            if (!api.CheckArgs(2, luna::ValueT_String, luna::ValueT_Number))
+                return 0;
+
+            auto arg = api.GetNumber(1);
+            if (arg < 0)
+                arg = 0;
+
+            if (option == "setpause")
+            {
+                api.PushNumber(gc.GetGrowthFactor() * 100);
+                gc.SetGrowthFactor(arg / 100);
+            }
+            else
+            {
+                api.PushNumber(gc.GetStepMultiplier());
+                gc.SetStepMultiplier(static_cast<unsigned int>(arg));
+            }
+        }
+        else if (option == "stats")
+        {
+            api.PushTable(GCStatistics(state));
+        }
+        else if (option == "snapshot")
+        {
+            if (!api.CheckArgs(2, luna::ValueT_String, luna::ValueT_String))
+                return 0;
+
+            api.PushBool(state->WriteHeapSnapshot(api.GetCString(1)));
+        }
+        else if (option == "profile")
+        {
+            if (!api.CheckArgs(2, luna::ValueT_String, luna::ValueT_Number))
+                return 0;
+
+            auto &profiler = state->GetAllocProfiler();
+            auto arg = api.GetNumber(1);
+            if (arg >= 1)
+                profiler.Start(static_cast<std::size_t>(arg));
+            else
+                profiler.Stop();
+            api.PushNumber(0);
+        }
+        else if (option == "report")
+        {
+            std::ostringstream oss;
+            state->GetAllocProfiler().WriteReport(oss);
+            api.PushString(oss.str());
+        }
+        else if (option == "freeze")
+        {
+            gc.Freeze();
+            api.PushNumber(0);
+        }
+        else
+        {
+            return 0;
+        }
+
+        return 1;
+    }
+
     void RegisterLibBase(luna::State *state)
     {
         luna::Library lib(state);
@@ -205,9 +480,14 @@ namespace base {
         lib.RegisterFunc("puts", Puts);
         lib.RegisterFunc("ipairs", IPairs);
         lib.RegisterFunc("pairs", Pairs);
+        lib.RegisterFunc("next", Next);
+        state->SetTableIterators(Next, DoIPairs);
         lib.RegisterFunc("type", Type);
+        lib.RegisterFunc("tostring", ToString);
+        lib.RegisterFunc("tonumber", ToNumber);
         lib.RegisterFunc("getline", GetLine);
         lib.RegisterFunc("require", Require);
+        lib.RegisterFunc("collectgarbage", CollectGarbage);
     }
 
 } // namespace base
@@ -2,6 +2,7 @@
 #include "State.h"
 #include "String.h"
 #include "UserData.h"
+#include "Number.h"
 #include <cerrno>
 #include <cstring>
 #include <cstdio>
@@ -249,14 +250,16 @@ namespace io {
             if (type == luna::ValueT_String)
             {
                 auto str = api.GetString(i);
-                auto c_str = str->GetCStr();
+                auto c_str = str->GetData();
                 auto len = str->GetLength();
                 if (std::fwrite(c_str, len, 1, file) != 1)
                     return PushError(api);
             }
             else if (type == luna::ValueT_Number)
             {
-                if (std::fprintf(file, "%.14g", api.GetNumber(i)) < 0)
+                char buffer[luna::kMaxNumberLength];
+                auto len = luna::NumberToString(api.GetNumber(i), buffer);
+                if (std::fwrite(buffer, len, 1, file) != 1)
                     return PushError(api);
             }
             else
@@ -1,9 +1,16 @@
 #include "LibString.h"
+#include "State.h"
 #include "String.h"
+#include "Table.h"
+#include "Pattern.h"
+#include "Number.h"
+#include "Exception.h"
 #include <algorithm>
 #include <string>
 #include <cctype>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 
 namespace lib {
 namespace string {
@@ -29,7 +36,7 @@ namespace string {
             return 0;
 
         const luna::String *str = api.GetString(0);
-        const char *s = str->GetCStr();
+        const char *s = str->GetData();
         int len = str->GetLength();
         int count = 0;
 
@@ -37,7 +44,7 @@ namespace string {
         {
             if (index >= 0 && index < len)
             {
-                api.PushNumber(s[index]);
+                api.PushNumber(static_cast<unsigned char>(s[index]));
                 ++count;
             }
         }
@@ -85,7 +92,7 @@ namespace string {
 
         auto str = api.GetString(0);
         auto size = str->GetLength();
-        auto c_str = reinterpret_cast<const unsigned char *>(str->GetCStr());
+        auto c_str = reinterpret_cast<const unsigned char *>(str->GetData());
 
         std::string lower;
         lower.reserve(size);
@@ -104,7 +111,7 @@ namespace string {
 
         auto str = api.GetString(0);
         auto size = str->GetLength();
-        auto c_str = str->GetCStr();
+        auto c_str = str->GetData();
 
         std::string reverse;
         reverse.reserve(size);
@@ -115,6 +122,19 @@ namespace string {
         return 1;
     }
 
+    // Convert position of string to absolute position, negative position
+    // counts from the end of string
+    long long AbsolutePosition(double pos, std::size_t len)
+    {
+        auto p = static_cast<long long>(pos);
+        if (p >= 0)
+            return p;
+        else if (static_cast<std::size_t>(-p) > len)
+            return 0;
+        else
+            return static_cast<long long>(len) + p + 1;
+    }
+
     int Sub(luna::State *state)
     {
         luna::StackAPI api(state);
@@ -122,37 +142,601 @@ namespace string {
                            luna::ValueT_Number, luna::ValueT_Number))
             return 0;
 
-        auto str = api.GetString(0);
-        int size = str->GetLength();
-        auto c_str = str->GetCStr();
-        auto start = static_cast<int>(api.GetNumber(1));
+        auto size = static_cast<long long>(api.GetString(0)->GetLength());
+        auto start = AbsolutePosition(api.GetNumber(1), size);
         auto end = size;
+        if (api.GetStackSize() > 2)
+            end = AbsolutePosition(api.GetNumber(2), size);
 
-        auto params = api.GetStackSize();
-        if (params <= 2)
+        start = std::max(start, 1LL);
+        end = std::min(end, size);
+
+        // Long substring may be a slice of the string without copying
+        if (start <= end)
+            api.PushSubString(0, start - 1, end - start + 1);
+        else
+            api.PushString("", 0);
+        return 1;
+    }
+
+    // Get the start position of matching by the optional argument index
+    // of stack, return 0 when the argument is not a number
+    long long InitPosition(luna::StackAPI &api, int index, std::size_t len)
+    {
+        if (api.GetStackSize() <= index || api.GetValue(index)->IsNil())
+            return 1;
+
+        if (!api.IsNumber(index))
+        {
+            api.ArgTypeError(index, luna::ValueT_Number);
+            return 0;
+        }
+
+        return std::max(AbsolutePosition(api.GetNumber(index), len), 1LL);
+    }
+
+    // Push capture i of match, subject string is at the index of stack
+    // and data is the content of it
+    void PushCapture(luna::StackAPI &api, int subject, const char *data,
+                     const luna::Pattern::Match &match, int i)
+    {
+        if (match.capture_count_ == 0)
+        {
+            api.PushSubString(subject, match.begin_ - data,
+                              match.end_ - match.begin_);
+            return ;
+        }
+
+        const auto &capture = match.captures_[i];
+        if (capture.len_ == luna::Pattern::kPositionCapture)
+            api.PushNumber(static_cast<double>(capture.begin_ - data + 1));
+        else
+            api.PushSubString(subject, capture.begin_ - data, capture.len_);
+    }
+
+    // Push all captures of match, the whole match is the capture when
+    // there is no capture and whole is true, return count of pushed values
+    int PushCaptures(luna::StackAPI &api, int subject, const char *data,
+                     const luna::Pattern::Match &match, bool whole)
+    {
+        auto count = match.capture_count_ == 0 && whole ? 1 : match.capture_count_;
+        for (int i = 0; i < count; ++i)
+            PushCapture(api, subject, data, match, i);
+        return count;
+    }
+
+    // Find or match pattern in string
+    int FindAux(luna::State *state, bool find)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_String, luna::ValueT_String))
+            return 0;
+
+        auto size = api.GetString(0)->GetLength();
+        auto init = InitPosition(api, 2, size);
+        if (init == 0)
+            return 0;
+
+        if (init > static_cast<long long>(size) + 1)
+        {
+            api.PushNil();
+            return 1;
+        }
+
+        // Search plain string without compiling the pattern
+        auto p = api.GetString(1);
+        bool plain = find && api.GetStackSize() > 3 && !api.GetValue(3)->IsFalse();
+        if (find && (plain || !luna::Pattern::HasSpecials(p->GetData(), p->GetLength())))
+        {
+            auto data = api.GetString(0)->GetData();
+            auto pos = luna::Pattern::FindPlain(data + init - 1, data + size,
+                                                p->GetData(), p->GetLength());
+            if (!pos)
+            {
+                api.PushNil();
+                return 1;
+            }
+
+            api.PushNumber(static_cast<double>(pos - data + 1));
+            api.PushNumber(static_cast<double>(pos - data + p->GetLength()));
+            return 2;
+        }
+
+        // Pattern is held by shared_ptr, it may be evicted from cache
+        auto pattern = state->GetPatternCache().GetPattern(p);
+        auto data = api.GetString(0)->GetData();
+
+        luna::Pattern::Match match;
+        if (!pattern->Find(data, data + size, data + init - 1, match))
+        {
+            api.PushNil();
+            return 1;
+        }
+
+        if (!find)
+            return PushCaptures(api, 0, data, match, true);
+
+        api.PushNumber(static_cast<double>(match.begin_ - data + 1));
+        api.PushNumber(static_cast<double>(match.end_ - data));
+        return 2 + PushCaptures(api, 0, data, match, false);
+    }
+
+    int Find(luna::State *state)
+    {
+        return FindAux(state, true);
+    }
+
+    int Match(luna::State *state)
+    {
+        return FindAux(state, false);
+    }
+
+    // Iterator of gmatch, the state is a table of
+    // { string, pattern, start offset, end offset of last match }
+    int GMatchIterator(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Table))
+            return 0;
+
+        auto t = api.GetTable(0);
+        auto subject = api.GetStackSize();
+        api.PushValue(t->GetArrayValue(1));
+
+        auto pattern = state->GetPatternCache().GetPattern(t->GetArrayValue(2).str_);
+        auto pos = static_cast<std::size_t>(t->GetArrayValue(3).num_);
+        auto last = t->GetArrayValue(4).num_;
+
+        // Anchored pattern only matches at the start of string
+        if (pattern->IsAnchored() && pos > 0)
+            return 0;
+
+        auto str = api.GetString(subject);
+        auto data = str->GetData();
+        auto end = data + str->GetLength();
+
+        luna::Pattern::Match match;
+        for (auto s = data + pos; s <= end; s = match.begin_ + 1)
+        {
+            if (!pattern->Find(data, end, s, match))
+                break;
+
+            // Empty match at the end of last match is skipped
+            if (match.end_ - data != last)
+            {
+                auto e = static_cast<double>(match.end_ - data);
+                t->SetArrayValue(3, luna::Value(e));
+                t->SetArrayValue(4, luna::Value(e));
+                return PushCaptures(api, subject, data, match, true);
+            }
+
+            if (pattern->IsAnchored())
+                break;
+        }
+
+        return 0;
+    }
+
+    int GMatch(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_String, luna::ValueT_String))
+            return 0;
+
+        // Compile the pattern, then malformed pattern is reported here
+        state->GetPatternCache().GetPattern(api.GetString(1));
+
+        auto t = state->NewTable(4, 0);
+        t->SetArrayValue(1, *api.GetValue(0));
+        t->SetArrayValue(2, *api.GetValue(1));
+        t->SetArrayValue(3, luna::Value(0.0));
+        t->SetArrayValue(4, luna::Value(-1.0));
+        CHECK_BARRIER(state->GetGC(), t);
+
+        api.PushCFunction(GMatchIterator);
+        api.PushTable(t);
+        api.PushNil();
+        return 3;
+    }
+
+    // Append number to str as "%.14g"
+    void AppendNumber(std::string &str, double num)
+    {
+        char buffer[luna::kMaxNumberLength];
+        str.append(buffer, luna::NumberToString(num, buffer));
+    }
+
+    // Append replacement string of match to result, '%0' is the whole
+    // match, '%1' to '%9' are captures and '%%' is '%'
+    void AddString(luna::StackAPI &api, const char *data,
+                   const luna::Pattern::Match &match, std::string &result)
+    {
+        auto repl = api.GetString(2);
+        auto r = repl->GetData();
+        auto len = repl->GetLength();
+
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            if (r[i] != '%')
+            {
+                result.push_back(r[i]);
+                continue;
+            }
+
+            if (++i == len)
+                throw luna::CallCFuncException("invalid use of '%' in replacement string");
+
+            if (r[i] == '%')
+            {
+                result.push_back('%');
+            }
+            else if (r[i] == '0')
+            {
+                result.append(match.begin_, match.end_ - match.begin_);
+            }
+            else if (isdigit(static_cast<unsigned char>(r[i])))
+            {
+                int index = r[i] - '1';
+                if (match.capture_count_ == 0 && index == 0)
+                {
+                    result.append(match.begin_, match.end_ - match.begin_);
+                    continue;
+                }
+
+                if (index >= match.capture_count_)
+                    throw luna::CallCFuncException("invalid capture index %",
+                                                   index + 1, " in replacement string");
+
+                const auto &capture = match.captures_[index];
+                if (capture.len_ == luna::Pattern::kPositionCapture)
+                    AppendNumber(result, static_cast<double>(capture.begin_ - data + 1));
+                else
+                    result.append(capture.begin_, capture.len_);
+            }
+            else
+            {
+                throw luna::CallCFuncException("invalid use of '%' in replacement string");
+            }
+        }
+    }
+
+    // Append value of table or function replacement of match to result.
+    // GC may run in the function, so match is invalid after it.
+    void AddValue(luna::StackAPI &api, const char *data,
+                  const luna::Pattern::Match &match, std::string &result)
+    {
+        auto begin = match.begin_ - data;
+        auto len = match.end_ - match.begin_;
+
+        if (api.IsTable(2))
+        {
+            PushCapture(api, 0, data, match, 0);
+            auto value = api.GetTable(2)->GetValue(*api.GetValue(-1));
+            api.Pop(1);
+            api.PushValue(value);
+        }
+        else
+        {
+            api.PushValue(*api.GetValue(2));
+            auto count = PushCaptures(api, 0, data, match, true);
+            api.Call(count, 1);
+        }
+
+        auto value = api.GetValue(-1);
+        if (value->IsFalse())
+            result.append(api.GetString(0)->GetData() + begin, len);
+        else if (value->type_ == luna::ValueT_String)
+            result.append(value->str_->GetData(), value->str_->GetLength());
+        else if (value->type_ == luna::ValueT_Number)
+            AppendNumber(result, value->num_);
+        else
+            throw luna::CallCFuncException("invalid replacement value (a ",
+                                           value->TypeName(), ")");
+        api.Pop(1);
+    }
+
+    int GSub(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(3, luna::ValueT_String, luna::ValueT_String))
+            return 0;
+
+        auto repl_type = api.GetValueType(2);
+        if (repl_type != luna::ValueT_String && repl_type != luna::ValueT_Table &&
+            repl_type != luna::ValueT_Closure && repl_type != luna::ValueT_CFunction)
+        {
+            api.ArgTypeError(2, luna::ValueT_String);
+            return 0;
+        }
+
+        double max_count = HUGE_VAL;
+        if (api.GetStackSize() > 3 && !api.GetValue(3)->IsNil())
         {
-            if (start == 0)
+            if (!api.IsNumber(3))
             {
-                start = 1;
+                api.ArgTypeError(3, luna::ValueT_Number);
+                return 0;
             }
-            else if (start < 0)
+            max_count = api.GetNumber(3);
+        }
+
+        auto pattern = state->GetPatternCache().GetPattern(api.GetString(1));
+        auto size = api.GetString(0)->GetLength();
+
+        // Positions are offsets, GC may move the string when the
+        // replacement function is called
+        std::string result;
+        std::size_t pos = 0;
+        std::ptrdiff_t last = -1;
+        int count = 0;
+
+        while (count < max_count && pos <= size)
+        {
+            auto data = api.GetString(0)->GetData();
+            luna::Pattern::Match match;
+            if (!pattern->Find(data, data + size, data + pos, match))
+                break;
+
+            auto begin = static_cast<std::size_t>(match.begin_ - data);
+            auto end = static_cast<std::size_t>(match.end_ - data);
+            result.append(data + pos, begin - pos);
+
+            // Empty match at the end of last match is skipped
+            if (static_cast<std::ptrdiff_t>(end) == last)
             {
-                start += size;
-                start = start < 0 ? 1 : start + 1;
+                if (begin < size)
+                    result.push_back(data[begin]);
+                pos = begin + 1;
             }
+            else
+            {
+                if (repl_type == luna::ValueT_String)
+                    AddString(api, data, match, result);
+                else
+                    AddValue(api, data, match, result);
+
+                ++count;
+                pos = end;
+                last = end;
+            }
+
+            if (pattern->IsAnchored())
+                break;
+        }
+
+        if (count == 0)
+        {
+            api.PushValue(*api.GetValue(0));
         }
         else
         {
-            start = start == 0 ? 1 : std::abs(start);
-            end = std::abs(static_cast<int>(api.GetNumber(2)));
-            end = std::min(end, size);
+            if (pos < size)
+                result.append(api.GetString(0)->GetData() + pos, size - pos);
+            api.PushString(result);
         }
 
-        std::string sub;
-        for (int i = start; i <= end; ++i)
-            sub.push_back(c_str[i - 1]);
+        api.PushNumber(count);
+        return 2;
+    }
+
+    // Append quoted string which can be read back by lexer
+    void AddQuoted(const luna::String *str, std::string &result)
+    {
+        auto s = str->GetData();
+        auto len = str->GetLength();
+
+        result.push_back('"');
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            auto c = static_cast<unsigned char>(s[i]);
+            if (c == '"' || c == '\\')
+            {
+                result.push_back('\\');
+                result.push_back(c);
+            }
+            else if (c == '\n')
+            {
+                result.append("\\n");
+            }
+            else if (c == '\r')
+            {
+                result.append("\\r");
+            }
+            else if (c == '\0' || iscntrl(c))
+            {
+                char buffer[8];
+                if (i + 1 < len && isdigit(static_cast<unsigned char>(s[i + 1])))
+                    snprintf(buffer, sizeof(buffer), "\\%03d", c);
+                else
+                    snprintf(buffer, sizeof(buffer), "\\%d", c);
+                result.append(buffer);
+            }
+            else
+            {
+                result.push_back(c);
+            }
+        }
+        result.push_back('"');
+    }
+
+    // Append number which can be read back by lexer, "inf" and "nan"
+    // are not numbers for lexer, so they are written as expressions
+    void AddQuotedNumber(double num, std::string &result)
+    {
+        if (num != num)
+        {
+            result.append("(0/0)");
+        }
+        else if (std::isinf(num))
+        {
+            result.append(num > 0 ? "1e9999" : "-1e9999");
+        }
+        else if (std::floor(num) == num && std::fabs(num) <= luna::kMaxExactInteger)
+        {
+            // Exact integers are formatted with all digits, others need
+            // 17 digits
+            AppendNumber(result, num);
+        }
+        else
+        {
+            char buffer[luna::kMaxNumberLength];
+            snprintf(buffer, sizeof(buffer), "%.17g", num);
+            result.append(buffer);
+        }
+    }
+
+    // Format arguments like sprintf
+    int Format(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_String))
+            return 0;
+
+        auto fmt = api.GetString(0);
+        auto f = fmt->GetData();
+        auto end = f + fmt->GetLength();
+        auto params = api.GetStackSize();
+
+        // Max length of one formatted item, '%99.99f' of the max double
+        // is less than it
+        const std::size_t kMaxItemLength = 512;
+        char buffer[kMaxItemLength];
+
+        std::string result;
+        int arg = 0;
+        while (f < end)
+        {
+            if (*f != '%')
+            {
+                result.push_back(*f++);
+                continue;
+            }
+
+            if (++f < end && *f == '%')
+            {
+                result.push_back(*f++);
+                continue;
+            }
+
+            // Conversion spec: flags, width and precision of 2 digits
+            std::string spec("%");
+            while (f < end && strchr("-+ #0", *f) && *f != '\0')
+                spec.push_back(*f++);
+            for (int i = 0; i < 2 && f < end && isdigit(static_cast<unsigned char>(*f)); ++i)
+                spec.push_back(*f++);
+            bool has_precision = f < end && *f == '.';
+            if (has_precision)
+            {
+                spec.push_back(*f++);
+                for (int i = 0; i < 2 && f < end && isdigit(static_cast<unsigned char>(*f)); ++i)
+                    spec.push_back(*f++);
+            }
+
+            if (f == end || isdigit(static_cast<unsigned char>(*f)))
+                throw luna::CallCFuncException("invalid conversion '", spec, "' to 'format'");
+
+            auto conversion = *f++;
+            if (++arg >= params)
+                throw luna::CallCFuncException("bad argument #", arg + 1, " to 'format' (no value)");
+
+            switch (conversion)
+            {
+                case 'c': case 'd': case 'i':
+                case 'o': case 'u': case 'x': case 'X':
+                    {
+                        if (!api.IsNumber(arg))
+                        {
+                            api.ArgTypeError(arg, luna::ValueT_Number);
+                            return 0;
+                        }
+
+                        auto num = api.GetNumber(arg);
+                        if (std::floor(num) != num || std::fabs(num) >= 9.3e18)
+                            throw luna::CallCFuncException("bad argument #", arg + 1,
+                                                           " to 'format' (number has no integer representation)");
+
+                        if (conversion == 'c')
+                        {
+                            spec.push_back('c');
+                            snprintf(buffer, sizeof(buffer), spec.c_str(), static_cast<int>(num));
+                        }
+                        else
+                        {
+                            spec.append("ll");
+                            spec.push_back(conversion == 'i' ? 'd' : conversion);
+                            snprintf(buffer, sizeof(buffer), spec.c_str(), static_cast<long long>(num));
+                        }
+                        result.append(buffer);
+                    }
+                    break;
+                case 'a': case 'A': case 'e': case 'E':
+                case 'f': case 'F': case 'g': case 'G':
+                    if (!api.IsNumber(arg))
+                    {
+                        api.ArgTypeError(arg, luna::ValueT_Number);
+                        return 0;
+                    }
+
+                    spec.push_back(conversion);
+                    snprintf(buffer, sizeof(buffer), spec.c_str(), api.GetNumber(arg));
+                    result.append(buffer);
+                    break;
+                case 'q':
+                    if (api.IsString(arg))
+                    {
+                        AddQuoted(api.GetString(arg), result);
+                    }
+                    else if (api.IsNumber(arg))
+                    {
+                        AddQuotedNumber(api.GetNumber(arg), result);
+                    }
+                    else
+                    {
+                        api.ArgTypeError(arg, luna::ValueT_String);
+                        return 0;
+                    }
+                    break;
+                case 's':
+                    {
+                        std::string str;
+                        auto value = api.GetValue(arg);
+                        if (value->type_ == luna::ValueT_String)
+                            str.assign(value->str_->GetData(), value->str_->GetLength());
+                        else if (value->type_ == luna::ValueT_Number)
+                            AppendNumber(str, value->num_);
+                        else if (value->type_ == luna::ValueT_Nil)
+                            str = "nil";
+                        else if (value->type_ == luna::ValueT_Bool)
+                            str = value->bvalue_ ? "true" : "false";
+                        else
+                        {
+                            api.ArgTypeError(arg, luna::ValueT_String);
+                            return 0;
+                        }
+
+                        // Plain '%s' keeps the whole string
+                        if (spec.size() == 1)
+                        {
+                            result.append(str);
+                        }
+                        else
+                        {
+                            if (!has_precision && str.size() >= 100)
+                                throw luna::CallCFuncException("bad argument #", arg + 1,
+                                                               " to 'format' (string too long)");
+                            spec.push_back('s');
+                            snprintf(buffer, sizeof(buffer), spec.c_str(), str.c_str());
+                            result.append(buffer);
+                        }
+                    }
+                    break;
+                default:
+                    throw luna::CallCFuncException("invalid conversion '", spec,
+                                                   conversion, "' to 'format'");
+            }
+        }
 
-        api.PushString(sub);
+        api.PushString(result);
         return 1;
     }
 
@@ -164,7 +748,7 @@ namespace string {
 
         auto str = api.GetString(0);
         auto size = str->GetLength();
-        auto c_str = reinterpret_cast<const unsigned char *>(str->GetCStr());
+        auto c_str = reinterpret_cast<const unsigned char *>(str->GetData());
 
         std::string upper;
         upper.reserve(size);
@@ -181,8 +765,13 @@ namespace string {
         luna::TableMemberReg string[] = {
             { "byte", Byte },
             { "char", Char },
+            { "find", Find },
+            { "format", Format },
+            { "gmatch", GMatch },
+            { "gsub", GSub },
             { "len", Len },
             { "lower", Lower },
+            { "match", Match },
             { "reverse", Reverse },
             { "sub", Sub },
             { "upper", Upper }
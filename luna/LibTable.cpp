@@ -1,7 +1,12 @@
 #include "LibTable.h"
 #include "State.h"
 #include "Table.h"
-#include <sstream>
+#include "String.h"
+#include "Exception.h"
+#include "Number.h"
+#include <algorithm>
+#include <string>
+#include <vector>
 
 namespace lib {
 namespace table {
@@ -29,8 +34,10 @@ namespace table {
 
         auto table = api.GetTable(0);
         const char *sep = "";
-        std::size_t i = 1;
-        std::size_t j = table->ArraySize();
+        std::size_t sep_len = 0;
+        auto border = table->ArraySize();
+        double first = 1;
+        double last = static_cast<double>(border);
 
         auto params = api.GetStackSize();
         if (params > 1)
@@ -38,45 +45,80 @@ namespace table {
             // If the value of index 1 is string, then get the string as sep
             if (api.IsString(1))
             {
-                sep = api.GetString(1)->GetCStr();
+                sep = api.GetString(1)->GetData();
+                sep_len = api.GetString(1)->GetLength();
 
                 // Try to get the range of table
-                if (params > 2 && !GetNumber(api, 2, i))
+                if (params > 2 && !GetNumber(api, 2, first))
                     return 0;
 
-                if (params > 3 && !GetNumber(api, 3, j))
+                if (params > 3 && !GetNumber(api, 3, last))
                     return 0;
             }
             else
             {
                 // Try to get the range of table
-                if (!GetNumber(api, 1, i))
+                if (!GetNumber(api, 1, first))
                     return 0;
 
-                if (params > 2 && !GetNumber(api, 2, j))
+                if (params > 2 && !GetNumber(api, 2, last))
                     return 0;
             }
         }
 
-        luna::Value key;
-        key.type_ = luna::ValueT_Number;
+        // Range is clamped to [1, border] before it is converted to
+        // indices, values out of it are nil, and a huge range must not
+        // size a huge buffer
+        first = std::max(first, 1.0);
+        last = std::min(last, static_cast<double>(border));
+        if (!(first <= last))
+        {
+            api.PushString("", 0);
+            return 1;
+        }
 
-        // Concat values(number or string) of the range [i, j]
-        std::ostringstream oss;
-        for (; i <= j; ++i)
+        auto i = static_cast<std::size_t>(first);
+        auto j = static_cast<std::size_t>(last);
+
+        // Concat values(number or string) of the range [i, j], other
+        // values are skipped. Calculate length of result first, numbers
+        // are counted by max length of them, then write all values into
+        // the buffer once.
+        std::size_t length = 0;
+        for (auto index = i; index <= j; ++index)
         {
-            key.num_ = i;
-            auto value = table->GetValue(key);
+            auto value = table->GetArrayValue(index);
+            if (value.type_ == luna::ValueT_Number)
+                length += luna::kMaxNumberLength;
+            else if (value.type_ == luna::ValueT_String)
+                length += value.str_->GetLength();
+            if (index != j) length += sep_len;
+        }
 
+        std::string buffer(length, '\0');
+        auto begin = &buffer[0];
+        auto end = begin;
+        for (; i <= j; ++i)
+        {
+            auto value = table->GetArrayValue(i);
             if (value.type_ == luna::ValueT_Number)
-                oss << value.num_;
+            {
+                end += luna::NumberToString(value.num_, end);
+            }
             else if (value.type_ == luna::ValueT_String)
-                oss << value.str_->GetCStr();
+            {
+                memcpy(end, value.str_->GetData(), value.str_->GetLength());
+                end += value.str_->GetLength();
+            }
 
-            if (i != j) oss << sep;
+            if (i != j)
+            {
+                memcpy(end, sep, sep_len);
+                end += sep_len;
+            }
         }
 
-        api.PushString(oss.str());
+        api.PushString(begin, end - begin);
         return 1;
     }
 
@@ -99,7 +141,10 @@ namespace table {
             value = 2;
         }
 
-        api.PushBool(table->InsertArrayValue(index, *api.GetValue(value)));
+        auto result = table->InsertArrayValue(index, *api.GetValue(value));
+        CHECK_BARRIER(state->GetGC(), table);
+
+        api.PushBool(result);
         return 1;
     }
 
@@ -107,8 +152,8 @@ namespace table {
     {
         luna::StackAPI api(state);
 
-        auto table = state->NewTable();
         auto params = api.GetStackSize();
+        auto table = state->NewTable(params, 0);
         for (int i = 0; i < params; ++i)
             table->SetArrayValue(i + 1, *api.GetValue(i));
 
@@ -116,6 +161,29 @@ namespace table {
         return 1;
     }
 
+    // New table which array part and hash part are reserved
+    int New(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Number, luna::ValueT_Number))
+            return 0;
+
+        // Sizes are hints, clamp them before converting to size_t, then
+        // huge, infinite and NaN sizes are safe
+        auto size = [&](int index) -> std::size_t {
+            if (api.GetStackSize() <= index)
+                return 0;
+            auto num = api.GetNumber(index);
+            if (!(num > 0))
+                return 0;
+            auto max = static_cast<double>(luna::Table::kMaxReserveSize);
+            return static_cast<std::size_t>(std::min(num, max));
+        };
+
+        api.PushTable(state->NewTable(size(0), size(1)));
+        return 1;
+    }
+
     int Remove(luna::State *state)
     {
         luna::StackAPI api(state);
@@ -170,14 +238,300 @@ namespace table {
         return count;
     }
 
+    // Ranges not longer than it are sorted by insertion sort
+    const std::size_t kInsertionSortLength = 16;
+
+    // Introsort of [lo, hi] by less(i, j) and swap(i, j) of indices, it
+    // never accesses out of range even when less is an invalid order
+    template<typename Less, typename Swap>
+    void IntroSort(std::size_t lo, std::size_t hi, int depth,
+                   const Less &less, const Swap &swap)
+    {
+        while (lo < hi && hi - lo > kInsertionSortLength)
+        {
+            // Heap sort when partitions are too unbalanced
+            if (depth-- == 0)
+            {
+                auto sift_down = [&](std::size_t root, std::size_t end) {
+                    for (auto child = 2 * root + 1; child < end; child = 2 * root + 1)
+                    {
+                        if (child + 1 < end && less(lo + child, lo + child + 1))
+                            ++child;
+                        if (!less(lo + root, lo + child))
+                            return ;
+                        swap(lo + root, lo + child);
+                        root = child;
+                    }
+                };
+
+                auto count = hi - lo + 1;
+                for (auto i = count / 2; i-- > 0; )
+                    sift_down(i, count);
+                for (auto end = count - 1; end > 0; --end)
+                {
+                    swap(lo, lo + end);
+                    sift_down(0, end);
+                }
+                return ;
+            }
+
+            // Median of three, then a[lo] <= pivot <= a[hi], and move
+            // pivot to hi - 1
+            auto mid = lo + (hi - lo) / 2;
+            if (less(mid, lo))
+                swap(mid, lo);
+            if (less(hi, lo))
+                swap(hi, lo);
+            if (less(hi, mid))
+                swap(hi, mid);
+            auto pivot = hi - 1;
+            swap(mid, pivot);
+
+            auto i = lo;
+            auto j = pivot;
+            for (;;)
+            {
+                while (less(++i, pivot))
+                {
+                    if (i >= hi)
+                        throw luna::CallCFuncException("invalid order function for sorting");
+                }
+                while (less(pivot, --j))
+                {
+                    if (j <= lo)
+                        throw luna::CallCFuncException("invalid order function for sorting");
+                }
+                if (i >= j)
+                    break;
+                swap(i, j);
+            }
+            swap(i, pivot);
+
+            // Sort the smaller part by recursion, and the larger part by
+            // loop, then depth of recursion is O(log(n))
+            if (i - lo < hi - i)
+            {
+                IntroSort(lo, i - 1, depth, less, swap);
+                lo = i + 1;
+            }
+            else
+            {
+                IntroSort(i + 1, hi, depth, less, swap);
+                hi = i - 1;
+            }
+        }
+
+        for (auto i = lo + 1; i <= hi; ++i)
+        {
+            for (auto j = i; j > lo && less(j, j - 1); --j)
+                swap(j, j - 1);
+        }
+    }
+
+    luna::Value IndexKey(std::size_t index)
+    {
+        luna::Value key;
+        key.type_ = luna::ValueT_Number;
+        key.num_ = static_cast<double>(index);
+        return key;
+    }
+
+    // Get values of [1, size] of table, from array part directly when
+    // they are in it
+    std::vector<luna::Value> GetSequence(const luna::Table *table, std::size_t size)
+    {
+        std::vector<luna::Value> values;
+        values.reserve(size);
+        for (std::size_t i = 1; i <= size; ++i)
+            values.push_back(table->GetArrayValue(i));
+        return values;
+    }
+
+    // Set values to [1, values.size()] of table in one pass, keys are
+    // not constructed when they are in array part
+    void SetSequence(luna::Table *table, const std::vector<luna::Value> &values)
+    {
+        auto size = values.size();
+        if (table->IsInArrayPart(size))
+        {
+            for (std::size_t i = 0; i < size; ++i)
+                table->SetArrayPartValue(i + 1, values[i]);
+        }
+        else
+        {
+            for (std::size_t i = 0; i < size; ++i)
+                table->SetValue(IndexKey(i + 1), values[i]);
+        }
+    }
+
+    // Sort numbers or strings of table without calling back to VM,
+    // return false when values are not all numbers or all strings
+    bool SortValues(luna::Table *table, std::size_t size)
+    {
+        auto values = GetSequence(table, size);
+
+        auto type = values[0].type_;
+        for (const auto &value : values)
+        {
+            if (value.type_ != type)
+                return false;
+        }
+
+        if (type == luna::ValueT_Number)
+        {
+            // NaN is not ordered with any number, put NaNs in the end
+            std::vector<double> nums;
+            nums.reserve(size);
+            for (const auto &value : values)
+                nums.push_back(value.num_);
+            auto end = std::partition(nums.begin(), nums.end(),
+                                      [](double d) { return d == d; });
+            std::sort(nums.begin(), end);
+
+            for (std::size_t i = 0; i < size; ++i)
+                values[i] = luna::Value(nums[i]);
+        }
+        else if (type == luna::ValueT_String)
+        {
+            std::sort(values.begin(), values.end(),
+                      [](const luna::Value &l, const luna::Value &r) {
+                          return *l.str_ < *r.str_;
+                      });
+        }
+        else
+        {
+            return false;
+        }
+
+        SetSequence(table, values);
+        return true;
+    }
+
+    // Sort array of table, by the function 'comp' or '<'
+    int Sort(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Table))
+            return 0;
+
+        auto size = api.GetTable(0)->ArraySize();
+        if (size < 2)
+            return 0;
+
+        bool has_comp = api.GetStackSize() > 1 && !api.GetValue(1)->IsNil();
+        if (!has_comp)
+        {
+            if (!SortValues(api.GetTable(0), size))
+                throw luna::CallCFuncException("attempt to compare values of different types or neither numbers nor strings");
+            CHECK_BARRIER(state->GetGC(), api.GetTable(0));
+            return 0;
+        }
+
+        // Sort indices of values, values stay in the table while comp is
+        // called, so GC updates them when moves them. GC may move the
+        // table too, so get it from stack every time.
+        std::vector<std::size_t> order(size + 1);
+        for (std::size_t i = 1; i <= size; ++i)
+            order[i] = i;
+
+        auto less = [&](std::size_t i, std::size_t j) {
+            auto table = api.GetTable(0);
+            api.PushValue(*api.GetValue(1));
+            api.PushValue(table->GetArrayValue(order[i]));
+            api.PushValue(table->GetArrayValue(order[j]));
+            api.Call(2, 1);
+            auto result = !api.GetValue(api.GetStackSize() - 1)->IsFalse();
+            api.Pop(1);
+            return result;
+        };
+
+        auto swap = [&](std::size_t i, std::size_t j) {
+            std::swap(order[i], order[j]);
+        };
+
+        int depth = 0;
+        for (auto n = size; n > 1; n >>= 1)
+            depth += 2;
+
+        IntroSort(1, size, depth, less, swap);
+
+        // Move values to sorted order in one pass, GC does not run here
+        auto table = api.GetTable(0);
+        std::vector<luna::Value> values;
+        values.reserve(size);
+        for (std::size_t i = 1; i <= size; ++i)
+            values.push_back(table->GetArrayValue(order[i]));
+        SetSequence(table, values);
+        CHECK_BARRIER(state->GetGC(), table);
+        return 0;
+    }
+
+    // Set weak mode of table, mode could be "k"(weak keys), "v"(weak
+    // values), "kv"(weak keys and values), "e"(ephemeron, weak keys and
+    // values are alive only when keys are alive), ""(strong)
+    int SetMode(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_Table, luna::ValueT_String))
+            return 0;
+
+        std::string mode = api.GetCString(1);
+        luna::TableMode table_mode = luna::TableMode_Strong;
+        if (mode == "k")
+            table_mode = luna::TableMode_WeakKey;
+        else if (mode == "v")
+            table_mode = luna::TableMode_WeakValue;
+        else if (mode == "kv" || mode == "vk")
+            table_mode = luna::TableMode_WeakKeyValue;
+        else if (mode == "e")
+            table_mode = luna::TableMode_Ephemeron;
+        else if (!mode.empty())
+            return 0;
+
+        api.SetTableMode(0, table_mode);
+        api.PushValue(*api.GetValue(0));
+        return 1;
+    }
+
+    int GetMode(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Table))
+            return 0;
+
+        switch (api.GetTableMode(0))
+        {
+            case luna::TableMode_Strong:
+                api.PushString("");
+                break;
+            case luna::TableMode_WeakKey:
+                api.PushString("k");
+                break;
+            case luna::TableMode_WeakValue:
+                api.PushString("v");
+                break;
+            case luna::TableMode_WeakKeyValue:
+                api.PushString("kv");
+                break;
+            case luna::TableMode_Ephemeron:
+                api.PushString("e");
+                break;
+        }
+        return 1;
+    }
+
     void RegisterLibTable(luna::State *state)
     {
         luna::Library lib(state);
         luna::TableMemberReg table[] = {
             { "concat", Concat },
+            { "getmode", GetMode },
             { "insert", Insert },
+            { "new", New },
             { "pack", Pack },
             { "remove", Remove },
+            { "setmode", SetMode },
+            { "sort", Sort },
             { "unpack", Unpack }
         };
 
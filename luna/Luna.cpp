@@ -56,6 +56,9 @@ int main(int argc, const char **argv)
     lib::string::RegisterLibString(&state);
     lib::table::RegisterLibTable(&state);
 
+    // Libraries are alived with state, GC never traces them again
+    state.GetGC().Freeze();
+
     if (argc < 2)
     {
         Repl(state);
@@ -42,6 +42,7 @@ namespace luna
         Value key(state_->GetString(module_name));
         Value value = *(state_->stack_.top_ - 1);
         modules_->SetValue(key, value);
+        CHECK_BARRIER(state_->GetGC(), modules_);
     }
 
     void ModuleManager::LoadString(const std::string &str, const std::string &name)
@@ -0,0 +1,389 @@
+#include "Number.h"
+#include <string>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+    // Significant digits of "%.14g"
+    const int kPrecision = 14;
+
+    const uint64_t kPow10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL,
+        10000000000000000000ULL
+    };
+
+    // Powers of ten which are exact in double
+    const double kExactPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    inline bool IsDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    inline bool IsSpace(char c)
+    {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    // Value of hexadecimal digit, or -1 when c is not a hexadecimal digit
+    inline int HexValue(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // Write decimal digits of n into buffer, return count of digits
+    std::size_t IntegerToString(uint64_t n, char *buffer)
+    {
+        char digits[20];
+        std::size_t count = 0;
+        do
+        {
+            digits[count++] = static_cast<char>('0' + n % 10);
+            n /= 10;
+        } while (n != 0);
+
+        std::size_t len = 0;
+        while (count > 0)
+            buffer[len++] = digits[--count];
+        return len;
+    }
+
+    // Format kPrecision digits which the first digit is of decimal
+    // exponent exp, in fixed or exponent notation like "%g" does
+    std::size_t FormatDigits(bool negative, uint64_t digits, int exp, char *buffer)
+    {
+        char d[kPrecision];
+        for (int i = kPrecision - 1; i >= 0; --i)
+        {
+            d[i] = static_cast<char>('0' + digits % 10);
+            digits /= 10;
+        }
+
+        // Trailing zeros are removed
+        int count = kPrecision;
+        while (count > 1 && d[count - 1] == '0')
+            --count;
+
+        std::size_t len = 0;
+        if (negative)
+            buffer[len++] = '-';
+
+        if (exp < -4 || exp >= kPrecision)
+        {
+            buffer[len++] = d[0];
+            if (count > 1)
+            {
+                buffer[len++] = '.';
+                memcpy(buffer + len, d + 1, count - 1);
+                len += count - 1;
+            }
+
+            buffer[len++] = 'e';
+            buffer[len++] = exp < 0 ? '-' : '+';
+            if (exp > -10 && exp < 10)
+                buffer[len++] = '0';
+            len += IntegerToString(exp < 0 ? -exp : exp, buffer + len);
+        }
+        else if (exp >= 0)
+        {
+            for (int i = 0; i <= exp; ++i)
+                buffer[len++] = i < count ? d[i] : '0';
+
+            if (count > exp + 1)
+            {
+                buffer[len++] = '.';
+                memcpy(buffer + len, d + exp + 1, count - exp - 1);
+                len += count - exp - 1;
+            }
+        }
+        else
+        {
+            buffer[len++] = '0';
+            buffer[len++] = '.';
+            for (int i = -1; i > exp; --i)
+                buffer[len++] = '0';
+            memcpy(buffer + len, d, count);
+            len += count;
+        }
+
+        buffer[len] = '\0';
+        return len;
+    }
+
+#if defined(__SIZEOF_INT128__)
+    // Get kPrecision significant digits of num, which is in [1e-4, 1e14),
+    // rounded to nearest even by exact integer arithmetic. exp is decimal
+    // exponent of the first digit.
+    void GetDigits(double num, uint64_t &digits, int &exp)
+    {
+        // num = m * 2^-shift, shift is in [6, 66] for num in the range
+        int e2 = 0;
+        auto m = static_cast<uint64_t>(ldexp(frexp(num, &e2), 53));
+        auto shift = 53 - e2;
+
+        // Estimated exponent may be off by one, correct it by digits
+        exp = static_cast<int>(floor(log10(num)));
+        exp = exp < -4 ? -4 : (exp > kPrecision - 1 ? kPrecision - 1 : exp);
+
+        typedef unsigned __int128 uint128;
+        for (;;)
+        {
+            auto p = static_cast<uint128>(m) * kPow10[kPrecision - 1 - exp];
+            auto q = static_cast<uint64_t>(p >> shift);
+            if (q >= kPow10[kPrecision])
+            {
+                ++exp;
+                continue;
+            }
+            if (q < kPow10[kPrecision - 1])
+            {
+                --exp;
+                continue;
+            }
+
+            auto r = p & ((static_cast<uint128>(1) << shift) - 1);
+            auto half = static_cast<uint128>(1) << (shift - 1);
+            if (r > half || (r == half && (q & 1)))
+                ++q;
+
+            // Rounded up to the next power of ten
+            if (q == kPow10[kPrecision])
+            {
+                q = kPow10[kPrecision - 1];
+                ++exp;
+            }
+
+            digits = q;
+            return ;
+        }
+    }
+#endif // __SIZEOF_INT128__
+
+    // Convert number string which is checked already by strtod
+    double StrToD(const char *str, std::size_t len)
+    {
+        std::string s(str, len);
+        return strtod(s.c_str(), nullptr);
+    }
+
+    // Parse decimal number from str, return the end of number, or nullptr
+    // when str is not a number. When the significand has at most 19 digits
+    // and fits in double, and the exponent is small enough, the number is
+    // computed exactly by one multiplication or division.
+    const char * ParseDecimal(const char *str, const char *end, double &num)
+    {
+        uint64_t m = 0;
+        int digits = 0;
+        int exp = 0;
+        bool exact = true;
+        bool any = false;
+
+        auto p = str;
+        for (; p < end && IsDigit(*p); ++p)
+        {
+            any = true;
+            if (digits < 19)
+            {
+                if (m != 0 || *p != '0')
+                {
+                    m = m * 10 + (*p - '0');
+                    ++digits;
+                }
+            }
+            else
+            {
+                ++exp;
+                exact = exact && *p == '0';
+            }
+        }
+
+        if (p < end && *p == '.')
+        {
+            for (++p; p < end && IsDigit(*p); ++p)
+            {
+                any = true;
+                if (digits < 19)
+                {
+                    if (m != 0 || *p != '0')
+                    {
+                        m = m * 10 + (*p - '0');
+                        ++digits;
+                    }
+                    --exp;
+                }
+                else
+                {
+                    exact = exact && *p == '0';
+                }
+            }
+        }
+
+        if (!any)
+            return nullptr;
+
+        if (p < end && (*p == 'e' || *p == 'E'))
+        {
+            ++p;
+            bool negative = false;
+            if (p < end && (*p == '-' || *p == '+'))
+                negative = *p++ == '-';
+
+            if (p == end || !IsDigit(*p))
+                return nullptr;
+
+            int e = 0;
+            for (; p < end && IsDigit(*p); ++p)
+            {
+                if (e < 100000)
+                    e = e * 10 + (*p - '0');
+            }
+            exp += negative ? -e : e;
+        }
+
+        if (m == 0)
+            num = 0.0;
+        else if (exact && m <= (1ULL << 53) && exp >= -22 && exp <= 22)
+            num = exp < 0 ? m / kExactPow10[-exp] : m * kExactPow10[exp];
+        else
+            num = StrToD(str, p - str);
+        return p;
+    }
+
+    // Parse hexadecimal number after "0x" from str, return the end of
+    // number, or nullptr when str is not a number
+    const char * ParseHex(const char *str, const char *end, double &num)
+    {
+        uint64_t m = 0;
+        int exp = 0;
+        bool exact = true;
+        bool any = false;
+
+        auto p = str;
+        for (; p < end && HexValue(*p) >= 0; ++p)
+        {
+            any = true;
+            if ((m >> 60) == 0)
+                m = m * 16 + HexValue(*p);
+            else
+            {
+                exp += 4;
+                exact = exact && *p == '0';
+            }
+        }
+
+        if (p < end && *p == '.')
+        {
+            for (++p; p < end && HexValue(*p) >= 0; ++p)
+            {
+                any = true;
+                if ((m >> 60) == 0)
+                {
+                    m = m * 16 + HexValue(*p);
+                    exp -= 4;
+                }
+                else
+                {
+                    exact = exact && *p == '0';
+                }
+            }
+        }
+
+        if (!any)
+            return nullptr;
+
+        if (p < end && (*p == 'p' || *p == 'P'))
+        {
+            ++p;
+            bool negative = false;
+            if (p < end && (*p == '-' || *p == '+'))
+                negative = *p++ == '-';
+
+            if (p == end || !IsDigit(*p))
+                return nullptr;
+
+            int e = 0;
+            for (; p < end && IsDigit(*p); ++p)
+            {
+                if (e < 100000)
+                    e = e * 10 + (*p - '0');
+            }
+            exp += negative ? -e : e;
+        }
+
+        if (exact && m < (1ULL << 53))
+            num = ldexp(static_cast<double>(m), exp);
+        else
+            num = StrToD(str - 2, p - str + 2);
+        return p;
+    }
+} // namespace
+
+namespace luna
+{
+    std::size_t NumberToString(double num, char *buffer)
+    {
+        // Exact integers are formatted with all digits
+        if (floor(num) == num && fabs(num) <= kMaxExactInteger && !(num == 0 && signbit(num)))
+        {
+            std::size_t len = 0;
+            if (num < 0)
+                buffer[len++] = '-';
+            len += IntegerToString(static_cast<uint64_t>(fabs(num)), buffer + len);
+            buffer[len] = '\0';
+            return len;
+        }
+
+#if defined(__SIZEOF_INT128__)
+        auto abs = fabs(num);
+        if (abs >= 1e-4 && abs < 1e14)
+        {
+            uint64_t digits = 0;
+            int exp = 0;
+            GetDigits(abs, digits, exp);
+            return FormatDigits(num < 0, digits, exp, buffer);
+        }
+#endif // __SIZEOF_INT128__
+
+        return snprintf(buffer, kMaxNumberLength, "%.14g", num);
+    }
+
+    bool StringToNumber(const char *str, std::size_t len, double &num)
+    {
+        auto end = str + len;
+        while (str < end && IsSpace(*str))
+            ++str;
+        while (end > str && IsSpace(end[-1]))
+            --end;
+
+        bool negative = false;
+        if (str < end && (*str == '-' || *str == '+'))
+            negative = *str++ == '-';
+
+        const char *p = nullptr;
+        if (end - str >= 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+            p = ParseHex(str + 2, end, num);
+        else
+            p = ParseDecimal(str, end, num);
+
+        if (p != end)
+            return false;
+
+        if (negative)
+            num = -num;
+        return true;
+    }
+} // namespace luna
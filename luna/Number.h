@@ -0,0 +1,27 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include <cstddef>
+
+namespace luna
+{
+    // Buffer size for NumberToString, including the terminating '\0'
+    const std::size_t kMaxNumberLength = 32;
+
+    // Integers whose magnitude is not greater than it are exact in double
+    const double kMaxExactInteger = 9007199254740992.0;
+
+    // Format number same as "%.14g" into buffer which has
+    // kMaxNumberLength bytes at least, buffer is terminated by '\0'.
+    // Integers not greater than kMaxExactInteger in magnitude are
+    // formatted with all digits, so ids and timestamps keep exact.
+    // Return length of formatted number.
+    std::size_t NumberToString(double num, char *buffer);
+
+    // Convert decimal or hexadecimal number string of len bytes to
+    // number, leading and trailing spaces and a sign are allowed.
+    // Return false when the string is not a number.
+    bool StringToNumber(const char *str, std::size_t len, double &num);
+} // namespace luna
+
+#endif // NUMBER_H
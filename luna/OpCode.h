@@ -1,6 +1,8 @@
 #ifndef OP_CODE_H
 #define OP_CODE_H
 
+#include <stddef.h>
+
 namespace luna
 {
     enum OpType
@@ -32,18 +34,19 @@ namespace luna
         OpType_Div,                     // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_Pow,                     // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_Mod,                     // ABC  A: dst register B: operand1 register C: operand2 register
-        OpType_Concat,                  // ABC  A: dst register B: operand1 register C: operand2 register
+        OpType_Concat,                  // ABC  A: dst register B: first operand register C: operand count
         OpType_Less,                    // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_Greater,                 // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_Equal,                   // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_UnEqual,                 // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_LessEqual,               // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_GreaterEqual,            // ABC  A: dst register B: operand1 register C: operand2 register
-        OpType_NewTable,                // A    A: register of table
+        OpType_NewTable,                // ABC  A: register of table B: array size hint C: hash size hint, hints are encoded by Instruction::EncodeSize
         OpType_SetTable,                // ABC  A: register of table B: key register C: value register
         OpType_GetTable,                // ABC  A: register of table B: key register C: value register
         OpType_ForInit,                 // ABC  A: var register B: limit register    C: step register
         OpType_ForStep,                 // ABC  ABC same with OpType_ForInit, next instruction sBx: diff of instruction index
+        OpType_ForIter,                 // ABC  A: iterator function register B: first name register C: name count, next instruction sBx: diff of instruction index when table is iterated by built-in iterator
     };
 
     struct Instruction
@@ -112,6 +115,26 @@ namespace luna
             return Instruction(op, a, b, 0);
         }
 
+        // Encode size to 8 bits, size not less than 128 is rounded up to
+        // power of two
+        static int EncodeSize(size_t size)
+        {
+            if (size < 0x80)
+                return static_cast<int>(size);
+
+            int bits = 7;
+            while ((static_cast<size_t>(1) << bits) < size)
+                ++bits;
+            return 0x80 | bits;
+        }
+
+        static size_t DecodeSize(int code)
+        {
+            if (code < 0x80)
+                return code;
+            return static_cast<size_t>(1) << (code & 0x7F);
+        }
+
         static Instruction ACode(OpType op, int a)
         {
             return Instruction(op, a, 0, 0);
@@ -0,0 +1,542 @@
+#include "Pattern.h"
+#include "String.h"
+#include "Exception.h"
+#include <algorithm>
+#include <ctype.h>
+#include <string.h>
+
+namespace
+{
+    // Length of a capture which is not closed yet
+    const std::ptrdiff_t kUnfinishedCapture = -1;
+
+    const char kSpecials[] = "^$*+?.([%-";
+
+    inline unsigned char UChar(char c)
+    {
+        return static_cast<unsigned char>(c);
+    }
+
+    // Character c is in class cl or not, cl is the character after '%'
+    bool MatchClass(int c, int cl)
+    {
+        bool res = false;
+        switch (tolower(cl))
+        {
+            case 'a': res = isalpha(c) != 0; break;
+            case 'c': res = iscntrl(c) != 0; break;
+            case 'd': res = isdigit(c) != 0; break;
+            case 'g': res = isgraph(c) != 0; break;
+            case 'l': res = islower(c) != 0; break;
+            case 'p': res = ispunct(c) != 0; break;
+            case 's': res = isspace(c) != 0; break;
+            case 'u': res = isupper(c) != 0; break;
+            case 'w': res = isalnum(c) != 0; break;
+            case 'x': res = isxdigit(c) != 0; break;
+            default: return cl == c;
+        }
+
+        // Upper case class is the complement
+        return isupper(cl) ? !res : res;
+    }
+} // namespace
+
+namespace luna
+{
+    const int Pattern::kMaxCaptures;
+    const std::ptrdiff_t Pattern::kPositionCapture;
+
+    Pattern::Pattern(const char *pattern, std::size_t len)
+        : capture_count_(0), anchored_(false)
+    {
+        auto p = pattern;
+        auto end = pattern + len;
+        if (p < end && *p == '^')
+        {
+            anchored_ = true;
+            ++p;
+        }
+
+        // Captures which are not closed, and position captures, they can
+        // not be back referenced
+        std::vector<int> open;
+        std::vector<int> positions;
+        // Literal character of items, -1 when item is not a literal
+        std::vector<int> literals;
+
+        while (p < end)
+        {
+            Item item = { ItemType_Char, Repeat_One, -1, 0, 0, 0 };
+            int literal = -1;
+
+            switch (*p)
+            {
+                case '(':
+                    if (capture_count_ >= kMaxCaptures)
+                        throw CallCFuncException("too many captures");
+
+                    item.arg_ = capture_count_++;
+                    if (p + 1 < end && p[1] == ')')
+                    {
+                        item.type_ = ItemType_PositionCapture;
+                        positions.push_back(item.arg_);
+                        p += 2;
+                    }
+                    else
+                    {
+                        item.type_ = ItemType_CaptureBegin;
+                        open.push_back(item.arg_);
+                        ++p;
+                    }
+                    break;
+                case ')':
+                    if (open.empty())
+                        throw CallCFuncException("invalid pattern capture");
+
+                    item.type_ = ItemType_CaptureEnd;
+                    item.arg_ = open.back();
+                    open.pop_back();
+                    ++p;
+                    break;
+                case '$':
+                    if (p + 1 == end)
+                    {
+                        item.type_ = ItemType_End;
+                        ++p;
+                    }
+                    break;
+                case '%':
+                    if (p + 1 == end)
+                        throw CallCFuncException("malformed pattern (ends with '%')");
+
+                    if (p[1] == 'b')
+                    {
+                        if (end - p < 4)
+                            throw CallCFuncException("malformed pattern (missing arguments to '%b')");
+
+                        item.type_ = ItemType_Balance;
+                        item.open_ = p[2];
+                        item.close_ = p[3];
+                        p += 4;
+                    }
+                    else if (p[1] == 'f')
+                    {
+                        p += 2;
+                        if (p == end || *p != '[')
+                            throw CallCFuncException("missing '[' after '%f' in pattern");
+
+                        item.type_ = ItemType_Frontier;
+                        item.set_ = static_cast<int>(sets_.size());
+                        sets_.push_back(CharSet());
+                        p = CompileSet(p + 1, end, sets_.back());
+                    }
+                    else if (isdigit(UChar(p[1])))
+                    {
+                        int index = p[1] - '1';
+                        if (index < 0 || index >= capture_count_ ||
+                            std::find(open.begin(), open.end(), index) != open.end() ||
+                            std::find(positions.begin(), positions.end(), index) != positions.end())
+                            throw CallCFuncException("invalid capture index %", index + 1);
+
+                        item.type_ = ItemType_BackReference;
+                        item.arg_ = index;
+                        p += 2;
+                    }
+                    break;
+                default:
+                    break;
+            }
+
+            // Single character class with optional repetition
+            if (item.type_ == ItemType_Char)
+            {
+                item.set_ = static_cast<int>(sets_.size());
+                sets_.push_back(CharSet());
+                p = CompileClass(p, end, sets_.back(), literal);
+
+                if (p < end)
+                {
+                    switch (*p)
+                    {
+                        case '*': item.repeat_ = Repeat_Star; ++p; break;
+                        case '+': item.repeat_ = Repeat_Plus; ++p; break;
+                        case '-': item.repeat_ = Repeat_Lazy; ++p; break;
+                        case '?': item.repeat_ = Repeat_Optional; ++p; break;
+                        default: break;
+                    }
+                }
+
+                if (item.repeat_ != Repeat_One)
+                    literal = -1;
+            }
+
+            items_.push_back(item);
+            literals.push_back(literal);
+        }
+
+        if (!open.empty())
+            throw CallCFuncException("unfinished capture");
+
+        // Leading literal characters
+        for (std::size_t i = 0; i < literals.size() && literals[i] >= 0; ++i)
+            prefix_.push_back(static_cast<char>(literals[i]));
+    }
+
+    const char * Pattern::CompileClass(const char *p, const char *end,
+                                       CharSet &set, int &literal)
+    {
+        set.fill(false);
+        literal = -1;
+
+        switch (*p)
+        {
+            case '.':
+                set.fill(true);
+                return p + 1;
+            case '%':
+                for (int c = 0; c < 256; ++c)
+                    set[c] = MatchClass(c, UChar(p[1]));
+                if (!isalpha(UChar(p[1])))
+                    literal = UChar(p[1]);
+                return p + 2;
+            case '[':
+                return CompileSet(p + 1, end, set);
+            default:
+                set[UChar(*p)] = true;
+                literal = UChar(*p);
+                return p + 1;
+        }
+    }
+
+    const char * Pattern::CompileSet(const char *p, const char *end, CharSet &set)
+    {
+        set.fill(false);
+
+        bool complement = false;
+        if (p < end && *p == '^')
+        {
+            complement = true;
+            ++p;
+        }
+
+        // The first ']' is a character in set
+        for (bool first = true; ; first = false)
+        {
+            if (p == end)
+                throw CallCFuncException("malformed pattern (missing ']')");
+            if (*p == ']' && !first)
+                break;
+
+            if (*p == '%')
+            {
+                if (++p == end)
+                    throw CallCFuncException("malformed pattern (missing ']')");
+                for (int c = 0; c < 256; ++c)
+                    set[c] = set[c] || MatchClass(c, UChar(*p));
+                ++p;
+            }
+            else if (end - p > 2 && p[1] == '-' && p[2] != ']')
+            {
+                for (int c = UChar(p[0]); c <= UChar(p[2]); ++c)
+                    set[c] = true;
+                p += 3;
+            }
+            else
+            {
+                set[UChar(*p)] = true;
+                ++p;
+            }
+        }
+
+        if (complement)
+        {
+            for (auto &in : set)
+                in = !in;
+        }
+        return p + 1;
+    }
+
+    bool Pattern::Find(const char *begin, const char *end,
+                       const char *init, Match &match) const
+    {
+        if (anchored_)
+            return MatchAt(begin, end, init, match);
+
+        MatchState ms;
+        ms.begin_ = begin;
+        ms.end_ = end;
+
+        auto s = init;
+        if (!prefix_.empty())
+        {
+            // Search the literal prefix, then match remain items after it
+            while ((s = FindPlain(s, end, prefix_.data(), prefix_.size())))
+            {
+                ms.level_ = 0;
+                auto e = DoMatch(ms, s + prefix_.size(), prefix_.size());
+                if (e)
+                {
+                    SetMatch(ms, s, e, match);
+                    return true;
+                }
+                ++s;
+            }
+            return false;
+        }
+
+        if (!items_.empty() && items_[0].type_ == ItemType_Char &&
+            (items_[0].repeat_ == Repeat_One || items_[0].repeat_ == Repeat_Plus))
+        {
+            // Match starts with a character of the first set
+            const auto &set = sets_[items_[0].set_];
+            for (; s < end; ++s)
+            {
+                if (!set[UChar(*s)])
+                    continue;
+
+                ms.level_ = 0;
+                auto e = DoMatch(ms, s, 0);
+                if (e)
+                {
+                    SetMatch(ms, s, e, match);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        do
+        {
+            ms.level_ = 0;
+            auto e = DoMatch(ms, s, 0);
+            if (e)
+            {
+                SetMatch(ms, s, e, match);
+                return true;
+            }
+        } while (s++ < end);
+        return false;
+    }
+
+    bool Pattern::MatchAt(const char *begin, const char *end,
+                          const char *s, Match &match) const
+    {
+        MatchState ms;
+        ms.begin_ = begin;
+        ms.end_ = end;
+        ms.level_ = 0;
+
+        auto e = DoMatch(ms, s, 0);
+        if (!e)
+            return false;
+
+        SetMatch(ms, s, e, match);
+        return true;
+    }
+
+    const char * Pattern::FindPlain(const char *begin, const char *end,
+                                    const char *str, std::size_t len)
+    {
+        if (len == 0)
+            return begin;
+        if (end < begin || static_cast<std::size_t>(end - begin) < len)
+            return nullptr;
+
+        // Find the first character by memchr, then compare the others
+        auto last = end - len;
+        for (auto s = begin; s <= last; )
+        {
+            auto p = static_cast<const char *>(memchr(s, str[0], last - s + 1));
+            if (!p)
+                return nullptr;
+            if (memcmp(p + 1, str + 1, len - 1) == 0)
+                return p;
+            s = p + 1;
+        }
+        return nullptr;
+    }
+
+    bool Pattern::HasSpecials(const char *pattern, std::size_t len)
+    {
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            if (strchr(kSpecials, pattern[i]) && pattern[i] != '\0')
+                return true;
+        }
+        return false;
+    }
+
+    const char * Pattern::DoMatch(MatchState &ms, const char *s, std::size_t i) const
+    {
+        // Items which match once are matched in this loop, others recurse
+        // for the remain items, so depth of recursion is not more than
+        // count of items
+        for (; i < items_.size(); ++i)
+        {
+            const auto &item = items_[i];
+            switch (item.type_)
+            {
+                case ItemType_Char:
+                    {
+                        const auto &set = sets_[item.set_];
+                        bool matched = s < ms.end_ && set[UChar(*s)];
+                        switch (item.repeat_)
+                        {
+                            case Repeat_One:
+                                if (!matched)
+                                    return nullptr;
+                                ++s;
+                                break;
+                            case Repeat_Optional:
+                                if (matched)
+                                {
+                                    auto res = DoMatch(ms, s + 1, i + 1);
+                                    if (res)
+                                        return res;
+                                }
+                                break;
+                            case Repeat_Plus:
+                                return matched ? MaxExpand(ms, s + 1, i) : nullptr;
+                            case Repeat_Star:
+                                return MaxExpand(ms, s, i);
+                            case Repeat_Lazy:
+                                return MinExpand(ms, s, i);
+                        }
+                    }
+                    break;
+                case ItemType_CaptureBegin:
+                case ItemType_PositionCapture:
+                    {
+                        auto &capture = ms.captures_[ms.level_++];
+                        capture.begin_ = s;
+                        capture.len_ = item.type_ == ItemType_CaptureBegin ?
+                            kUnfinishedCapture : kPositionCapture;
+
+                        auto res = DoMatch(ms, s, i + 1);
+                        if (!res)
+                            --ms.level_;
+                        return res;
+                    }
+                case ItemType_CaptureEnd:
+                    {
+                        auto &capture = ms.captures_[item.arg_];
+                        capture.len_ = s - capture.begin_;
+
+                        auto res = DoMatch(ms, s, i + 1);
+                        if (!res)
+                            capture.len_ = kUnfinishedCapture;
+                        return res;
+                    }
+                case ItemType_BackReference:
+                    {
+                        const auto &capture = ms.captures_[item.arg_];
+                        auto len = capture.len_;
+                        if (ms.end_ - s < len || memcmp(capture.begin_, s, len) != 0)
+                            return nullptr;
+                        s += len;
+                    }
+                    break;
+                case ItemType_Balance:
+                    s = MatchBalance(ms, s, item);
+                    if (!s)
+                        return nullptr;
+                    break;
+                case ItemType_Frontier:
+                    {
+                        // Characters out of subject are '\0'
+                        const auto &set = sets_[item.set_];
+                        auto prev = s == ms.begin_ ? '\0' : s[-1];
+                        auto cur = s < ms.end_ ? *s : '\0';
+                        if (set[UChar(prev)] || !set[UChar(cur)])
+                            return nullptr;
+                    }
+                    break;
+                case ItemType_End:
+                    if (s != ms.end_)
+                        return nullptr;
+                    break;
+            }
+        }
+
+        return s;
+    }
+
+    const char * Pattern::MaxExpand(MatchState &ms, const char *s, std::size_t i) const
+    {
+        const auto &set = sets_[items_[i].set_];
+        auto e = s;
+        while (e < ms.end_ && set[UChar(*e)])
+            ++e;
+
+        // Try the longest sequence first
+        for (;;)
+        {
+            auto res = DoMatch(ms, e, i + 1);
+            if (res)
+                return res;
+            if (e == s)
+                return nullptr;
+            --e;
+        }
+    }
+
+    const char * Pattern::MinExpand(MatchState &ms, const char *s, std::size_t i) const
+    {
+        const auto &set = sets_[items_[i].set_];
+        for (;;)
+        {
+            auto res = DoMatch(ms, s, i + 1);
+            if (res)
+                return res;
+            if (s < ms.end_ && set[UChar(*s)])
+                ++s;
+            else
+                return nullptr;
+        }
+    }
+
+    const char * Pattern::MatchBalance(const MatchState &ms, const char *s,
+                                       const Item &item) const
+    {
+        if (s >= ms.end_ || *s != item.open_)
+            return nullptr;
+
+        int count = 1;
+        for (auto e = s + 1; e < ms.end_; ++e)
+        {
+            if (*e == item.close_)
+            {
+                if (--count == 0)
+                    return e + 1;
+            }
+            else if (*e == item.open_)
+            {
+                ++count;
+            }
+        }
+        return nullptr;
+    }
+
+    void Pattern::SetMatch(const MatchState &ms, const char *s,
+                           const char *e, Match &match) const
+    {
+        match.begin_ = s;
+        match.end_ = e;
+        match.capture_count_ = ms.level_;
+        std::copy(ms.captures_, ms.captures_ + ms.level_, match.captures_);
+    }
+
+    std::shared_ptr<const Pattern> PatternCache::GetPattern(const String *str)
+    {
+        auto &entry = entries_[str->GetHash() % kCacheSize];
+        if (entry.pattern_ &&
+            str->IsEqual(entry.source_.data(), entry.source_.size()))
+            return entry.pattern_;
+
+        // Compile before the entry changed, compiling may throw
+        auto pattern = std::make_shared<const Pattern>(str->GetData(), str->GetLength());
+        entry.source_.assign(str->GetData(), str->GetLength());
+        entry.pattern_ = pattern;
+        return pattern;
+    }
+} // namespace luna
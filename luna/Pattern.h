@@ -0,0 +1,173 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace luna
+{
+    class String;
+
+    // Lua pattern which is compiled to a sequence of items, single
+    // character classes and sets of items are compiled to tables of all
+    // 256 characters, so matching a character is one lookup.
+    class Pattern
+    {
+    public:
+        // Max count of captures in pattern
+        static const int kMaxCaptures = 32;
+        // Length of a position capture
+        static const std::ptrdiff_t kPositionCapture = -2;
+
+        struct Capture
+        {
+            const char *begin_;
+            std::ptrdiff_t len_;
+        };
+
+        // Result of matching, there is no capture when capture_count_ is
+        // 0, then the whole match is the capture
+        struct Match
+        {
+            const char *begin_;
+            const char *end_;
+            int capture_count_;
+            Capture captures_[kMaxCaptures];
+        };
+
+        // Compile pattern of len bytes, throw CallCFuncException when the
+        // pattern is malformed
+        Pattern(const char *pattern, std::size_t len);
+
+        Pattern(const Pattern &) = delete;
+        void operator = (const Pattern &) = delete;
+
+        // Pattern starts with '^', it only matches at the init position
+        bool IsAnchored() const
+        { return anchored_; }
+
+        // Find the first match of subject [begin, end) which starts from
+        // init, return true when found
+        bool Find(const char *begin, const char *end,
+                  const char *init, Match &match) const;
+
+        // Match subject [begin, end) at position s, return true when matched
+        bool MatchAt(const char *begin, const char *end,
+                     const char *s, Match &match) const;
+
+        // Find str of len bytes in subject [begin, end) without special
+        // characters, return nullptr when not found
+        static const char * FindPlain(const char *begin, const char *end,
+                                      const char *str, std::size_t len);
+
+        // Pattern has special characters or not
+        static bool HasSpecials(const char *pattern, std::size_t len);
+
+    private:
+        enum ItemType
+        {
+            ItemType_Char,              // Single character in set_
+            ItemType_CaptureBegin,      // '(' of capture arg_
+            ItemType_CaptureEnd,        // ')' of capture arg_
+            ItemType_PositionCapture,   // '()' of capture arg_
+            ItemType_BackReference,     // %1 to %9 of capture arg_
+            ItemType_Balance,           // %bxy
+            ItemType_Frontier,          // %f[set]
+            ItemType_End,               // '$' at end of pattern
+        };
+
+        enum Repeat
+        {
+            Repeat_One,                 // Match once
+            Repeat_Star,                // '*', longest sequence
+            Repeat_Plus,                // '+', longest sequence at least one
+            Repeat_Lazy,                // '-', shortest sequence
+            Repeat_Optional,            // '?', zero or one
+        };
+
+        typedef std::array<bool, 256> CharSet;
+
+        struct Item
+        {
+            ItemType type_;
+            Repeat repeat_;
+            int set_;                   // Index of CharSet
+            int arg_;                   // Capture index
+            char open_;                 // Open and close chars of %b
+            char close_;
+        };
+
+        // Captures and recursion state of matching
+        struct MatchState
+        {
+            const char *begin_;
+            const char *end_;
+            int level_;
+            Capture captures_[kMaxCaptures];
+        };
+
+        // Compile a single character class at p, return end of it.
+        // literal is the character when the class is a literal character,
+        // otherwise it is -1.
+        const char * CompileClass(const char *p, const char *end,
+                                  CharSet &set, int &literal);
+
+        // Compile a set which starts after '[', return end of it
+        const char * CompileSet(const char *p, const char *end, CharSet &set);
+
+        // Match items from index i at s, return end of match or nullptr
+        const char * DoMatch(MatchState &ms, const char *s, std::size_t i) const;
+
+        // Match longest or shortest sequence of item i at s
+        const char * MaxExpand(MatchState &ms, const char *s, std::size_t i) const;
+        const char * MinExpand(MatchState &ms, const char *s, std::size_t i) const;
+
+        // Match %bxy at s, return end of it or nullptr
+        const char * MatchBalance(const MatchState &ms, const char *s,
+                                  const Item &item) const;
+
+        // Copy result of matched state to match
+        void SetMatch(const MatchState &ms, const char *s,
+                      const char *e, Match &match) const;
+
+        std::vector<Item> items_;
+        std::vector<CharSet> sets_;
+        // Leading literal characters, they are searched by memchr
+        std::string prefix_;
+        int capture_count_;
+        bool anchored_;
+    };
+
+    // Cache of compiled patterns. Patterns are found by hash and content
+    // of pattern strings instead of addresses, because GC moves strings
+    // and reuses addresses of freed strings.
+    class PatternCache
+    {
+    public:
+        PatternCache() = default;
+
+        PatternCache(const PatternCache &) = delete;
+        void operator = (const PatternCache &) = delete;
+
+        // Get compiled pattern of str, compile it when it is not cached.
+        // Pattern is shared, so it is alive when it is evicted by a
+        // nested call while matching.
+        std::shared_ptr<const Pattern> GetPattern(const String *str);
+
+    private:
+        static const std::size_t kCacheSize = 64;
+
+        struct Entry
+        {
+            std::string source_;
+            std::shared_ptr<const Pattern> pattern_;
+        };
+
+        Entry entries_[kCacheSize];
+    };
+} // namespace luna
+
+#endif // PATTERN_H
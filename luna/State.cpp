@@ -7,30 +7,71 @@
 #include "Table.h"
 #include "TextInStream.h"
 #include "Exception.h"
+#include "HeapSnapshot.h"
+#include "AllocProfiler.h"
+#include "Pattern.h"
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+namespace
+{
+    // Substring is a slice when it is not shorter than kMinSliceLength,
+    // and the string is not longer than kMaxSliceRatio times of it, then
+    // small slices do not keep large strings alive
+    const std::size_t kMinSliceLength = 128;
+    const std::size_t kMaxSliceRatio = 16;
+} // namespace
 
 namespace luna
 {
 #define METATABLES "__metatables"
 #define MODULES_TABLE "__modules"
 
-    State::State()
+    State::State(bool sample_string_hash)
+        : sample_string_hash_(sample_string_hash),
+          next_iterator_(nullptr), inext_iterator_(nullptr)
     {
-        string_pool_.reset(new StringPool);
+        // Mix random device with time and address, random device may be
+        // deterministic on some platforms
+        std::random_device rd;
+        auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        std::seed_seq seq{ rd(), rd(), static_cast<unsigned int>(now),
+            static_cast<unsigned int>(reinterpret_cast<std::uintptr_t>(this)) };
+        unsigned int seed[2];
+        seq.generate(seed, seed + 2);
+        hash_seed_ = (static_cast<std::size_t>(seed[0]) << 16 << 16) ^ seed[1];
+
+        string_pool_.reset(new StringPool(hash_seed_));
 
         // Init GC
         gc_.reset(new GC([&](GCObject *obj, unsigned int type) {
             if (type == GCObjectType_String)
             {
-                string_pool_->DeleteString(static_cast<String *>(obj));
+                auto str = static_cast<String *>(obj);
+                if (str->IsInterned())
+                    string_pool_->DeleteString(str);
             }
-            delete obj;
         }));
+        gc_->SetMover([&](GCObject *old_obj, GCObject *new_obj, unsigned int type) {
+            if (type == GCObjectType_String)
+            {
+                auto new_str = static_cast<String *>(new_obj);
+                if (new_str->IsInterned())
+                    string_pool_->ReplaceString(static_cast<String *>(old_obj),
+                                                new_str);
+            }
+        });
         auto root = std::bind(&State::FullGCRoot, this, std::placeholders::_1);
         gc_->SetRootTraveller(root, root);
+        gc_->SetRootUpdater(std::bind(&State::UpdateGCRoot, this));
+        alloc_profiler_.reset(new AllocProfiler(this));
+        pattern_cache_.reset(new PatternCache);
 
-        // New global table
-        global_.table_ = NewTable();
+        // New global table, global table, metatables and modules table
+        // are alived with State, so put them in GCGen2
+        global_.table_ = gc_->NewTable(GCGen2);
         global_.type_ = ValueT_Table;
 
         // New table for store metatables
@@ -39,15 +80,16 @@ namespace luna
         k.str_ = GetString(METATABLES);
         Value v;
         v.type_ = ValueT_Table;
-        v.table_ = NewTable();
+        v.table_ = gc_->NewTable(GCGen2);
         global_.table_->SetValue(k, v);
 
         // New table for store modules
         k.type_ = ValueT_String;
         k.str_ = GetString(MODULES_TABLE);
         v.type_ = ValueT_Table;
-        v.table_ = NewTable();
+        v.table_ = gc_->NewTable(GCGen2);
         global_.table_->SetValue(k, v);
+        CHECK_BARRIER(GetGC(), global_.table_);
 
         // Init module manager
         module_manager_.reset(new ModuleManager(this, v.table_));
@@ -55,7 +97,7 @@ namespace luna
 
     State::~State()
     {
-        gc_->ResetDeleter();
+        gc_->ResetFinalizer();
     }
 
     bool State::IsModuleLoaded(const std::string &module_name) const
@@ -115,40 +157,80 @@ namespace luna
 
     String * State::GetString(const std::string &str)
     {
-        auto s = string_pool_->GetString(str);
-        if (!s)
-        {
-            s = gc_->NewString();
-            s->SetValue(str);
-            string_pool_->AddString(s);
-        }
-        return s;
+        return GetString(str.c_str(), str.size());
     }
 
     String * State::GetString(const char *str, std::size_t len)
     {
-        auto s = string_pool_->GetString(str, len);
+        if (len >= String::kLongStringLength)
+            return NewString(str, len);
+
+        return GetInternedString(str, len, HashString(str, len));
+    }
+
+    String * State::GetString(const char *str, std::size_t len, std::size_t hash)
+    {
+        // Long strings are not interned and hashed lazily
+        if (len >= String::kLongStringLength)
+            return NewString(str, len);
+
+        return GetInternedString(str, len, hash);
+    }
+
+    String * State::GetInternedString(const char *str, std::size_t len)
+    {
+        return GetInternedString(str, len, HashString(str, len));
+    }
+
+    String * State::GetInternedString(const char *str, std::size_t len,
+                                      std::size_t hash)
+    {
+        auto s = string_pool_->GetString(str, len, hash);
         if (!s)
         {
-            s = gc_->NewString();
-            s->SetValue(str, len);
+            s = NewString(str, len);
             string_pool_->AddString(s);
         }
         return s;
     }
 
-    String * State::GetString(const char *str)
+    String * State::NewRopeString(String *left, String *right)
     {
-        auto s = string_pool_->GetString(str);
-        if (!s)
-        {
-            s = gc_->NewString();
-            s->SetValue(str);
-            string_pool_->AddString(s);
-        }
+        auto s = gc_->NewString(GCGen0, String::kRopeInlineSize);
+        s->SetRope(left, right, hash_seed_, sample_string_hash_, gc_.get());
+        return s;
+    }
+
+    String * State::GetSubString(String *str, std::size_t offset, std::size_t len)
+    {
+        if (offset == 0 && len == str->GetLength())
+            return str;
+
+        if (len < kMinSliceLength || len * kMaxSliceRatio < str->GetLength())
+            return GetString(str->GetData() + offset, len);
+
+        auto s = gc_->NewString(GCGen0, String::kRopeInlineSize);
+        s->SetSlice(str, offset, len, hash_seed_, sample_string_hash_, gc_.get());
+        return s;
+    }
+
+    String * State::NewString(const char *str, std::size_t len)
+    {
+        auto s = gc_->NewString(GCGen0, len);
+        auto size = s->GetMemorySize();
+        s->SetValue(str, len, hash_seed_, sample_string_hash_);
+
+        // Count memory of string content when it is not inline
+        if (s->GetMemorySize() != size)
+            gc_->ChangeObjectMemory(s, s->GetMemorySize() - size);
         return s;
     }
 
+    String * State::GetString(const char *str)
+    {
+        return GetString(str, strlen(str));
+    }
+
     Function * State::NewFunction()
     {
         return gc_->NewFunction();
@@ -164,9 +246,12 @@ namespace luna
         return gc_->NewUpvalue();
     }
 
-    Table * State::NewTable()
+    Table * State::NewTable(std::size_t array_size, std::size_t hash_size)
     {
-        return gc_->NewTable();
+        auto t = gc_->NewTable();
+        if (array_size > 0 || hash_size > 0)
+            t->Reserve(array_size, hash_size);
+        return t;
     }
 
     UserData * State::NewUserData()
@@ -201,6 +286,7 @@ namespace luna
             metatable.type_ = ValueT_Table;
             metatable.table_ = NewTable();
             metatables->SetValue(k, metatable);
+            CHECK_BARRIER(GetGC(), metatables);
         }
 
         assert(metatable.type_ == ValueT_Table);
@@ -240,6 +326,30 @@ namespace luna
         }
     }
 
+    bool State::WriteHeapSnapshot(const std::string &file)
+    {
+        HeapSnapshot snapshot(*gc_);
+        snapshot.AddRoot("global", global_);
+
+        for (std::size_t i = 0; i < stack_.stack_.size(); ++i)
+        {
+            snapshot.AddRoot("stack[" + std::to_string(i) + "]",
+                             stack_.stack_[i]);
+        }
+
+        return snapshot.Write(file);
+    }
+
+    void State::UpdateGCRoot()
+    {
+        global_.UpdateReference();
+
+        for (auto &value : stack_.stack_)
+        {
+            value.UpdateReference();
+        }
+    }
+
     Table * State::GetMetatables()
     {
         Value k;
@@ -295,12 +405,23 @@ namespace luna
         callee.register_ = f + 1;
         callee.func_ = f;
         callee.expect_result_ = expect_result;
+        auto calls_count = calls_.size();
         calls_.push_back(callee);
 
-        // Call c function
+        // Call c function, c function may call functions which throw
+        // exceptions, pop the CallInfos of them and the c function
         CFunctionType cfunc = f->cfunc_;
         ClearCFunctionError();
-        int res_count = cfunc(this);
+        int res_count = 0;
+        try
+        {
+            res_count = cfunc(this);
+        }
+        catch (...)
+        {
+            calls_.resize(calls_count);
+            throw;
+        }
         CheckCFunctionError();
 
         Value *src = nullptr;
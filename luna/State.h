@@ -13,6 +13,8 @@
 namespace luna
 {
     class VM;
+    class AllocProfiler;
+    class PatternCache;
 
     // Error type reported by called c function
     enum CFuntionErrorType
@@ -46,8 +48,11 @@ namespace luna
         friend class Library;
         friend class ModuleManager;
         friend class CodeGenerateVisitor;
+        friend class AllocProfiler;
     public:
-        State();
+        // When sample_string_hash is true, only part of very long
+        // strings is hashed, it is faster, but easier to be collided
+        explicit State(bool sample_string_hash = false);
         ~State();
 
         State(const State&) = delete;
@@ -78,10 +83,27 @@ namespace luna
         String * GetString(const std::string &str);
         String * GetString(const char *str, std::size_t len);
         String * GetString(const char *str);
+        // Get string with precomputed hash, hash must be HashString of
+        // str, then str is not hashed again
+        String * GetString(const char *str, std::size_t len, std::size_t hash);
+        // Hash str with the hash seed of this State
+        std::size_t HashString(const char *str, std::size_t len) const
+        { return String::Hash(str, len, hash_seed_, sample_string_hash_); }
+        // New rope string of left concat right, content of left and
+        // right is not copied until it is used
+        String * NewRopeString(String *left, String *right);
+        // Get substring of len bytes from offset of str, short substring
+        // is interned, long substring which is not much shorter than str
+        // is a slice referencing content of str, others are copied
+        String * GetSubString(String *str, std::size_t offset, std::size_t len);
+        // Get interned string even when it is a long string, interned
+        // strings with same content have the same address
+        String * GetInternedString(const char *str, std::size_t len);
         Function * NewFunction();
         Closure * NewClosure();
         Upvalue * NewUpvalue();
-        Table * NewTable();
+        // Array part and hash part of table are reserved by sizes
+        Table * NewTable(std::size_t array_size = 0, std::size_t hash_size = 0);
         UserData * NewUserData();
 
         // Get current CallInfo
@@ -104,16 +126,41 @@ namespace luna
         CFunctionError * GetCFunctionErrorData()
         { return &cfunc_error_; }
 
+        // Set iterator functions returned by pairs and ipairs, generic
+        // for iterates tables directly when they are the iterators
+        void SetTableIterators(CFunctionType next, CFunctionType inext)
+        { next_iterator_ = next; inext_iterator_ = inext; }
+
         // Get the GC
         GC& GetGC() { return *gc_; }
 
         // Check and run GC
         void CheckRunGC() { gc_->CheckGC(); }
 
+        // Get allocation profiler of GC objects
+        AllocProfiler & GetAllocProfiler() { return *alloc_profiler_; }
+
+        // Get cache of compiled string patterns
+        PatternCache & GetPatternCache() { return *pattern_cache_; }
+
+        // Write heap snapshot of all GC objects with roots of global
+        // table and stack to file, return false when write failed
+        bool WriteHeapSnapshot(const std::string &file);
+
     private:
         // Full GC root
         void FullGCRoot(GCObjectVisitor *v);
 
+        // Update GC root references after GC moved objects
+        void UpdateGCRoot();
+
+        // Get interned string by precomputed hash
+        String * GetInternedString(const char *str, std::size_t len,
+                                   std::size_t hash);
+
+        // New a string which is not interned
+        String * NewString(const char *str, std::size_t len);
+
         // For CallFunction
         void CallClosure(Value *f, int expect_result);
         void CallCFunction(Value *f, int expect_result);
@@ -122,12 +169,22 @@ namespace luna
         // Get the table which stores all metatables
         Table * GetMetatables();
 
+        // Random hash seed of strings, strings are hashed differently
+        // in each State, then colliding keys can not be precomputed
+        std::size_t hash_seed_;
+        // Sample very long strings when hash them or not
+        bool sample_string_hash_;
+
         // Manage all modules
         std::unique_ptr<ModuleManager> module_manager_;
         // All strings in the pool
         std::unique_ptr<StringPool> string_pool_;
         // The GC
         std::unique_ptr<GC> gc_;
+        // Allocation profiler
+        std::unique_ptr<AllocProfiler> alloc_profiler_;
+        // Compiled string patterns
+        std::unique_ptr<PatternCache> pattern_cache_;
 
         // Error of call c function
         CFunctionError cfunc_error_;
@@ -138,6 +195,9 @@ namespace luna
         std::list<CallInfo> calls_;
         // Global table
         Value global_;
+        // Built-in iterator functions of pairs and ipairs
+        CFunctionType next_iterator_;
+        CFunctionType inext_iterator_;
     };
 } // namespace luna
 
@@ -1,9 +1,66 @@
 #include "String.h"
+#include <new>
+#include <vector>
+#include <assert.h>
+#include <stdint.h>
+
+namespace
+{
+    const uint64_t kHashK0 = 0xa0761d6478bd642fULL;
+    const uint64_t kHashK1 = 0xe7037ed1a0b428dbULL;
+
+    inline uint64_t Load64(const char *p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint64_t Load32(const char *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // Multiply a and b to 128 bits, fold high and low 64 bits by xor
+    inline uint64_t Mix(uint64_t a, uint64_t b)
+    {
+#if defined(__SIZEOF_INT128__)
+        auto r = static_cast<unsigned __int128>(a) * b;
+        return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+#else
+        auto ha = a >> 32, la = a & 0xffffffff;
+        auto hb = b >> 32, lb = b & 0xffffffff;
+        auto hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+        auto t = ll + (hl << 32);
+        uint64_t carry = t < ll;
+        auto lo = t + (lh << 32);
+        carry += lo < t;
+        auto hi = hh + (hl >> 32) + (lh >> 32) + carry;
+        return lo ^ hi;
+#endif
+    }
+
+    // Hash 16 bytes block at p into h
+    inline uint64_t MixBlock(const char *p, uint64_t h)
+    {
+        return Mix(Load64(p) ^ kHashK1, Load64(p + 8) ^ h);
+    }
+} // namespace
 
 namespace luna
 {
+    const std::size_t String::kHashSeed;
+    const std::size_t String::kHashSampleLength;
+    const std::size_t String::kHashSampleBlocks;
+    const std::size_t String::kLongStringLength;
+    const std::size_t String::kRopeInlineSize;
+
     String::String()
-        : in_heap_(0), str_(nullptr), length_(0), hash_(0)
+        : str_(""), length_(0), inline_size_(0), owned_(0),
+          hashed_(1), interned_(0), sample_hash_(0), slice_(0),
+          hash_(Hash(nullptr, 0))
     {
     }
 
@@ -15,16 +72,213 @@ namespace luna
 
     String::~String()
     {
-        if (in_heap_)
+        if (owned_)
             delete [] str_;
     }
 
+    String * String::ConstructInline(void *mem, std::size_t inline_size)
+    {
+        assert(inline_size > 0);
+        auto s = new (mem) String;
+        s->inline_size_ = static_cast<unsigned int>(inline_size);
+
+        auto storage = s->GetInlineStorage();
+        storage[0] = 0;
+        s->str_ = storage;
+        return s;
+    }
+
+    String * String::ConstructMoved(void *mem, String *other)
+    {
+        auto s = new (mem) String;
+        static_cast<GCObject &>(*s) = *other;
+        s->length_ = other->length_;
+        s->inline_size_ = other->inline_size_;
+        s->owned_ = other->owned_;
+        s->hashed_ = other->hashed_;
+        s->interned_ = other->interned_;
+        s->sample_hash_ = other->sample_hash_;
+        s->slice_ = other->slice_;
+        s->hash_ = other->hash_;
+
+        if (other->owned_)
+        {
+            // Take heap content, other keeps inline_size_, GC steps over
+            // its memory block by that
+            s->str_ = other->str_;
+            other->str_ = "";
+            other->owned_ = 0;
+            other->length_ = 0;
+        }
+        else if (other->inline_size_ > 0)
+        {
+            // Content, children of rope or string of slice are in inline
+            // storage
+            auto storage = s->GetInlineStorage();
+            memcpy(storage, other->GetInlineStorage(), other->inline_size_);
+            s->str_ = other->HasReferences() ? nullptr : storage;
+        }
+        return s;
+    }
+
+    void String::Accept(GCObjectVisitor *v)
+    {
+        if (v->Visit(this))
+        {
+            if (IsRope())
+            {
+                auto children = GetRopeChildren();
+                children[0]->Accept(v);
+                children[1]->Accept(v);
+            }
+            else if (IsSlice())
+            {
+                GetSlice()->str_->Accept(v);
+            }
+        }
+    }
+
+    void String::UpdateReferences()
+    {
+        if (IsRope())
+        {
+            auto children = GetRopeChildren();
+            UpdateReference(children[0]);
+            UpdateReference(children[1]);
+        }
+        else if (IsSlice())
+        {
+            UpdateReference(GetSlice()->str_);
+        }
+    }
+
     std::string String::GetStdString() const
     {
-        if (in_heap_)
-            return std::string(str_, length_);
-        else
-            return std::string(str_buffer_, length_);
+        return std::string(GetData(), length_);
+    }
+
+    void String::SetRope(String *left, String *right,
+                         std::size_t seed, bool sample, GC *gc)
+    {
+        assert(inline_size_ >= kRopeInlineSize);
+        if (owned_)
+            delete [] str_;
+
+        auto children = GetRopeChildren();
+        children[0] = left;
+        children[1] = right;
+        GetReferenceGC() = gc;
+
+        str_ = nullptr;
+        owned_ = 0;
+        slice_ = 0;
+        length_ = left->length_ + right->length_;
+        hashed_ = 0;
+        sample_hash_ = sample ? 1 : 0;
+        hash_ = seed;
+    }
+
+    void String::SetSlice(String *other, std::size_t offset, std::size_t len,
+                          std::size_t seed, bool sample, GC *gc)
+    {
+        assert(inline_size_ >= kRopeInlineSize);
+        assert(offset + len <= other->length_);
+        if (owned_)
+            delete [] str_;
+
+        // Reference the string which owns the content
+        if (other->IsSlice())
+        {
+            offset += other->GetSlice()->offset_;
+            other = other->GetSlice()->str_;
+        }
+        else if (other->IsRope())
+        {
+            other->Flatten();
+        }
+
+        auto slice = GetSlice();
+        slice->str_ = other;
+        slice->offset_ = offset;
+        GetReferenceGC() = gc;
+
+        str_ = nullptr;
+        owned_ = 0;
+        slice_ = 1;
+        length_ = len;
+        hashed_ = 0;
+        sample_hash_ = sample ? 1 : 0;
+        hash_ = seed;
+    }
+
+    const char * String::GetSliceData() const
+    {
+        return GetSlice()->str_->str_ + GetSlice()->offset_;
+    }
+
+    const char * String::GetReferencedData() const
+    {
+        return slice_ ? GetSliceData() : Flatten();
+    }
+
+    void String::ReportFlattenedMemory() const
+    {
+        // Owned content is counted by GetMemorySize after flattened, and
+        // GC counts it as freed when string is destroyed
+        auto gc = GetReferenceGC();
+        if (gc)
+            gc->ChangeObjectMemory(this, static_cast<std::ptrdiff_t>(length_ + 1));
+    }
+
+    const char * String::Flatten() const
+    {
+        auto buffer = new char[length_ + 1];
+        buffer[length_] = 0;
+
+        if (IsSlice())
+        {
+            memcpy(buffer, GetSliceData(), length_);
+            GetSlice()->str_ = nullptr;
+
+            str_ = buffer;
+            owned_ = 1;
+            slice_ = 0;
+            ReportFlattenedMemory();
+            return str_;
+        }
+
+        // Copy strings from right to left, left deep rope which is built by
+        // appending keeps only two nodes in stack
+        auto end = buffer + length_;
+        std::vector<const String *> nodes(1, this);
+        while (!nodes.empty())
+        {
+            auto s = nodes.back();
+            nodes.pop_back();
+
+            if (s->IsRope())
+            {
+                auto children = s->GetRopeChildren();
+                nodes.push_back(children[0]);
+                nodes.push_back(children[1]);
+            }
+            else
+            {
+                end -= s->length_;
+                memcpy(end, s->GetData(), s->length_);
+            }
+        }
+        assert(end == buffer);
+
+        // Release left and right strings
+        auto children = GetRopeChildren();
+        children[0] = nullptr;
+        children[1] = nullptr;
+
+        str_ = buffer;
+        owned_ = 1;
+        ReportFlattenedMemory();
+        return str_;
     }
 
     void String::SetValue(const std::string &str)
@@ -37,35 +291,78 @@ namespace luna
         SetValue(str, strlen(str));
     }
 
-    void String::SetValue(const char *str, std::size_t len)
+    void String::SetValue(const char *str, std::size_t len,
+                          std::size_t seed, bool sample)
     {
-        if (in_heap_)
+        // str may be the content of this string, so free old content
+        // after copied
+        char *buffer = len < inline_size_ ? GetInlineStorage() : new char[len + 1];
+        memmove(buffer, str, len);
+        buffer[len] = 0;
+
+        if (owned_)
             delete [] str_;
 
+        str_ = buffer;
         length_ = len;
-        if (len < sizeof(str_buffer_))
+        owned_ = len < inline_size_ ? 0 : 1;
+        slice_ = 0;
+
+        // Long string is hashed lazily
+        hashed_ = 0;
+        sample_hash_ = sample ? 1 : 0;
+        hash_ = seed;
+        if (!IsLong())
+            GetHash();
+    }
+
+    std::size_t String::Hash(const char *str, std::size_t len,
+                             std::size_t seed, bool sample)
+    {
+        // Read 8 bytes at a time and mix them by 128 bits multiplication,
+        // length is mixed in, so embedded zeros are hashed as well
+        uint64_t h = seed ^ Mix(seed ^ kHashK0, kHashK1);
+        uint64_t a = 0;
+        uint64_t b = 0;
+
+        if (len <= 16)
         {
-            memcpy(str_buffer_, str, len);
-            str_buffer_[len] = 0;
-            in_heap_ = 0;
-            Hash(str_buffer_);
+            if (len >= 4)
+            {
+                // Overlapped loads cover all bytes of 4 to 16
+                auto off = (len >> 3) << 2;
+                a = (Load32(str) << 32) | Load32(str + off);
+                b = (Load32(str + len - 4) << 32) | Load32(str + len - 4 - off);
+            }
+            else if (len > 0)
+            {
+                a = (static_cast<uint64_t>(static_cast<unsigned char>(str[0])) << 16) |
+                    (static_cast<uint64_t>(static_cast<unsigned char>(str[len >> 1])) << 8) |
+                    static_cast<unsigned char>(str[len - 1]);
+            }
         }
         else
         {
-            str_ = new char[len + 1];
-            memcpy(str_, str, len);
-            str_[len] = 0;
-            in_heap_ = 1;
-            Hash(str_);
-        }
-    }
+            if (sample && len > kHashSampleLength)
+            {
+                // Hash blocks spread over whole string
+                auto step = (len - 16) / kHashSampleBlocks;
+                for (std::size_t i = 0; i < kHashSampleBlocks; ++i)
+                    h = MixBlock(str + i * step, h);
+            }
+            else
+            {
+                std::size_t i = 0;
+                for (; i + 16 < len; i += 16)
+                    h = MixBlock(str + i, h);
+            }
 
-    void String::Hash(const char *s)
-    {
-        hash_ = 5381;
-        int c = 0;
+            // Last 16 bytes are always hashed
+            a = Load64(str + len - 16);
+            b = Load64(str + len - 8);
+        }
 
-        while ((c = *s++))
-            hash_ = ((hash_ << 5) + hash_) + c;
+        auto hash = Mix(kHashK1 ^ len, Mix(a ^ kHashK1, b ^ h));
+        return static_cast<std::size_t>(hash);
     }
 } // namespace luna
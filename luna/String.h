@@ -8,8 +8,11 @@
 
 namespace luna
 {
-    class String : public GCObject
+    // String allocated by GC stores its content in the same memory block
+    // after the String object, other strings store content in heap
+    class String final : public GCObject
     {
+        friend class GC;
     public:
         String();
         explicit String(const char *str);
@@ -18,32 +21,120 @@ namespace luna
         String(const String &) = delete;
         void operator = (const String &) = delete;
 
-        virtual void Accept(GCObjectVisitor *v)
-        { v->Visit(this); }
+        // String may be allocated with inline storage by GC, memory of
+        // it is freed as a whole
+        static void operator delete(void *ptr)
+        { ::operator delete(ptr); }
 
+        virtual void Accept(GCObjectVisitor *v);
+        virtual void UpdateReferences();
+
+        virtual std::size_t GetMemorySize() const
+        { return GetAllocSize() + (owned_ ? length_ + 1 : 0); }
+
+        // Hash of long string is calculated when it is used first time,
+        // hash_ stores the seed before that. Slice is flattened when it is
+        // hashed, then a table key does not keep the whole string alive.
         std::size_t GetHash() const
-        { return hash_; }
+        {
+            if (!hashed_)
+            {
+                hash_ = Hash(GetCStr(), length_, hash_, sample_hash_ != 0);
+                hashed_ = 1;
+            }
+            return hash_;
+        }
+
+        // Long strings are not interned by State, they are compared by
+        // content, short strings are compared by address
+        bool IsLong() const
+        { return length_ >= kLongStringLength; }
+
+        // String is in StringPool or not
+        bool IsInterned() const
+        { return interned_ != 0; }
+
+        void SetInterned(bool interned)
+        { interned_ = interned ? 1 : 0; }
 
         std::size_t GetLength() const
         { return length_; }
 
+        // Content of string, it is not terminated by '\0' when string is
+        // a slice, use GetCStr when a C string is needed
+        const char * GetData() const
+        { return str_ ? str_ : GetReferencedData(); }
+
+        // Rope and slice are flattened when C string is used first time
         const char * GetCStr() const
-        { return in_heap_ ? str_ : str_buffer_; }
+        { return str_ ? str_ : Flatten(); }
+
+        // String is a rope which content is not flattened yet
+        bool IsRope() const
+        { return str_ == nullptr && !slice_; }
+
+        // String is a slice of another string which is not flattened yet
+        bool IsSlice() const
+        { return str_ == nullptr && slice_; }
+
+        // String references other strings as a rope or slice
+        bool HasReferences() const
+        { return str_ == nullptr; }
+
+        // Make this string the concatenation of left and right without
+        // copying them, string must be allocated by GC with inline storage
+        // of kRopeInlineSize bytes at least, left and right are referenced
+        // until content is flattened. Memory of flattened content is
+        // reported to gc when it is not nullptr.
+        void SetRope(String *left, String *right,
+                     std::size_t seed = kHashSeed, bool sample = false,
+                     GC *gc = nullptr);
+
+        // Make this string the len bytes from offset of other without
+        // copying them, string must be allocated by GC with inline storage
+        // of kRopeInlineSize bytes at least, the string which owns the
+        // content is referenced until content is flattened. Memory of
+        // flattened content is reported to gc when it is not nullptr.
+        void SetSlice(String *other, std::size_t offset, std::size_t len,
+                      std::size_t seed = kHashSeed, bool sample = false,
+                      GC *gc = nullptr);
 
         // Convert to std::string
         std::string GetStdString() const;
 
-        // Change context of string
+        // Content of string is same as str or not
+        bool IsEqual(const char *str, std::size_t len) const
+        { return length_ == len && memcmp(GetData(), str, len) == 0; }
+
+        // Calculate hash of str with seed, all bytes of str are hashed
+        // unless sample is true and str is longer than kHashSampleLength,
+        // then only kHashSampleBlocks blocks spread over str are hashed
+        static std::size_t Hash(const char *str, std::size_t len,
+                                std::size_t seed = kHashSeed,
+                                bool sample = false);
+
+        static const std::size_t kHashSeed = 5381;
+        static const std::size_t kHashSampleLength = 1024;
+        static const std::size_t kHashSampleBlocks = 64;
+        // Strings which length is not less than it are long strings
+        static const std::size_t kLongStringLength = 40;
+        // Inline storage size of rope to store left and right strings,
+        // and of slice to store its string and offset, then the GC
+        static const std::size_t kRopeInlineSize = 2 * sizeof(String *) + sizeof(GC *);
+
+        // Change context of string, hash of string is calculated with
+        // seed and sample, content is stored in inline storage when it
+        // fits, otherwise in heap
         void SetValue(const std::string &str);
         void SetValue(const char *str);
-        void SetValue(const char *str, std::size_t len);
+        void SetValue(const char *str, std::size_t len,
+                      std::size_t seed = kHashSeed, bool sample = false);
 
         friend bool operator == (const String &l, const String &r)
         {
-            return l.hash_ == r.hash_ &&
-                l.length_ == r.length_ &&
-                (l.in_heap_ ? memcmp(l.str_, r.str_, l.length_) :
-                 memcmp(l.str_buffer_, r.str_buffer_, l.length_)) == 0;
+            return l.length_ == r.length_ &&
+                (!l.hashed_ || !r.hashed_ || l.hash_ == r.hash_) &&
+                memcmp(l.GetData(), r.GetData(), l.length_) == 0;
         }
 
         friend bool operator != (const String &l, const String &r)
@@ -53,10 +144,8 @@ namespace luna
 
         friend bool operator < (const String &l, const String &r)
         {
-            auto *l_s = l.in_heap_ ? l.str_ : l.str_buffer_;
-            auto *r_s = r.in_heap_ ? r.str_ : r.str_buffer_;
             auto len = std::min(l.length_, r.length_);
-            auto cmp = memcmp(l_s, r_s, len);
+            auto cmp = memcmp(l.GetData(), r.GetData(), len);
             if (cmp == 0)
                 return l.length_ < r.length_;
             else
@@ -79,23 +168,73 @@ namespace luna
         }
 
     private:
-        // Calculate hash of string
-        void Hash(const char *s);
+        // Construct string in mem which has inline_size bytes storage
+        // after the String object, only GC allocates strings like this
+        static String * ConstructInline(void *mem, std::size_t inline_size);
+
+        // Move string to mem which is allocated by GetAllocSize bytes
+        static String * ConstructMoved(void *mem, String *other);
 
-        // String in heap or not
-        char in_heap_;
-        union
+        // Size of memory block of String object and inline storage
+        std::size_t GetAllocSize() const
+        { return sizeof(String) + inline_size_; }
+
+        char * GetInlineStorage()
+        { return reinterpret_cast<char *>(this) + sizeof(String); }
+
+        // Left and right strings of rope are stored in inline storage
+        String ** GetRopeChildren() const
+        { return reinterpret_cast<String **>(const_cast<String *>(this)->GetInlineStorage()); }
+
+        // String which owns the content and offset of slice
+        struct Slice
         {
-            // Buffer for short string
-            char str_buffer_[11];
-            // Pointer to heap which stored long string
-            char *str_;
+            String *str_;
+            std::size_t offset_;
         };
 
+        // String and offset of slice are stored in inline storage
+        Slice * GetSlice() const
+        { return reinterpret_cast<Slice *>(const_cast<String *>(this)->GetInlineStorage()); }
+
+        // GC of rope or slice, it is stored after children of rope or
+        // string and offset of slice in inline storage
+        GC *& GetReferenceGC() const
+        { return *reinterpret_cast<GC **>(const_cast<String *>(this)->GetInlineStorage() + 2 * sizeof(String *)); }
+
+        // Content of slice in its string, it is got from the string every
+        // time, because GC may move the string and its inline content
+        const char * GetSliceData() const;
+
+        // Content of slice, or flattened content of rope
+        const char * GetReferencedData() const;
+
+        // Copy content of rope or slice to heap, and release referenced
+        // strings
+        const char * Flatten() const;
+
+        // Report memory of flattened content to GC of rope or slice
+        void ReportFlattenedMemory() const;
+
+        // Content of string, it is in inline storage, heap or a static
+        // empty string, it is nullptr when string is a rope or slice
+        mutable const char *str_;
         // Length of string
         unsigned int length_;
-        // Hash value of string
-        std::size_t hash_;
+        // Bytes of inline storage after String object
+        unsigned int inline_size_;
+        // str_ is allocated in heap and owned by this string or not
+        mutable char owned_;
+        // hash_ is calculated or not
+        mutable char hashed_;
+        // String is in StringPool or not
+        char interned_;
+        // Hash is sampled for very long string or not
+        char sample_hash_;
+        // String is a slice or not when str_ is nullptr
+        mutable char slice_;
+        // Hash value of string, or the seed before hashed
+        mutable std::size_t hash_;
     };
 } // namespace luna
 
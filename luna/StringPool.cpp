@@ -1,48 +1,133 @@
 #include "StringPool.h"
+#include <utility>
 #include <assert.h>
 
 namespace luna
 {
-    StringPool::StringPool()
+    const std::size_t StringPool::kMinCapacity;
+
+    StringPool::StringPool(std::size_t seed)
+        : slots_(kMinCapacity), count_(0), seed_(seed)
     {
     }
 
     String * StringPool::GetString(const std::string &str)
     {
-        temp_.SetValue(str);
-        return GetString();
+        return GetString(str.c_str(), str.size());
     }
 
     String * StringPool::GetString(const char *str, std::size_t len)
     {
-        temp_.SetValue(str, len);
-        return GetString();
+        return GetString(str, len, String::Hash(str, len, seed_));
     }
 
     String * StringPool::GetString(const char *str)
     {
-        temp_.SetValue(str);
-        return GetString();
+        return GetString(str, strlen(str));
+    }
+
+    String * StringPool::GetString(const char *str, std::size_t len, std::size_t hash)
+    {
+        auto mask = slots_.size() - 1;
+        for (auto index = hash & mask; slots_[index].str_; index = (index + 1) & mask)
+        {
+            const auto &slot = slots_[index];
+            if (slot.hash_ == hash && slot.str_->IsEqual(str, len))
+                return slot.str_;
+        }
+
+        return nullptr;
     }
 
     void StringPool::AddString(String *str)
     {
-        auto it = strings_.insert(str);
-        assert(it.second);
-        (void)it;
+        // Keep load factor under 1/2
+        if ((count_ + 1) * 2 > slots_.size())
+            Rehash(slots_.size() * 2);
+
+        auto hash = str->GetHash();
+        auto mask = slots_.size() - 1;
+        auto index = hash & mask;
+        while (slots_[index].str_)
+        {
+            assert(slots_[index].str_ != str);
+            index = (index + 1) & mask;
+        }
+
+        slots_[index].str_ = str;
+        slots_[index].hash_ = hash;
+        str->SetInterned(true);
+        ++count_;
     }
 
     void StringPool::DeleteString(String *str)
     {
-        strings_.erase(str);
+        auto index = FindSlot(str->GetHash(), str);
+        if (index != slots_.size())
+        {
+            EraseSlot(index);
+            str->SetInterned(false);
+        }
     }
 
-    String * StringPool::GetString()
+    void StringPool::ReplaceString(String *old_str, String *new_str)
     {
-        auto it = strings_.find(&temp_);
-        if (it == strings_.end())
-            return nullptr;
-        else
-            return *it;
+        // Old string and new string have the same hash, find the old one
+        // by address from the slot of new string's hash
+        auto index = FindSlot(new_str->GetHash(), old_str);
+        assert(index != slots_.size() && "old string is not in pool");
+        slots_[index].str_ = new_str;
+    }
+
+    std::size_t StringPool::FindSlot(std::size_t hash, const String *str) const
+    {
+        auto mask = slots_.size() - 1;
+        for (auto index = hash & mask; slots_[index].str_; index = (index + 1) & mask)
+        {
+            if (slots_[index].str_ == str)
+                return index;
+        }
+
+        return slots_.size();
+    }
+
+    void StringPool::EraseSlot(std::size_t index)
+    {
+        auto mask = slots_.size() - 1;
+        slots_[index].str_ = nullptr;
+        --count_;
+
+        // Move following strings back when the erased slot is between
+        // their home slot and their current slot
+        for (auto next = (index + 1) & mask; slots_[next].str_; next = (next + 1) & mask)
+        {
+            auto home = slots_[next].hash_ & mask;
+            bool stay = index <= next ? (index < home && home <= next) :
+                                        (index < home || home <= next);
+            if (stay)
+                continue;
+
+            slots_[index] = slots_[next];
+            slots_[next].str_ = nullptr;
+            index = next;
+        }
+    }
+
+    void StringPool::Rehash(std::size_t capacity)
+    {
+        std::vector<Slot> slots(capacity);
+        slots.swap(slots_);
+
+        auto mask = capacity - 1;
+        for (const auto &slot : slots)
+        {
+            if (!slot.str_)
+                continue;
+
+            auto index = slot.hash_ & mask;
+            while (slots_[index].str_)
+                index = (index + 1) & mask;
+            slots_[index] = slot;
+        }
     }
 } // namespace luna
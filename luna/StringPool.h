@@ -3,14 +3,14 @@
 
 #include "String.h"
 #include <vector>
-#include <unordered_set>
 
 namespace luna
 {
     class StringPool
     {
     public:
-        StringPool();
+        // Strings are hashed by seed when hash is not given
+        explicit StringPool(std::size_t seed = String::kHashSeed);
 
         StringPool(const StringPool&) = delete;
         void operator = (const StringPool&) = delete;
@@ -21,33 +21,50 @@ namespace luna
         String * GetString(const char *str, std::size_t len);
         String * GetString(const char *str);
 
+        // Get string by precomputed hash, hash must be String::Hash of
+        // str, str is not copied
+        String * GetString(const char *str, std::size_t len, std::size_t hash);
+
         // Add string to pool
         void AddString(String *str);
 
         // Delete string from pool
         void DeleteString(String *str);
 
+        // Replace old string with the new string which has same content,
+        // old string may be unreadable when it has been moved by GC
+        void ReplaceString(String *old_str, String *new_str);
+
     private:
-        struct StringHash
+        // Strings are stored in an open addressing table with linear
+        // probing, hash is stored in slot, so probing does not touch
+        // strings which hash is different
+        struct Slot
         {
-            std::size_t operator () (const String *s) const
-            {
-                return s->GetHash();
-            }
-        };
+            String *str_;
+            std::size_t hash_;
 
-        struct StringEqual
-        {
-            bool operator () (const String *l, const String *r) const
-            {
-                return l == r || *l == *r;
-            }
+            Slot() : str_(nullptr), hash_(0) { }
         };
 
-        String * GetString();
+        // Find slot index of str by address from the slot of hash,
+        // return slots_.size() when not found
+        std::size_t FindSlot(std::size_t hash, const String *str) const;
+
+        // Remove string in slot index, move following strings back, so
+        // no deleted marker is needed
+        void EraseSlot(std::size_t index);
+
+        // Grow table to capacity, capacity is power of 2
+        void Rehash(std::size_t capacity);
+
+        static const std::size_t kMinCapacity = 64;
 
-        String temp_;
-        std::unordered_set<String *, StringHash, StringEqual> strings_;
+        std::vector<Slot> slots_;
+        // Count of strings in table
+        std::size_t count_;
+        // Hash seed of strings
+        std::size_t seed_;
     };
 } // namespace luna
 
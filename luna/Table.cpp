@@ -1,17 +1,186 @@
 #include "Table.h"
+#include <algorithm>
+#include <assert.h>
+#include <cstdint>
 #include <math.h>
+#include <string.h>
 
 namespace
 {
+    // Integer keys in [1, 2^kMaxArrayBits] could be in array part
+    const int kMaxArrayBits = 30;
+    const std::size_t kMaxArrayIndex = static_cast<std::size_t>(1) << kMaxArrayBits;
+
     inline bool IsInt(double d)
     {
         return floor(d) == d;
     }
+
+    // Get array index of key, return 0 when key could not be in array
+    inline std::size_t ArrayIndex(const luna::Value &key)
+    {
+        if (key.type_ == luna::ValueT_Number && IsInt(key.num_) &&
+            key.num_ >= 1 && key.num_ <= kMaxArrayIndex)
+            return static_cast<std::size_t>(key.num_);
+        return 0;
+    }
+
+    inline luna::Value IndexKey(std::size_t index)
+    {
+        luna::Value key;
+        key.num_ = static_cast<double>(index);
+        key.type_ = luna::ValueT_Number;
+        return key;
+    }
+
+    // Nil in number array part is a NaN which is never produced by
+    // arithmetic, storing a number of the same bits boxes the array part
+    const std::uint64_t kNilSlotBits = 0x7FF4DEADBEEF0000ULL;
+
+    inline double NilSlot()
+    {
+        double d;
+        memcpy(&d, &kNilSlotBits, sizeof(d));
+        return d;
+    }
+
+    inline bool IsNilSlot(double d)
+    {
+        std::uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return bits == kNilSlotBits;
+    }
+
+    // Smallest bits which 2^bits >= x
+    inline int CeilLog2(std::size_t x)
+    {
+        int bits = 0;
+        while ((static_cast<std::size_t>(1) << bits) < x)
+            ++bits;
+        return bits;
+    }
 } // namespace
 
 namespace luna
 {
+    const std::size_t HashPart::kNoNode;
+    const std::size_t Table::kMaxReserveSize;
+
+    HashPart::HashPart()
+        : shift_(0), size_(0)
+    {
+    }
+
+    std::size_t HashPart::Find(const Value &key) const
+    {
+        if (index_.empty())
+            return kNoNode;
+
+        auto hash = std::hash<Value>()(key);
+        auto mask = index_.size() - 1;
+        for (auto slot = GetSlot(hash); index_[slot] != 0; slot = (slot + 1) & mask)
+        {
+            auto index = index_[slot] - 1;
+            const auto &node = nodes_[index];
+            if (node.hash_ == hash && node.key_ == key)
+                return index;
+        }
+
+        return kNoNode;
+    }
+
+    void HashPart::Insert(const Value &key, const Value &value)
+    {
+        // Keep load factor of index not greater than 3/4
+        if ((nodes_.size() + 1) * 4 > index_.size() * 3)
+        {
+            std::size_t capacity = 4;
+            while ((size_ + 1) * 4 > capacity * 3)
+                capacity <<= 1;
+
+            // Grow when there are not enough dead nodes to remove
+            if (capacity <= index_.size() && size_ * 2 >= nodes_.size())
+                capacity = index_.size() << 1;
+            Rehash(capacity);
+        }
+
+        Node node;
+        node.key_ = key;
+        node.value_ = value;
+        node.hash_ = std::hash<Value>()(key);
+        nodes_.push_back(node);
+        ++size_;
+
+        auto mask = index_.size() - 1;
+        auto slot = GetSlot(node.hash_);
+        while (index_[slot] != 0)
+            slot = (slot + 1) & mask;
+        index_[slot] = static_cast<unsigned int>(nodes_.size());
+    }
+
+    void HashPart::Reserve(std::size_t size)
+    {
+        if (size * 4 > index_.size() * 3)
+            Resize(size);
+    }
+
+    void HashPart::Resize(std::size_t size)
+    {
+        std::size_t capacity = 4;
+        while (size * 4 > capacity * 3)
+            capacity <<= 1;
+        Rehash(capacity);
+    }
+
+    void HashPart::SetNodeValue(std::size_t index, const Value &value)
+    {
+        auto &node = nodes_[index];
+        if (node.value_.IsNil() != value.IsNil())
+        {
+            if (value.IsNil())
+                --size_;
+            else
+                ++size_;
+        }
+        node.value_ = value;
+    }
+
+    std::size_t HashPart::GetMemorySize() const
+    {
+        return sizeof(HashPart) + nodes_.capacity() * sizeof(Node) +
+            index_.capacity() * sizeof(unsigned int);
+    }
+
+    void HashPart::Rehash(std::size_t capacity)
+    {
+        // Remove dead nodes and keep order of alive nodes
+        std::vector<Node> nodes;
+        nodes.reserve(capacity * 3 / 4);
+        for (const auto &node : nodes_)
+        {
+            if (!node.value_.IsNil())
+                nodes.push_back(node);
+        }
+        nodes_.swap(nodes);
+
+        shift_ = 64;
+        for (auto c = capacity; c > 1; c >>= 1)
+            --shift_;
+
+        std::vector<unsigned int>(capacity, 0).swap(index_);
+        auto mask = capacity - 1;
+        for (std::size_t i = 0; i < nodes_.size(); ++i)
+        {
+            auto slot = GetSlot(nodes_[i].hash_);
+            while (index_[slot] != 0)
+                slot = (slot + 1) & mask;
+            index_[slot] = static_cast<unsigned int>(i + 1);
+        }
+    }
+
     Table::Table()
+        : gc_(nullptr), parts_size_(0), cursor_(0), border_(0),
+          mode_(TableMode_Strong)
     {
     }
 
@@ -19,7 +188,8 @@ namespace luna
     {
         if (v->Visit(this))
         {
-            // Visit all array members
+            // Visit all array members, number array part has no
+            // members to visit
             if (array_)
             {
                 for (const auto &value : *array_)
@@ -29,51 +199,69 @@ namespace luna
             // Visit all keys and values in hash table.
             if (hash_)
             {
-                for (auto it = hash_->begin(); it != hash_->end(); ++it)
+                // Keys of dead nodes are visited too, since they are
+                // still referenced until removed
+                for (const auto &node : *hash_)
                 {
-                    it->first.Accept(v);
-                    it->second.Accept(v);
+                    node.key_.Accept(v);
+                    node.value_.Accept(v);
                 }
             }
         }
     }
 
-    bool Table::SetArrayValue(std::size_t index, const Value &value)
+    void Table::UpdateReferences()
     {
-        if (index < 1)
-            return false;
+        if (array_)
+        {
+            for (auto &value : *array_)
+                value.UpdateReference();
+        }
 
-        std::size_t array_size = ArraySize();
-        if (index > array_size + 1)
-            return false;
+        if (hash_)
+        {
+            for (auto &node : *hash_)
+            {
+                // Hash of key is not changed when the key object moved,
+                // so update the key in place
+                node.key_.UpdateReference();
+                node.value_.UpdateReference();
+            }
+        }
+    }
 
-        if (index == array_size + 1)
-            AppendAndMergeFromHashToArray(value);
-        else
-            (*array_)[index - 1] = value;
+    std::size_t Table::GetMemorySize() const
+    {
+        return sizeof(Table) + GetPartsMemorySize();
+    }
+
+    bool Table::SetArrayValue(std::size_t index, const Value &value)
+    {
+        if (index < 1 || index > ArraySize() + 1)
+            return false;
 
+        SetValue(IndexKey(index), value);
         return true;
     }
 
     bool Table::InsertArrayValue(std::size_t index, const Value &value)
     {
-        if (index < 1)
-            return false;
-
         std::size_t array_size = ArraySize();
-        if (index > array_size + 1)
+        if (index < 1 || index > array_size + 1)
             return false;
 
-        if (index == array_size + 1)
-            AppendAndMergeFromHashToArray(value);
+        if (array_size < ArrayPartSize())
+        {
+            // Shift up values in array part
+            for (auto i = array_size; i >= index; --i)
+                SetArraySlot(i, GetArraySlot(i - 1));
+            SetArraySlot(index - 1, value);
+        }
         else
         {
-            // Insert value
-            auto it = array_->begin();
-            std::advance(it, index - 1);
-            array_->insert(it, value);
-            // Try to merge from hash to array
-            MergeFromHashToArray();
+            for (auto i = array_size; i >= index; --i)
+                SetValue(IndexKey(i + 1), GetValue(IndexKey(i)));
+            SetValue(IndexKey(index), value);
         }
 
         return true;
@@ -81,173 +269,483 @@ namespace luna
 
     bool Table::EraseArrayValue(std::size_t index)
     {
-        if (index < 1 || index > ArraySize())
+        std::size_t array_size = ArraySize();
+        if (index < 1 || index > array_size)
             return false;
 
-        auto it = array_->begin();
-        std::advance(it, index - 1);
-        array_->erase(it);
+        if (array_size <= ArrayPartSize())
+        {
+            // Shift down values in array part
+            for (auto i = index; i < array_size; ++i)
+                SetArraySlot(i - 1, GetArraySlot(i));
+            SetArraySlot(array_size - 1, Value());
+        }
+        else
+        {
+            for (auto i = index; i < array_size; ++i)
+                SetValue(IndexKey(i), GetValue(IndexKey(i + 1)));
+            SetValue(IndexKey(array_size), Value());
+        }
+
         return true;
     }
 
     void Table::SetValue(const Value &key, const Value &value)
     {
         // Try array part
-        if (key.type_ == ValueT_Number && IsInt(key.num_))
+        auto array_index = ArrayIndex(key);
+        if (array_index > 0 && array_index <= ArrayPartSize())
         {
-            if (SetArrayValue(static_cast<std::size_t>(key.num_), value))
-                return ;
+            SetArraySlot(array_index - 1, value);
+            return ;
         }
 
-        // Hash part
-        if (!hash_)
+        // Hash part, nil can not be key
+        if (key.IsNil())
+            return ;
+
+        // If key is existed, then set the value of node, the node is
+        // kept when value is nil, so traversal can continue from it
+        if (hash_)
         {
-            // If value is nil and hash part is not existed, then do nothing
-            if (value.IsNil())
+            auto index = hash_->Find(key);
+            if (index != Hash::kNoNode)
+            {
+                hash_->SetNodeValue(index, value);
                 return ;
-            hash_.reset(new Hash);
+            }
         }
 
-        auto it = hash_->find(key);
-        if (it != hash_->end())
-        {
-            // If value is nil, then just erase the element
-            if (value.IsNil())
-                hash_->erase(it);
-            else
-                it->second = value;
-        }
-        else
+        // If key is not existed and value is nil, then do nothing
+        if (value.IsNil())
+            return ;
+
+        // Rebalance array part and hash part when hash part is full,
+        // key may fit with array part after that
+        if (!hash_ || hash_->IsFull())
         {
-            // If key is not existed and value is not nil, then insert it
-            if (!value.IsNil())
-                hash_->insert(std::make_pair(key, value));
+            Rehash(key);
+            if (array_index > 0 && array_index <= ArrayPartSize())
+            {
+                SetArraySlot(array_index - 1, value);
+                ReportMemoryChange();
+                return ;
+            }
         }
+
+        hash_->Insert(key, value);
+        ReportMemoryChange();
     }
 
     Value Table::GetValue(const Value &key) const
     {
         // Get from array first
-        if (key.type_ == ValueT_Number && IsInt(key.num_))
-        {
-            std::size_t index = static_cast<std::size_t>(key.num_);
-            if (index >= 1 && index <= ArraySize())
-                return (*array_)[index - 1];
-        }
+        auto index = ArrayIndex(key);
+        if (index > 0 && index <= ArrayPartSize())
+            return GetArraySlot(index - 1);
 
         // Get from hash table
         if (hash_)
         {
-            auto it = hash_->find(key);
-            if (it != hash_->end())
-                return it->second;
+            auto node = hash_->Find(key);
+            if (node != Hash::kNoNode)
+                return hash_->GetNode(node).value_;
         }
 
         // key not exist
         return Value();
     }
 
+    Value Table::GetArrayValue(std::size_t index) const
+    {
+        if (index > 0 && index <= ArrayPartSize())
+            return GetArraySlot(index - 1);
+
+        Value key;
+        key.num_ = index;
+        key.type_ = ValueT_Number;
+        return GetValue(key);
+    }
+
+    void Table::SetArrayPartValue(std::size_t index, const Value &value)
+    {
+        assert(index > 0 && index <= ArrayPartSize());
+        SetArraySlot(index - 1, value);
+    }
+
     bool Table::FirstKeyValue(Value &key, Value &value)
     {
-        // array part
-        if (ArraySize() > 0)
+        // array part, skip nil values
+        for (std::size_t index = 1; index <= ArrayPartSize(); ++index)
         {
-            key.num_ = 1;           // first element index
-            key.type_ = ValueT_Number;
-            value = (*array_)[0];
-            return true;
+            if (!IsArraySlotNil(index - 1))
+            {
+                key.num_ = index;
+                key.type_ = ValueT_Number;
+                value = GetArraySlot(index - 1);
+                return true;
+            }
         }
 
         // hash part
-        if (hash_ && !hash_->empty())
-        {
-            auto first = hash_->begin();
-            key = first->first;
-            value = first->second;
-            return true;
-        }
-
-        return false;
+        return NextHashKeyValue(0, key, value);
     }
 
     bool Table::NextKeyValue(const Value &key, Value &next_key, Value &next_value)
     {
+        if (key.IsNil())
+            return FirstKeyValue(next_key, next_value);
+
         // array part
-        if (key.type_ == ValueT_Number && IsInt(key.num_))
+        auto array_index = ArrayIndex(key);
+        if (array_index > 0 && array_index <= ArrayPartSize())
         {
-            std::size_t index = static_cast<std::size_t>(key.num_) + 1;
-            if (index >= 1 && index <= ArraySize())
+            std::size_t index = array_index + 1;
+            for (; index <= ArrayPartSize(); ++index)
             {
+                // Skip nil values
+                if (IsArraySlotNil(index - 1))
+                    continue;
+
                 next_key.num_ = index;
                 next_key.type_ = ValueT_Number;
-                next_value = (*array_)[index - 1];
+                next_value = GetArraySlot(index - 1);
                 return true;
             }
+
+            return NextHashKeyValue(0, next_key, next_value);
         }
 
-        // hash part
-        if (hash_)
+        if (!hash_)
+            return false;
+
+        // Key is the last traversed key usually, search it when not
+        auto index = cursor_;
+        if (index >= hash_->GetNodeCount() || !(hash_->GetNode(index).key_ == key))
+        {
+            index = hash_->Find(key);
+            if (index == Hash::kNoNode)
+                return false;
+        }
+
+        return NextHashKeyValue(index + 1, next_key, next_value);
+    }
+
+    bool Table::NextHashKeyValue(std::size_t index, Value &next_key, Value &next_value)
+    {
+        if (!hash_)
+            return false;
+
+        // Skip dead nodes
+        for (auto count = hash_->GetNodeCount(); index < count; ++index)
         {
-            auto it = hash_->find(key);
-            if (it == hash_->end() && !hash_->empty())
+            const auto &node = hash_->GetNode(index);
+            if (node.value_.IsNil())
+                continue;
+
+            cursor_ = index;
+            next_key = node.key_;
+            next_value = node.value_;
+            return true;
+        }
+
+        return false;
+    }
+
+    std::size_t Table::ArraySize() const
+    {
+        auto size = ArrayPartSize();
+
+        // Search a border in array part when the last value is nil
+        if (size > 0 && IsArraySlotNil(size - 1))
+        {
+            // Border is not changed or increased by one usually, such as
+            // appending values by t[#t + 1]
+            auto border = border_;
+            if (border < size && IsArraySlotNil(border) &&
+                (border == 0 || !IsArraySlotNil(border - 1)))
+                return border;
+            if (border + 1 < size && !IsArraySlotNil(border) &&
+                IsArraySlotNil(border + 1))
+                return border_ = border + 1;
+
+            // Binary search it
+            std::size_t i = 0;
+            while (size - i > 1)
             {
-                it = hash_->begin();
-                next_key = it->first;
-                next_value = it->second;
-                return true;
+                auto m = (i + size) / 2;
+                if (IsArraySlotNil(m - 1))
+                    size = m;
+                else
+                    i = m;
             }
+            return border_ = i;
+        }
+
+        if (!hash_)
+            return size;
 
-            if (it != hash_->end() && ++it != hash_->end())
+        // Border may be in hash part, search it by doubling index
+        auto i = size;
+        auto j = size + 1;
+        while (!GetValue(IndexKey(j)).IsNil())
+        {
+            i = j;
+            if (j > kMaxArrayIndex)
             {
-                next_key = it->first;
-                next_value = it->second;
-                return true;
+                // Table is made bad, search it linearly
+                while (!GetValue(IndexKey(i + 1)).IsNil())
+                    ++i;
+                return i;
             }
+            j *= 2;
         }
 
-        return false;
+        while (j - i > 1)
+        {
+            auto m = (i + j) / 2;
+            if (GetValue(IndexKey(m)).IsNil())
+                j = m;
+            else
+                i = m;
+        }
+        return i;
     }
 
-    std::size_t Table::ArraySize() const
+    void Table::Reserve(std::size_t array_size, std::size_t hash_size)
+    {
+        // Array part never has slots for indices out of array part
+        array_size = std::min(array_size, std::min(kMaxReserveSize, kMaxArrayIndex));
+        hash_size = std::min(hash_size, kMaxReserveSize);
+
+        if (array_size > ArrayPartSize())
+            ResizeArray(array_size);
+
+        if (hash_size > 0)
+        {
+            if (!hash_)
+                hash_.reset(new Hash);
+            hash_->Reserve(hash_size);
+        }
+        ReportMemoryChange();
+    }
+
+    std::size_t Table::ArrayPartSize() const
     {
+        if (num_array_)
+            return num_array_->size();
         return array_ ? array_->size() : 0;
     }
 
-    void Table::AppendAndMergeFromHashToArray(const Value &value)
+    Value Table::GetArraySlot(std::size_t index) const
     {
-        AppendToArray(value);
-        MergeFromHashToArray();
+        Value value;
+        if (num_array_)
+        {
+            auto num = (*num_array_)[index];
+            if (!IsNilSlot(num))
+            {
+                value.num_ = num;
+                value.type_ = ValueT_Number;
+            }
+        }
+        else
+        {
+            value = (*array_)[index];
+        }
+        return value;
     }
 
-    void Table::AppendToArray(const Value &value)
+    bool Table::IsArraySlotNil(std::size_t index) const
     {
-        if (!array_)
-            array_.reset(new Array);
-        array_->push_back(value);
+        if (num_array_)
+            return IsNilSlot((*num_array_)[index]);
+        return (*array_)[index].IsNil();
     }
 
-    void Table::MergeFromHashToArray()
+    void Table::SetArraySlot(std::size_t index, const Value &value)
     {
-        auto index = ArraySize();
-        Value key;
-        key.num_ = ++index;
-        key.type_ = ValueT_Number;
+        if (num_array_)
+        {
+            if (value.IsNil())
+            {
+                (*num_array_)[index] = NilSlot();
+                return ;
+            }
+
+            if (value.type_ == ValueT_Number && !IsNilSlot(value.num_))
+            {
+                (*num_array_)[index] = value.num_;
+                return ;
+            }
+
+            BoxArray();
+            ReportMemoryChange();
+        }
+
+        (*array_)[index] = value;
+    }
+
+    void Table::ResizeArray(std::size_t size)
+    {
+        // New array part stores numbers only until other value stored
+        if (!num_array_ && !array_)
+            num_array_.reset(new NumberArray);
+
+        if (num_array_)
+        {
+            auto old_size = num_array_->size();
+            num_array_->resize(size, NilSlot());
+            if (size < old_size)
+                num_array_->shrink_to_fit();
+        }
+        else
+        {
+            auto old_size = array_->size();
+            array_->resize(size);
+            if (size < old_size)
+                array_->shrink_to_fit();
+        }
+    }
+
+    void Table::BoxArray()
+    {
+        std::unique_ptr<Array> array(new Array(num_array_->size()));
+        for (std::size_t i = 0; i < num_array_->size(); ++i)
+            (*array)[i] = GetArraySlot(i);
+
+        num_array_.reset();
+        array_ = std::move(array);
+    }
+
+    void Table::Rehash(const Value &key)
+    {
+        // Count integer keys by slices (2^(i - 1), 2^i]
+        std::size_t nums[kMaxArrayBits + 1] = { 0 };
+        std::size_t total = 0;
+        std::size_t int_keys = 0;
+
+        auto array_size = ArrayPartSize();
+        for (std::size_t bits = 0, index = 1; bits <= kMaxArrayBits; ++bits)
+        {
+            auto limit = std::min(static_cast<std::size_t>(1) << bits, array_size);
+            for (; index <= limit; ++index)
+            {
+                if (!IsArraySlotNil(index - 1))
+                    ++nums[bits];
+            }
+            int_keys += nums[bits];
+            if (index > array_size)
+                break;
+        }
+        total += int_keys;
+
+        auto count_key = [&](const Value &k) {
+            ++total;
+            auto index = ArrayIndex(k);
+            if (index > 0)
+            {
+                ++nums[CeilLog2(index)];
+                ++int_keys;
+            }
+        };
+
+        if (hash_)
+        {
+            for (const auto &node : *hash_)
+            {
+                if (!node.value_.IsNil())
+                    count_key(node.key_);
+            }
+        }
+        count_key(key);
+
+        // Size of array part is the largest power of two n, which more
+        // than half of slots in [1, n] are used
+        std::size_t size = 0;
+        std::size_t in_array = 0;
+        std::size_t used = 0;
+        for (std::size_t bits = 0; bits <= kMaxArrayBits; ++bits)
+        {
+            auto slots = static_cast<std::size_t>(1) << bits;
+            if (slots / 2 >= int_keys)
+                break;
+
+            used += nums[bits];
+            if (used > slots / 2)
+            {
+                size = slots;
+                in_array = used;
+            }
+        }
 
-        while (MoveHashToArray(key))
-            key.num_ = ++index;
+        Resize(size, total - in_array);
     }
 
-    bool Table::MoveHashToArray(const Value &key)
+    void Table::Resize(std::size_t array_size, std::size_t hash_size)
     {
+        auto old_array_size = ArrayPartSize();
+
+        // Values out of new array part are moved to hash part
+        std::vector<std::pair<std::size_t, Value>> moved;
+        for (auto index = array_size + 1; index <= old_array_size; ++index)
+        {
+            if (!IsArraySlotNil(index - 1))
+                moved.push_back(std::make_pair(index, GetArraySlot(index - 1)));
+        }
+
+        if (array_size != old_array_size)
+            ResizeArray(array_size);
+
+        // Values of integer keys fit with new array part are moved from
+        // hash part
+        if (hash_ && array_size > old_array_size)
+        {
+            for (std::size_t i = 0; i < hash_->GetNodeCount(); ++i)
+            {
+                const auto &node = hash_->GetNode(i);
+                auto index = ArrayIndex(node.key_);
+                if (index > old_array_size && index <= array_size &&
+                    !node.value_.IsNil())
+                {
+                    SetArraySlot(index - 1, node.value_);
+                    hash_->SetNodeValue(i, Value());
+                }
+            }
+        }
+
+        if (hash_size == 0)
+        {
+            hash_.reset();
+            return ;
+        }
+
         if (!hash_)
-            return false;
+            hash_.reset(new Hash);
+        hash_->Resize(hash_size);
 
-        auto it = hash_->find(key);
-        if (it == hash_->end())
-            return false;
+        for (const auto &kv : moved)
+            hash_->Insert(IndexKey(kv.first), kv.second);
+    }
 
-        AppendToArray(it->second);
-        hash_->erase(it);
-        return true;
+    std::size_t Table::GetPartsMemorySize() const
+    {
+        std::size_t size = 0;
+        if (array_)
+            size += sizeof(Array) + array_->capacity() * sizeof(Value);
+        if (num_array_)
+            size += sizeof(NumberArray) + num_array_->capacity() * sizeof(double);
+
+        if (hash_)
+            size += hash_->GetMemorySize();
+        return size;
+    }
+
+    void Table::ReportMemoryChange()
+    {
+        auto new_size = GetPartsMemorySize();
+        if (gc_ && new_size != parts_size_)
+            gc_->ChangeObjectMemory(this, static_cast<std::ptrdiff_t>(new_size - parts_size_));
+        parts_size_ = new_size;
     }
 } // namespace luna
@@ -5,17 +5,136 @@
 #include "Value.h"
 #include <memory>
 #include <vector>
-#include <unordered_map>
 
 namespace luna
 {
+    // Mode of table, GC does not keep weak keys or weak values alive,
+    // entries of dead weak keys or values are removed by GC.
+    // Strings are not weak, they are values like numbers.
+    enum TableMode
+    {
+        TableMode_Strong = 0,
+        TableMode_WeakKey = 1,
+        TableMode_WeakValue = 2,
+        TableMode_WeakKeyValue = TableMode_WeakKey | TableMode_WeakValue,
+        // Keys are weak, and values are alive only when keys are alive
+        TableMode_Ephemeron = 4,
+    };
+
+    // Hash part of table. Nodes are stored in insertion order, and an open
+    // addressing index maps hash of keys to nodes, so nodes can be
+    // traversed by index. Assigning nil to a key keeps the node as a dead
+    // node until rehash, then traversal is not broken by it.
+    class HashPart
+    {
+    public:
+        struct Node
+        {
+            Value key_;
+            Value value_;
+            std::size_t hash_;
+        };
+
+        static const std::size_t kNoNode = static_cast<std::size_t>(-1);
+
+        HashPart();
+
+        // Find node index of key, return kNoNode when not found
+        std::size_t Find(const Value &key) const;
+
+        // Insert key which is not existed, nodes may be reordered by
+        // rehash
+        void Insert(const Value &key, const Value &value);
+
+        // Reserve space for size alive nodes without rehash
+        void Reserve(std::size_t size);
+
+        // Remove dead nodes, and resize space for size alive nodes
+        void Resize(std::size_t size);
+
+        // Inserting one more node needs rehash
+        bool IsFull() const
+        { return (nodes_.size() + 1) * 4 > index_.size() * 3; }
+
+        // Set value of node, node is dead when value is nil
+        void SetNodeValue(std::size_t index, const Value &value);
+
+        Node & GetNode(std::size_t index)
+        { return nodes_[index]; }
+        const Node & GetNode(std::size_t index) const
+        { return nodes_[index]; }
+
+        // Count of nodes including dead nodes
+        std::size_t GetNodeCount() const
+        { return nodes_.size(); }
+
+        // Count of alive nodes
+        std::size_t Size() const
+        { return size_; }
+
+        bool HasDeadNodes() const
+        { return size_ != nodes_.size(); }
+
+        // Key of dead node is removed when is_dead(key) is true, the key
+        // never matches any key after removed
+        template<typename IsDead>
+        void ClearDeadKeys(const IsDead &is_dead)
+        {
+            for (auto &node : nodes_)
+            {
+                if (node.value_.IsNil() && is_dead(node.key_))
+                    node.key_.SetNil();
+            }
+        }
+
+        std::size_t GetMemorySize() const;
+
+        typedef std::vector<Node>::iterator iterator;
+        typedef std::vector<Node>::const_iterator const_iterator;
+
+        iterator begin() { return nodes_.begin(); }
+        iterator end() { return nodes_.end(); }
+        const_iterator begin() const { return nodes_.begin(); }
+        const_iterator end() const { return nodes_.end(); }
+
+    private:
+        // Remove dead nodes, and rebuild index for capacity alive nodes
+        void Rehash(std::size_t capacity);
+
+        std::size_t GetSlot(std::size_t hash) const
+        { return (hash * 0x9E3779B97F4A7C15ULL) >> shift_; }
+
+        // Nodes in insertion order
+        std::vector<Node> nodes_;
+        // Slots of node index + 1, 0 is empty slot
+        std::vector<unsigned int> index_;
+        // Shift bits of hash to get slot
+        unsigned int shift_;
+        // Count of alive nodes
+        std::size_t size_;
+    };
+
     // Table has array part and hash table part.
     class Table : public GCObject
     {
+        friend class GC;
     public:
         Table();
+        Table(Table &&) = default;
 
         virtual void Accept(GCObjectVisitor *v);
+        virtual void UpdateReferences();
+        virtual std::size_t GetMemorySize() const;
+
+        // Set GC which memory changes of array and hash part report to
+        void SetGC(GC *gc)
+        { gc_ = gc; }
+
+        // Set and get weak mode of table
+        void SetMode(TableMode mode)
+        { mode_ = mode; }
+        TableMode GetMode() const
+        { return static_cast<TableMode>(mode_); }
 
         // Set array value by index, return true if success.
         // 'index' start from 1, if 'index' == ArraySize() + 1,
@@ -44,36 +163,91 @@ namespace luna
         // Return value is 'nil' if 'key' is not existed.
         Value GetValue(const Value &key) const;
 
+        // Get value by integer 'index' which starts from 1, same as
+        // GetValue with number key, but no key is constructed and
+        // searched when 'index' is in array part.
+        Value GetArrayValue(std::size_t index) const;
+
+        // Values of index [1, size] are all in array part or not, then
+        // they can be set by SetArrayPartValue
+        bool IsInArrayPart(std::size_t size) const
+        { return size <= ArrayPartSize(); }
+
+        // Set value of array part by 'index' which starts from 1, 'index'
+        // must be in array part
+        void SetArrayPartValue(std::size_t index, const Value &value);
+
         // Get first key-value pair of table, return true if table is not empty.
         bool FirstKeyValue(Value &key, Value &value);
 
         // Get the next key-value pair by current 'key', return false if there
-        // is no key-value pair any more.
+        // is no key-value pair any more or 'key' is not existed.
+        // Table remembers the position of last returned key, so getting the
+        // next of it does not search 'key'.
         bool NextKeyValue(const Value &key, Value &next_key, Value &next_value);
 
-        // Return the number of array part elements.
+        // Return the border of array, which value of index 'border' is
+        // not nil and value of index 'border' + 1 is nil.
         std::size_t ArraySize() const;
 
+        // Max array and hash size of Reserve, larger sizes are clamped
+        // to it, tables still grow beyond it when values are set
+        static const std::size_t kMaxReserveSize = static_cast<std::size_t>(1) << 20;
+
+        // Reserve array part of array_size slots and space of hash part
+        // for hash_size keys, then tables of known sizes do not grow many
+        // times
+        void Reserve(std::size_t array_size, std::size_t hash_size);
+
     private:
         typedef std::vector<Value> Array;
-        typedef std::unordered_map<Value, Value> Hash;
+        typedef std::vector<double> NumberArray;
+        typedef HashPart Hash;
+
+        // Get the first alive node from hash node index
+        bool NextHashKeyValue(std::size_t index, Value &next_key, Value &next_value);
+
+        // Count of slots in array part, values of slots may be nil
+        std::size_t ArrayPartSize() const;
+
+        // Get, check and set value of array part slot, 'index' starts
+        // from 0. Setting a value which is not number converts number
+        // array part to Value array part.
+        Value GetArraySlot(std::size_t index) const;
+        bool IsArraySlotNil(std::size_t index) const;
+        void SetArraySlot(std::size_t index, const Value &value);
+
+        // Resize slots of array part, new slots are nil. New array part
+        // is number array part.
+        void ResizeArray(std::size_t size);
+
+        // Convert number array part to Value array part
+        void BoxArray();
 
-        // Combine AppendToArray and MergeFromHashToArray
-        void AppendAndMergeFromHashToArray(const Value &value);
+        // Count integer keys and 'key' which is going to be inserted, then
+        // resize array part to the largest power of two size which more
+        // than half of slots are used, other keys are in hash part.
+        void Rehash(const Value &key);
 
-        // Append value to array.
-        void AppendToArray(const Value &value);
+        // Resize array part to array_size slots and hash part for
+        // hash_size keys, move values between them
+        void Resize(std::size_t array_size, std::size_t hash_size);
 
-        // Try to move values from hash to array which keys start from
-        // ArraySize() + 1
-        void MergeFromHashToArray();
+        // Estimated memory size of array part and hash part
+        std::size_t GetPartsMemorySize() const;
 
-        // Move hash table key-value pair to array which key is number and key
-        // fit with array, return true if move success.
-        bool MoveHashToArray(const Value &key);
+        // Report memory change of array and hash part since last
+        // reported to GC
+        void ReportMemoryChange();
 
         std::unique_ptr<Array> array_;              // array part of table
+        std::unique_ptr<NumberArray> num_array_;    // array part of numbers only, exclusive with array_
         std::unique_ptr<Hash> hash_;                // hash table part of table
+        GC *gc_;                                    // GC of table
+        std::size_t parts_size_;                    // Parts memory size reported to GC
+        std::size_t cursor_;                        // Hash node index of last traversed key
+        mutable std::size_t border_;                // Last border found in array part
+        unsigned char mode_;                        // TableMode of table
     };
 } // namespace luna
 
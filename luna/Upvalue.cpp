@@ -9,4 +9,9 @@ namespace luna
             value_.Accept(v);
         }
     }
+
+    void Upvalue::UpdateReferences()
+    {
+        value_.UpdateReference();
+    }
 } // namespace luna
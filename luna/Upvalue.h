@@ -8,8 +8,13 @@ namespace luna
 {
     class Upvalue : public GCObject
     {
+        friend class GC;
     public:
         virtual void Accept(GCObjectVisitor *v);
+        virtual void UpdateReferences();
+
+        virtual std::size_t GetMemorySize() const
+        { return sizeof(Upvalue); }
 
         void SetValue(const Value &value)
         { value_ = value; }
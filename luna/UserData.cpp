@@ -2,6 +2,17 @@
 
 namespace luna
 {
+    UserData::UserData(UserData &&other)
+        : GCObject(other),
+          user_data_(other.user_data_),
+          metatable_(other.metatable_),
+          destroyer_(other.destroyer_),
+          destroyed_(other.destroyed_)
+    {
+        // User data is owned by this object now
+        other.destroyed_ = true;
+    }
+
     UserData::~UserData()
     {
         if (!destroyed_ && destroyer_)
@@ -15,4 +26,9 @@ namespace luna
             metatable_->Accept(v);
         }
     }
+
+    void UserData::UpdateReferences()
+    {
+        UpdateReference(metatable_);
+    }
 } // namespace luna
@@ -8,13 +8,20 @@ namespace luna
 {
     class UserData : public GCObject
     {
+        friend class GC;
     public:
         typedef void (*Destroyer)(void *);
 
         UserData() = default;
+        UserData(UserData &&other);
         virtual ~UserData();
 
         virtual void Accept(GCObjectVisitor *v) final;
+        virtual void UpdateReferences() final;
+
+        // Memory of user data is managed by user, it is not counted
+        virtual std::size_t GetMemorySize() const final
+        { return sizeof(UserData); }
 
         void Set(void *user_data, Table *metatable)
         {
@@ -4,21 +4,15 @@
 #include "UserData.h"
 #include "Function.h"
 #include "Exception.h"
+#include "Number.h"
 #include <assert.h>
 #include <math.h>
 
 namespace
 {
-    std::string NumberToStr(luna::Value *num)
-    {
-        assert(num->type_ == luna::ValueT_Number);
-        char temp[64];
-        if (floor(num->num_) == num->num_)
-            snprintf(temp, sizeof(temp), "%lld", static_cast<long long>(num->num_));
-        else
-            snprintf(temp, sizeof(temp), "%g", num->num_);
-        return temp;
-    }
+    // Concat to a string which is not shorter than it makes a rope, so
+    // appending to a long string repeatedly does not copy it every time
+    const std::size_t kMinRopePrefixLength = 128;
 } // namespace
 
 namespace luna
@@ -27,9 +21,14 @@ namespace luna
 #define GET_REGISTER_A(i)       (call->register_ + Instruction::GetParamA(i))
 #define GET_REGISTER_B(i)       (call->register_ + Instruction::GetParamB(i))
 #define GET_REGISTER_C(i)       (call->register_ + Instruction::GetParamC(i))
-#define GET_UPVALUE_B(i)        (cl->GetUpvalue(Instruction::GetParamB(i)))
+#define GET_UPVALUE_B(i)        (call->func_->closure_->GetUpvalue(Instruction::GetParamB(i)))
 #define GET_REAL_VALUE(a)       (a->type_ == ValueT_Upvalue ? a->upvalue_->GetValue() : a)
 
+    // Barrier the upvalue when a is upvalue, call it after set value to a
+#define CHECK_UPVALUE_BARRIER(a)                            \
+    if (a->type_ == ValueT_Upvalue)                         \
+        CHECK_BARRIER(state_->GetGC(), a->upvalue_)
+
 #define GET_REGISTER_ABC(i)                                 \
     a = GET_REGISTER_A(i);                                  \
     b = GET_REGISTER_B(i);                                  \
@@ -61,9 +60,10 @@ namespace luna
 
     void VM::ExecuteFrame()
     {
+        // Closure of current frame may be moved by GC, so get upvalues
+        // from call->func_ every time
         CallInfo *call = &state_->calls_.back();
-        Closure *cl = call->func_->closure_;
-        Function *proto = cl->GetPrototype();
+        Function *proto = call->func_->closure_->GetPrototype();
         Value *a = nullptr;
         Value *b = nullptr;
         Value *c = nullptr;
@@ -101,11 +101,13 @@ namespace luna
                     a = GET_REGISTER_A(i);
                     b = GET_CONST_VALUE(i);
                     *GET_REAL_VALUE(a) = *b;
+                    CHECK_UPVALUE_BARRIER(a);
                     break;
                 case OpType_Move:
                     a = GET_REGISTER_A(i);
                     b = GET_REGISTER_B(i);
                     *GET_REAL_VALUE(a) = *GET_REAL_VALUE(b);
+                    CHECK_UPVALUE_BARRIER(a);
                     break;
                 case OpType_Call:
                     a = GET_REGISTER_A(i);
@@ -115,21 +117,27 @@ namespace luna
                     a = GET_REGISTER_A(i);
                     b = GET_UPVALUE_B(i)->GetValue();
                     *GET_REAL_VALUE(a) = *b;
+                    CHECK_UPVALUE_BARRIER(a);
                     break;
                 case OpType_SetUpvalue:
-                    a = GET_REGISTER_A(i);
-                    b = GET_UPVALUE_B(i)->GetValue();
-                    *b = *a;
+                    {
+                        a = GET_REGISTER_A(i);
+                        auto upvalue = GET_UPVALUE_B(i);
+                        *upvalue->GetValue() = *a;
+                        CHECK_BARRIER(state_->GetGC(), upvalue);
+                    }
                     break;
                 case OpType_GetGlobal:
                     a = GET_REGISTER_A(i);
                     b = GET_CONST_VALUE(i);
                     *GET_REAL_VALUE(a) = state_->global_.table_->GetValue(*b);
+                    CHECK_UPVALUE_BARRIER(a);
                     break;
                 case OpType_SetGlobal:
                     a = GET_REGISTER_A(i);
                     b = GET_CONST_VALUE(i);
                     state_->global_.table_->SetValue(*b, *a);
+                    CHECK_BARRIER(state_->GetGC(), state_->global_.table_);
                     break;
                 case OpType_Closure:
                     a = GET_REGISTER_A(i);
@@ -216,8 +224,9 @@ namespace luna
                     a->type_ = ValueT_Number;
                     break;
                 case OpType_Concat:
-                    GET_REGISTER_ABC(i);
-                    Concat(a, b, c);
+                    a = GET_REGISTER_A(i);
+                    Concat(a, call->register_ + Instruction::GetParamB(i),
+                           Instruction::GetParamC(i));
                     break;
                 case OpType_Less:
                     GET_REGISTER_ABC(i);
@@ -261,16 +270,25 @@ namespace luna
                     break;
                 case OpType_NewTable:
                     a = GET_REGISTER_A(i);
-                    a->table_ = state_->NewTable();
+                    a->table_ = state_->NewTable(
+                        Instruction::DecodeSize(Instruction::GetParamB(i)),
+                        Instruction::DecodeSize(Instruction::GetParamC(i)));
                     a->type_ = ValueT_Table;
                     break;
                 case OpType_SetTable:
                     GET_REGISTER_ABC(i);
                     CheckTableType(a, b, "set", "to");
                     if (a->type_ == ValueT_Table)
+                    {
                         a->table_->SetValue(*b, *c);
+                        CHECK_BARRIER(state_->GetGC(), a->table_);
+                    }
                     else if (a->type_ == ValueT_UserData)
-                        a->user_data_->GetMetatable()->SetValue(*b, *c);
+                    {
+                        auto metatable = a->user_data_->GetMetatable();
+                        metatable->SetValue(*b, *c);
+                        CHECK_BARRIER(state_->GetGC(), metatable);
+                    }
                     else
                         assert(0);
                     break;
@@ -295,6 +313,14 @@ namespace luna
                         (c->num_ <= 0.0 && a->num_ < b->num_))
                         call->instruction_ += -1 + Instruction::GetParamsBx(i);
                     break;
+                case OpType_ForIter:
+                    a = GET_REGISTER_A(i);
+                    b = GET_REGISTER_B(i);
+                    if (ForIterate(a, b, Instruction::GetParamC(i)))
+                        call->instruction_ += Instruction::GetParamsBx(*call->instruction_);
+                    else
+                        ++call->instruction_;
+                    break;
                 default:
                     break;
             }
@@ -435,32 +461,46 @@ namespace luna
         state_->calls_.pop_back();
     }
 
-    void VM::Concat(Value *dst, Value *op1, Value *op2)
+    void VM::Concat(Value *dst, const Value *first, int count)
     {
-        if (op1->type_ == ValueT_String && op2->type_ == ValueT_String)
-        {
-            dst->str_ = state_->GetString(op1->str_->GetStdString() +
-                                          op2->str_->GetCStr());
-        }
-        else if (op1->type_ == ValueT_String && op2->type_ == ValueT_Number)
-        {
-            dst->str_ = state_->GetString(op1->str_->GetCStr() +
-                                          NumberToStr(op2));
-        }
-        else if (op1->type_ == ValueT_Number && op2->type_ == ValueT_String)
+        CheckConcatType(first, count);
+
+        String *result = nullptr;
+        if (first->type_ == ValueT_String &&
+            first->str_->GetLength() >= kMinRopePrefixLength)
         {
-            dst->str_ = state_->GetString(NumberToStr(op1) +
-                                          op2->str_->GetCStr());
+            auto suffix = count == 2 && first[1].type_ == ValueT_String ?
+                first[1].str_ : ConcatValues(first + 1, count - 1);
+            result = state_->NewRopeString(first->str_, suffix);
         }
         else
         {
-            auto pos = GetCurrentInstructionPos();
-            throw RuntimeException(pos.first, pos.second, op1, op2, "concat");
+            result = ConcatValues(first, count);
         }
 
+        dst->str_ = result;
         dst->type_ = ValueT_String;
     }
 
+    String * VM::ConcatValues(const Value *first, int count)
+    {
+        concat_buffer_.clear();
+        for (int i = 0; i < count; ++i)
+        {
+            if (first[i].type_ == ValueT_String)
+                concat_buffer_.append(first[i].str_->GetData(),
+                                      first[i].str_->GetLength());
+            else
+            {
+                char buffer[kMaxNumberLength];
+                auto len = NumberToString(first[i].num_, buffer);
+                concat_buffer_.append(buffer, len);
+            }
+        }
+
+        return state_->GetString(concat_buffer_.data(), concat_buffer_.size());
+    }
+
     void VM::ForInit(Value *var, Value *limit, Value *step)
     {
         if (var->type_ != ValueT_Number)
@@ -485,6 +525,49 @@ namespace luna
         }
     }
 
+    bool VM::ForIterate(const Value *iter, Value *names, int count)
+    {
+        // iter, state and control var are in consecutive registers
+        if (iter->type_ != ValueT_CFunction || iter[1].type_ != ValueT_Table)
+            return false;
+
+        auto t = iter[1].table_;
+        Value key;
+        Value value;
+        if (iter->cfunc_ == state_->next_iterator_)
+        {
+            t->NextKeyValue(iter[2], key, value);
+        }
+        else if (iter->cfunc_ == state_->inext_iterator_)
+        {
+            // Let ipairs iterator report the error
+            if (iter[2].type_ != ValueT_Number)
+                return false;
+
+            key.num_ = iter[2].num_ + 1;
+            key.type_ = ValueT_Number;
+            value = t->GetValue(key);
+            if (value.IsNil())
+                key.SetNil();
+        }
+        else
+            return false;
+
+        for (int n = 0; n < count; ++n)
+        {
+            auto name = names + n;
+            if (n == 0)
+                *GET_REAL_VALUE(name) = key;
+            else if (n == 1)
+                *GET_REAL_VALUE(name) = value;
+            else
+                GET_REAL_VALUE(name)->SetNil();
+            CHECK_UPVALUE_BARRIER(name);
+        }
+
+        return true;
+    }
+
     std::pair<const char *, const char *> VM::GetOperandNameAndScope(const Value *a) const
     {
         GET_CALLINFO_AND_PROTO();
@@ -587,6 +670,36 @@ namespace luna
         }
     }
 
+    void VM::CheckConcatType(const Value *first, int count) const
+    {
+        auto is_concatable = [](const Value *v) {
+            return v->type_ == ValueT_String || v->type_ == ValueT_Number;
+        };
+
+        // Values are concatenated from left to right, at least one of
+        // the first two values is a string
+        auto second = first + 1;
+        if (!is_concatable(first) || !is_concatable(second) ||
+            (first->type_ == ValueT_Number && second->type_ == ValueT_Number))
+        {
+            auto pos = GetCurrentInstructionPos();
+            throw RuntimeException(pos.first, pos.second, first, second, "concat");
+        }
+
+        for (int i = 2; i < count; ++i)
+        {
+            if (!is_concatable(first + i))
+            {
+                // Concatenated result of previous values is a string
+                Value prefix;
+                prefix.type_ = ValueT_String;
+                auto pos = GetCurrentInstructionPos();
+                throw RuntimeException(pos.first, pos.second,
+                                       &prefix, first + i, "concat");
+            }
+        }
+    }
+
     void VM::CheckTableType(const Value *t, const Value *k,
                             const char *op, const char *desc) const
     {
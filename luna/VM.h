@@ -3,6 +3,7 @@
 
 #include "Value.h"
 #include "OpCode.h"
+#include <string>
 #include <utility>
 
 namespace luna
@@ -26,8 +27,14 @@ namespace luna
         void CopyVarArg(Value *a, Instruction i);
         void Return(Value *a, Instruction i);
 
-        void Concat(Value *dst, Value *op1, Value *op2);
+        // Concat count values start from first to dst
+        void Concat(Value *dst, const Value *first, int count);
+        // Get string of count values concatenated
+        String * ConcatValues(const Value *first, int count);
         void ForInit(Value *var, Value *limit, Value *step);
+        // Iterate table by built-in iterator of pairs or ipairs, set
+        // count name values, return false when iterator is not built-in
+        bool ForIterate(const Value *iter, Value *names, int count);
 
         // Debug help functions
         std::pair<const char *, const char *>
@@ -43,12 +50,16 @@ namespace luna
         void CheckInequalityType(const Value *v1, const Value *v2,
                                  const char *op) const;
 
+        void CheckConcatType(const Value *first, int count) const;
+
         void CheckTableType(const Value *t, const Value *k,
                             const char *op, const char *desc) const;
 
         void ReportTypeError(const Value *v, const char *op) const;
 
         State *state_;
+        // Buffer for concat strings, reused by all concat operations
+        std::string concat_buffer_;
     };
 } // namespace luna
 
@@ -37,6 +37,36 @@ namespace luna
         }
     }
 
+    void Value::UpdateReference()
+    {
+        switch (type_)
+        {
+            case ValueT_Nil:
+            case ValueT_Bool:
+            case ValueT_Number:
+            case ValueT_CFunction:
+                break;
+            case ValueT_Obj:
+                luna::UpdateReference(obj_);
+                break;
+            case ValueT_String:
+                luna::UpdateReference(str_);
+                break;
+            case ValueT_Closure:
+                luna::UpdateReference(closure_);
+                break;
+            case ValueT_Upvalue:
+                luna::UpdateReference(upvalue_);
+                break;
+            case ValueT_Table:
+                luna::UpdateReference(table_);
+                break;
+            case ValueT_UserData:
+                luna::UpdateReference(user_data_);
+                break;
+        }
+    }
+
     const char * Value::TypeName() const
     {
         return TypeName(type_);
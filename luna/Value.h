@@ -2,6 +2,7 @@
 #define VALUE_H
 
 #include "GC.h"
+#include "String.h"
 #include <functional>
 
 namespace luna
@@ -71,7 +72,13 @@ namespace luna
         bool IsFalse() const
         { return type_ == ValueT_Nil || (type_ == ValueT_Bool && !bvalue_); }
 
+        // Value is a GC object or not, obj_ is the GC object when true
+        bool IsGCObject() const
+        { return type_ >= ValueT_Obj && type_ <= ValueT_UserData; }
+
         void Accept(GCObjectVisitor *v) const;
+        // Update GC object to new address after it moved by GC
+        void UpdateReference();
         const char * TypeName() const;
 
         static const char * TypeName(ValueT type);
@@ -88,7 +95,11 @@ namespace luna
             case ValueT_Bool: return left.bvalue_ == right.bvalue_;
             case ValueT_Number: return left.num_ == right.num_;
             case ValueT_Obj: return left.obj_ == right.obj_;
-            case ValueT_String: return left.str_ == right.str_;
+            case ValueT_String:
+                // Short strings are interned, long strings are compared
+                // by content
+                return left.str_ == right.str_ ||
+                    (left.str_->IsLong() && *left.str_ == *right.str_);
             case ValueT_Closure: return left.closure_ == right.closure_;
             case ValueT_Upvalue: return left.upvalue_ == right.upvalue_;
             case ValueT_Table: return left.table_ == right.table_;
@@ -120,20 +131,15 @@ namespace std
                     return hash<bool>()(t.bvalue_);
                 case luna::ValueT_Number:
                     return hash<double>()(t.num_);
-                case luna::ValueT_String:
-                    return hash<void *>()(t.str_);
-                case luna::ValueT_Closure:
-                    return hash<void *>()(t.closure_);
-                case luna::ValueT_Upvalue:
-                    return hash<void *>()(t.upvalue_);
-                case luna::ValueT_Table:
-                    return hash<void *>()(t.table_);
-                case luna::ValueT_UserData:
-                    return hash<void *>()(t.user_data_);
                 case luna::ValueT_CFunction:
                     return hash<void *>()(reinterpret_cast<void *>(t.cfunc_));
+                case luna::ValueT_String:
+                    // Seeded content hash, long strings with same content
+                    // may be different objects
+                    return t.str_->GetHash();
                 default:
-                    return hash<void *>()(t.obj_);
+                    // GC objects may be moved by GC, so use identity hash
+                    return t.obj_->GetObjectHash();
             }
         }
     };
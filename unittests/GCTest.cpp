@@ -15,7 +15,7 @@
 #include <deque>
 #include <string>
 
-luna::GC g_gc(luna::GC::DefaultDeleter(), true);
+luna::GC g_gc(luna::GC::DefaultFinalizer(), true);
 std::deque<luna::Table *> g_globalTable;
 std::deque<luna::Function *> g_globalFunction;
 std::deque<luna::Closure *> g_globalClosure;
@@ -63,6 +63,16 @@ void MajorRoot(luna::GCObjectVisitor *v)
     MinorRoot(v);
 }
 
+void UpdateRoot()
+{
+    for (auto &t : g_scopeTable)
+        luna::UpdateReference(t);
+    for (auto &c : g_scopeClosure)
+        luna::UpdateReference(c);
+    for (auto &s : g_scopeString)
+        luna::UpdateReference(s);
+}
+
 luna::Table * RandomTable();
 luna::Function * RandomFunction();
 luna::Closure * RandomClosure();
@@ -355,6 +365,7 @@ int main()
 {
     srand(static_cast<unsigned int>(time(nullptr)));
     g_gc.SetRootTraveller(MinorRoot, MajorRoot);
+    g_gc.SetRootUpdater(UpdateRoot);
     RandomLoop();
     return 0;
 }
@@ -0,0 +1,82 @@
+#include "UnitTest.h"
+#include "luna/AllocProfiler.h"
+#include "luna/State.h"
+#include <sstream>
+
+TEST_CASE(alloc_profiler1)
+{
+    luna::State state;
+    auto &profiler = state.GetAllocProfiler();
+    profiler.Start(1);
+    EXPECT_TRUE(profiler.IsRunning());
+
+    state.DoString("keep = {}\n"
+                   "for i = 1, 100 do keep[i] = {i} end\n", "profile");
+    profiler.Stop();
+    EXPECT_TRUE(!profiler.IsRunning());
+
+    std::ostringstream oss;
+    profiler.WriteReport(oss);
+    auto report = oss.str();
+    EXPECT_TRUE(report.find("profile:2") != std::string::npos);
+
+    // Reset clears all allocation sites
+    state.GetGC().FullGC();
+    profiler.Reset();
+    oss.str("");
+    profiler.WriteReport(oss);
+    EXPECT_TRUE(oss.str().find("profile:2") == std::string::npos);
+}
+
+namespace
+{
+    // Get alive count of the site which stack starts with site in report
+    int GetAliveCount(luna::AllocProfiler &profiler, const std::string &site)
+    {
+        std::ostringstream oss;
+        profiler.WriteReport(oss);
+
+        std::istringstream iss(oss.str());
+        std::string line;
+        while (std::getline(iss, line))
+        {
+            std::istringstream fields(line);
+            std::size_t bytes = 0, samples = 0, old = 0, alive = 0;
+            std::string stack;
+            if (fields >> bytes >> samples >> old >> alive >> stack && stack == site)
+                return static_cast<int>(alive);
+        }
+        return -1;
+    }
+} // namespace
+
+TEST_CASE(alloc_profiler2)
+{
+    luna::State state;
+    auto &profiler = state.GetAllocProfiler();
+    profiler.Start(1);
+    state.DoString("keep = {}\n"
+                   "for i = 1, 100 do keep[i] = {i} end\n"
+                   "junk = {}\n"
+                   "for i = 1, 100 do junk[i] = {i} end\n", "profile");
+    profiler.Stop();
+    EXPECT_TRUE(GetAliveCount(profiler, "profile:2") == 100);
+    EXPECT_TRUE(GetAliveCount(profiler, "profile:4") == 100);
+
+    // Sampled objects are still tracked after stopped, table junk may
+    // be kept by stale registers of stack, so clear all its elements
+    state.DoString("for i = 1, 100 do junk[i] = nil end\n", "free");
+    state.GetGC().FullGC();
+    EXPECT_TRUE(GetAliveCount(profiler, "profile:2") == 100);
+    EXPECT_TRUE(GetAliveCount(profiler, "profile:4") == 0);
+
+    // New objects reuse addresses of freed objects after restarted
+    profiler.Start(1);
+    state.DoString("other = {}\n"
+                   "for i = 1, 100 do other[i] = {i} end\n", "restart");
+    state.GetGC().FullGC();
+    profiler.Stop();
+    EXPECT_TRUE(GetAliveCount(profiler, "profile:2") == 100);
+    EXPECT_TRUE(GetAliveCount(profiler, "profile:4") == 0);
+    EXPECT_TRUE(GetAliveCount(profiler, "restart:2") == 100);
+}
@@ -0,0 +1,28 @@
+#include "UnitTest.h"
+#include "luna/GCStatistics.h"
+
+TEST_CASE(gc_statistics1)
+{
+    luna::PauseHistogram pause;
+    EXPECT_TRUE(pause.GetCount() == 0);
+    EXPECT_TRUE(pause.GetPercentile(0.5) == 0.0);
+
+    // 1 ~ 100 microseconds
+    for (int i = 1; i <= 100; ++i)
+        pause.Record(i * 1000ull);
+
+    EXPECT_TRUE(pause.GetCount() == 100);
+    EXPECT_TRUE(pause.GetMin() == 1.0);
+    EXPECT_TRUE(pause.GetMax() == 100.0);
+    EXPECT_TRUE(pause.GetAverage() == 50.5);
+
+    auto p50 = pause.GetPercentile(0.5);
+    auto p99 = pause.GetPercentile(0.99);
+    EXPECT_TRUE(p50 > 50.0 * 15 / 16 && p50 < 50.0 * 17 / 16);
+    EXPECT_TRUE(p99 > 99.0 * 15 / 16 && p99 <= 100.0);
+    EXPECT_TRUE(pause.GetPercentile(1.0) <= pause.GetMax());
+
+    pause.Reset();
+    EXPECT_TRUE(pause.GetCount() == 0);
+    EXPECT_TRUE(pause.GetMax() == 0.0);
+}
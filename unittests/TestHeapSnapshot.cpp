@@ -0,0 +1,82 @@
+#include "UnitTest.h"
+#include "luna/HeapSnapshot.h"
+#include "luna/State.h"
+#include "luna/Table.h"
+#include <sstream>
+#include <stdio.h>
+
+TEST_CASE(heap_snapshot1)
+{
+    // root(0) -> 1 -> 3, root(0) -> 2 -> 3, 3 -> 4, 5 is unreachable
+    std::istringstream iss(
+        "luna-heap-snapshot 1\n"
+        "o 0 table 1 100\n"
+        "e 1 a\n"
+        "e 2 b\n"
+        "o 1 table 1 10\n"
+        "e 3 [1]\n"
+        "o 2 table 1 20\n"
+        "e 3 [1]\n"
+        "o 3 table 0 30\n"
+        "e 4\n"
+        "o 4 closure 0 40\n"
+        "o 5 string 0 50\n"
+        "r 0 global\n");
+
+    luna::HeapGraph graph;
+    EXPECT_TRUE(graph.Load(iss));
+    graph.Analyze();
+
+    const auto &nodes = graph.GetNodes();
+    EXPECT_TRUE(nodes.size() == 6);
+    EXPECT_TRUE(nodes[0].idom_ == graph.GetRootNode());
+    EXPECT_TRUE(nodes[3].idom_ == 0);
+    EXPECT_TRUE(nodes[4].idom_ == 3);
+    EXPECT_TRUE(nodes[5].idom_ == luna::HeapGraph::kNoNode);
+
+    EXPECT_TRUE(nodes[0].retained_size_ == 200);
+    EXPECT_TRUE(nodes[1].retained_size_ == 10);
+    EXPECT_TRUE(nodes[3].retained_size_ == 70);
+
+    EXPECT_TRUE(graph.GetRootPath(4) == "global.a[1].<closure>");
+    EXPECT_TRUE(graph.GetRootPath(5).empty());
+}
+
+TEST_CASE(heap_snapshot2)
+{
+    std::istringstream iss("luna-heap-snapshot 1\n"
+                           "o 0 table 1 100\n"
+                           "e 7\n");
+    luna::HeapGraph graph;
+    EXPECT_TRUE(!graph.Load(iss));
+}
+
+TEST_CASE(heap_snapshot3)
+{
+    luna::State state;
+    state.DoString("big = {} for i = 1, 100 do big[i] = {i} end");
+
+    const char *file = "heap_snapshot3.snap";
+    EXPECT_TRUE(state.WriteHeapSnapshot(file));
+
+    luna::HeapGraph graph;
+    EXPECT_TRUE(graph.Load(file));
+    remove(file);
+    graph.Analyze();
+
+    // Table big is referenced by global table, and maybe by a stack
+    // register too, so its path is global.big or stack[n]
+    bool found = false;
+    const auto &nodes = graph.GetNodes();
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        auto path = graph.GetRootPath(i);
+        if (path == "global.big" || path.compare(0, 6, "stack[") == 0)
+        {
+            if (nodes[i].type_ == "table" &&
+                nodes[i].retained_size_ > 100 * sizeof(luna::Table))
+                found = true;
+        }
+    }
+    EXPECT_TRUE(found);
+}
@@ -0,0 +1,73 @@
+#include "UnitTest.h"
+#include "luna/Number.h"
+#include <random>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+    std::string ToString(double num)
+    {
+        char buffer[luna::kMaxNumberLength];
+        auto len = luna::NumberToString(num, buffer);
+        return std::string(buffer, len);
+    }
+
+    bool ToNumber(const char *str, double &num)
+    {
+        return luna::StringToNumber(str, strlen(str), num);
+    }
+} // namespace
+
+TEST_CASE(number1)
+{
+    EXPECT_TRUE(ToString(0) == "0");
+    EXPECT_TRUE(ToString(-0.0) == "-0");
+    EXPECT_TRUE(ToString(-42) == "-42");
+    EXPECT_TRUE(ToString(0.1 + 0.2) == "0.3");
+    EXPECT_TRUE(ToString(1.0 / 3) == "0.33333333333333");
+    EXPECT_TRUE(ToString(99999999999999.99) == "1e+14");
+    EXPECT_TRUE(ToString(1e-5) == "1e-05");
+    EXPECT_TRUE(ToString(1e100) == "1e+100");
+
+    // Exact integers keep all digits
+    EXPECT_TRUE(ToString(9007199254740992.0) == "9007199254740992");
+    EXPECT_TRUE(ToString(-9007199254740992.0) == "-9007199254740992");
+    EXPECT_TRUE(ToString(123456789012345.0) == "123456789012345");
+    EXPECT_TRUE(ToString(1e15) == "1000000000000000");
+    EXPECT_TRUE(ToString(18014398509481984.0) == "1.8014398509482e+16");
+
+    // Same as "%.14g" for random numbers
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<double> dist(-1e6, 1e6);
+    for (int i = 0; i < 100000; ++i)
+    {
+        auto num = dist(rng) / (1 << (i % 32));
+        char expect[64];
+        snprintf(expect, sizeof(expect), "%.14g", num);
+        EXPECT_TRUE(ToString(num) == expect);
+    }
+}
+
+TEST_CASE(number2)
+{
+    double num = 0;
+    EXPECT_TRUE(ToNumber(" 12 ", num) && num == 12);
+    EXPECT_TRUE(ToNumber("-1.5e2", num) && num == -150);
+    EXPECT_TRUE(ToNumber(".5", num) && num == 0.5);
+    EXPECT_TRUE(ToNumber("3.", num) && num == 3);
+    EXPECT_TRUE(ToNumber("0x1F", num) && num == 31);
+    EXPECT_TRUE(ToNumber("0x1p-2", num) && num == 0.25);
+    EXPECT_TRUE(ToNumber("0.1", num) && num == 0.1);
+    EXPECT_TRUE(ToNumber("123456789012345678901234567890", num) &&
+                num == 123456789012345678901234567890.0);
+
+    EXPECT_TRUE(!ToNumber("", num));
+    EXPECT_TRUE(!ToNumber(".", num));
+    EXPECT_TRUE(!ToNumber("1e", num));
+    EXPECT_TRUE(!ToNumber("0x", num));
+    EXPECT_TRUE(!ToNumber("1 2", num));
+    EXPECT_TRUE(!ToNumber("inf", num));
+    EXPECT_TRUE(!ToNumber("nan", num));
+}
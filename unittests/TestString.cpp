@@ -1,6 +1,16 @@
 #include "UnitTest.h"
+#include "luna/GC.h"
+#include "luna/State.h"
 #include "luna/String.h"
+#include "luna/Table.h"
+#include "luna/Exception.h"
 #include "luna/StringPool.h"
+#include "luna/Value.h"
+#include "luna/LibString.h"
+#include "luna/Pattern.h"
+#include <memory>
+#include <string>
+#include <vector>
 
 TEST_CASE(string1)
 {
@@ -70,3 +80,378 @@ TEST_CASE(string2)
     EXPECT_TRUE(!s3);
     EXPECT_TRUE(!s4);
 }
+
+TEST_CASE(string3)
+{
+    // Enough strings to grow pool and probe through collided slots
+    std::vector<std::unique_ptr<luna::String>> strs;
+    luna::StringPool pool;
+    for (int i = 0; i < 1000; ++i)
+    {
+        strs.emplace_back(new luna::String(("s" + std::to_string(i)).c_str()));
+        pool.AddString(strs.back().get());
+    }
+
+    for (int i = 0; i < 1000; i += 2)
+        pool.DeleteString(strs[i].get());
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        auto str = "s" + std::to_string(i);
+        auto hash = luna::String::Hash(str.c_str(), str.size());
+        auto s = pool.GetString(str.c_str(), str.size(), hash);
+        EXPECT_TRUE(i % 2 == 0 ? s == nullptr : s == strs[i].get());
+    }
+
+    luna::String moved("s1");
+    pool.ReplaceString(strs[1].get(), &moved);
+    EXPECT_TRUE(pool.GetString("s1") == &moved);
+}
+
+TEST_CASE(string4)
+{
+    std::string content(100, 'a');
+    luna::String str1(content.c_str());
+    luna::String str2(content.c_str());
+    luna::String str3("abc");
+
+    EXPECT_TRUE(str1.IsLong());
+    EXPECT_TRUE(!str3.IsLong());
+    EXPECT_TRUE(str1 == str2);
+    EXPECT_TRUE(str1.GetHash() == luna::String::Hash(content.c_str(), content.size()));
+    EXPECT_TRUE(str1.GetHash() == str2.GetHash());
+
+    // Long strings with same content are equal keys
+    luna::Value v1(&str1);
+    luna::Value v2(&str2);
+    EXPECT_TRUE(v1 == v2);
+    EXPECT_TRUE(std::hash<luna::Value>()(v1) == std::hash<luna::Value>()(v2));
+}
+
+TEST_CASE(string5)
+{
+    // Embedded zeros are hashed
+    const char a[] = { 'a', 0, 'b' };
+    const char b[] = { 'a', 0, 'c' };
+    EXPECT_TRUE(luna::String::Hash(a, 3) != luna::String::Hash(b, 3));
+    EXPECT_TRUE(luna::String::Hash(a, 2) != luna::String::Hash(a, 3));
+
+    // Different seeds hash differently
+    EXPECT_TRUE(luna::String::Hash("abc", 3, 1) != luna::String::Hash("abc", 3, 2));
+
+    // Every length around block sizes hashes all bytes
+    std::string content(64, 'x');
+    for (std::size_t len = 1; len <= content.size(); ++len)
+    {
+        auto hash = luna::String::Hash(content.c_str(), len);
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            auto changed = content.substr(0, len);
+            changed[i] = 'y';
+            EXPECT_TRUE(luna::String::Hash(changed.c_str(), len) != hash);
+        }
+    }
+
+    // Sampled hash is only used for very long strings
+    std::string long_str(luna::String::kHashSampleLength * 4, 'z');
+    EXPECT_TRUE(luna::String::Hash(content.c_str(), content.size(), 0, true) ==
+                luna::String::Hash(content.c_str(), content.size(), 0, false));
+    EXPECT_TRUE(luna::String::Hash(long_str.c_str(), long_str.size(), 0, true) !=
+                luna::String::Hash(long_str.c_str(), long_str.size(), 0, false));
+
+    luna::String str;
+    str.SetValue(long_str.c_str(), long_str.size(), 7, true);
+    EXPECT_TRUE(str.GetHash() ==
+                luna::String::Hash(long_str.c_str(), long_str.size(), 7, true));
+}
+
+TEST_CASE(string6)
+{
+    luna::GC gc;
+    std::vector<luna::String *> strs;
+    auto root = [&](luna::GCObjectVisitor *v) {
+        for (auto s : strs)
+            s->Accept(v);
+    };
+    gc.SetRootTraveller(root, root);
+    gc.SetRootUpdater([&] {
+        for (auto &s : strs)
+            luna::UpdateReference(s);
+    });
+
+    // Content fits inline storage, or stored in heap when it is too long
+    // for nursery
+    std::vector<std::string> contents;
+    for (std::size_t len : { 0, 1, 11, 12, 39, 40, 64, 1000, 100000 })
+    {
+        contents.push_back(std::string(len, 'a' + len % 26));
+        auto s = gc.NewString(luna::GCGen0, len);
+        s->SetValue(contents.back().c_str(), len);
+        strs.push_back(s);
+    }
+
+    EXPECT_TRUE(strs[6]->GetMemorySize() == sizeof(luna::String) + 65);
+    EXPECT_TRUE(strs[8]->GetMemorySize() > 100000);
+
+    // Strings are moved out of nursery with content
+    gc.FullGC();
+    gc.FullGC();
+    for (std::size_t i = 0; i < strs.size(); ++i)
+    {
+        EXPECT_TRUE(strs[i]->GetGeneration() != luna::GCGen0);
+        EXPECT_TRUE(strs[i]->GetStdString() == contents[i]);
+    }
+}
+
+TEST_CASE(string7)
+{
+    luna::GC gc;
+    luna::String *rope = nullptr;
+    auto root = [&](luna::GCObjectVisitor *v) { rope->Accept(v); };
+    gc.SetRootTraveller(root, root);
+    gc.SetRootUpdater([&] { luna::UpdateReference(rope); });
+
+    std::string left_content(200, 'l');
+    auto left = gc.NewString(luna::GCGen0, left_content.size());
+    left->SetValue(left_content.c_str(), left_content.size());
+    auto right = gc.NewString(luna::GCGen0, 5);
+    right->SetValue("right", 5);
+
+    // Rope keeps left and right alive until it is flattened
+    rope = gc.NewString(luna::GCGen0, luna::String::kRopeInlineSize);
+    rope->SetRope(left, right, luna::String::kHashSeed, false, &gc);
+    EXPECT_TRUE(rope->IsRope());
+    EXPECT_TRUE(rope->GetLength() == 205);
+
+    auto count_objects = [&]() {
+        int count = 0;
+        gc.ForEachObject([&](luna::GCObject *) { ++count; });
+        return count;
+    };
+
+    // Bytes counted by GC are same as memory size of all objects
+    auto check_bytes = [&]() {
+        std::size_t bytes = 0;
+        gc.ForEachObject([&](luna::GCObject *obj) { bytes += obj->GetMemorySize(); });
+        return bytes == gc.GetObjectBytes(luna::GCGen0) + gc.GetObjectBytes(luna::GCGen1) +
+            gc.GetObjectBytes(luna::GCGen2) + gc.GetObjectBytes(luna::GCGenPerm);
+    };
+
+    gc.FullGC();
+    EXPECT_TRUE(count_objects() == 3);
+    EXPECT_TRUE(rope->IsRope());
+    EXPECT_TRUE(check_bytes());
+    EXPECT_TRUE(rope->GetStdString() == left_content + "right");
+    EXPECT_TRUE(!rope->IsRope());
+    EXPECT_TRUE(check_bytes());
+
+    gc.FullGC();
+    EXPECT_TRUE(count_objects() == 1);
+    EXPECT_TRUE(rope->GetStdString() == left_content + "right");
+}
+
+TEST_CASE(string8)
+{
+    luna::State state;
+    state.DoString("local s = ''\n"
+                   "for i = 1, 1000 do s = s .. 'line ' .. i .. '\\n' end\n"
+                   "local t = ''\n"
+                   "for i = 1, 1000 do t = t .. 'line ' .. i .. '\\n' end\n"
+                   "same = s == t\n"
+                   "len = #s\n"
+                   "local keys = {}\n"
+                   "keys[s] = true\n"
+                   "found = keys[t]\n", "concat");
+
+    auto global = state.GetGlobal()->table_;
+    auto get = [&](const char *name) {
+        luna::Value key;
+        key.type_ = luna::ValueT_String;
+        key.str_ = state.GetString(name);
+        return global->GetValue(key);
+    };
+
+    EXPECT_TRUE(get("same").bvalue_);
+    EXPECT_TRUE(get("found").bvalue_);
+    EXPECT_TRUE(get("len").num_ == 7 * 9 + 8 * 90 + 9 * 900 + 10);
+
+    // First two values of concat can not be both numbers
+    bool error = false;
+    try
+    {
+        state.DoString("local a, b = 1, 2\nlocal c = a .. b .. 'x'\n", "error");
+    }
+    catch (const luna::RuntimeException &)
+    {
+        error = true;
+    }
+    EXPECT_TRUE(error);
+}
+
+TEST_CASE(string9)
+{
+    luna::GC gc;
+    luna::String *slice = nullptr;
+    auto root = [&](luna::GCObjectVisitor *v) { slice->Accept(v); };
+    gc.SetRootTraveller(root, root);
+    gc.SetRootUpdater([&] { luna::UpdateReference(slice); });
+
+    std::string content;
+    for (int i = 0; i < 300; ++i)
+        content.push_back('a' + i % 26);
+    auto str = gc.NewString(luna::GCGen0, content.size());
+    str->SetValue(content.c_str(), content.size());
+
+    // Slice of slice references the string which owns content
+    auto outer = gc.NewString(luna::GCGen0, luna::String::kRopeInlineSize);
+    outer->SetSlice(str, 10, 250);
+    slice = gc.NewString(luna::GCGen0, luna::String::kRopeInlineSize);
+    slice->SetSlice(outer, 20, 200);
+    EXPECT_TRUE(slice->IsSlice());
+    EXPECT_TRUE(slice->GetLength() == 200);
+
+    auto count_objects = [&]() {
+        int count = 0;
+        gc.ForEachObject([&](luna::GCObject *) { ++count; });
+        return count;
+    };
+
+    // Content is got from the string after it is moved by GC
+    gc.FullGC();
+    EXPECT_TRUE(count_objects() == 2);
+    EXPECT_TRUE(slice->IsSlice());
+    EXPECT_TRUE(memcmp(slice->GetData(), content.c_str() + 30, 200) == 0);
+    EXPECT_TRUE(slice->IsSlice());
+
+    // Hashing flattens slice, then the string is released
+    luna::String copy;
+    copy.SetValue(content.c_str() + 30, 200);
+    EXPECT_TRUE(*slice == copy);
+    EXPECT_TRUE(slice->GetHash() == copy.GetHash());
+    EXPECT_TRUE(!slice->IsSlice());
+    EXPECT_TRUE(strlen(slice->GetCStr()) == 200);
+
+    gc.FullGC();
+    EXPECT_TRUE(count_objects() == 1);
+    EXPECT_TRUE(slice->GetStdString() == content.substr(30, 200));
+}
+
+TEST_CASE(string10)
+{
+    luna::State state;
+    lib::string::RegisterLibString(&state);
+    state.DoString("local s = ''\n"
+                   "for i = 1, 100 do s = s .. 'word' .. i .. ' ' end\n"
+                   "a = string.sub('hello', 2, -2)\n"
+                   "b = string.sub('hello', -3)\n"
+                   "c = string.sub('hello', 0)\n"
+                   "d = string.sub('hello', 4, 2)\n"
+                   "e = string.sub('hello', -100, 100)\n"
+                   "local long = string.sub(s, 6, -6)\n"
+                   "f = long == string.sub(s, 6, #s - 5)\n"
+                   "g = string.sub(long, 1, 6)\n"
+                   "local keys = {}\n"
+                   "keys[long] = 1\n"
+                   "h = keys[string.sub(s, 6, -6)]\n", "sub");
+
+    auto global = state.GetGlobal()->table_;
+    auto get = [&](const char *name) {
+        luna::Value key;
+        key.type_ = luna::ValueT_String;
+        key.str_ = state.GetString(name);
+        return global->GetValue(key);
+    };
+
+    EXPECT_TRUE(get("a").str_->GetStdString() == "ell");
+    EXPECT_TRUE(get("b").str_->GetStdString() == "llo");
+    EXPECT_TRUE(get("c").str_->GetStdString() == "hello");
+    EXPECT_TRUE(get("d").str_->GetLength() == 0);
+    EXPECT_TRUE(get("e").str_->GetStdString() == "hello");
+    EXPECT_TRUE(get("f").bvalue_);
+    EXPECT_TRUE(get("g").str_->GetStdString() == " word2");
+    EXPECT_TRUE(get("h").num_ == 1);
+}
+
+TEST_CASE(string11)
+{
+    auto match = [](const char *pattern, const char *str, luna::Pattern::Match &m) {
+        luna::Pattern p(pattern, strlen(pattern));
+        return p.Find(str, str + strlen(str), str, m);
+    };
+
+    luna::Pattern::Match m;
+    EXPECT_TRUE(match("(%w+)=(%w+)", "  key=value", m));
+    EXPECT_TRUE(m.capture_count_ == 2);
+    EXPECT_TRUE(std::string(m.captures_[0].begin_, m.captures_[0].len_) == "key");
+    EXPECT_TRUE(std::string(m.captures_[1].begin_, m.captures_[1].len_) == "value");
+
+    EXPECT_TRUE(match("%b()", "f(a(b)c)", m));
+    EXPECT_TRUE(std::string(m.begin_, m.end_) == "(a(b)c)");
+    EXPECT_TRUE(match("%f[%a]%a+$", "12 ab cd", m));
+    EXPECT_TRUE(std::string(m.begin_, m.end_) == "cd");
+    EXPECT_TRUE(match("(a+)b%1", "xaaba", m));
+    EXPECT_TRUE(std::string(m.begin_, m.end_) == "aba");
+    EXPECT_TRUE(!match("^b", "ab", m));
+    EXPECT_TRUE(match("()", "", m));
+    EXPECT_TRUE(m.captures_[0].len_ == luna::Pattern::kPositionCapture);
+
+    // Malformed patterns are reported when compiling
+    const char *malformed[] = { "(a", "a)", "%", "[a", "%b(", "%fa", "%1", "(()%1)" };
+    for (auto pattern : malformed)
+    {
+        bool thrown = false;
+        try
+        {
+            luna::Pattern p(pattern, strlen(pattern));
+        }
+        catch (const luna::CallCFuncException &)
+        {
+            thrown = true;
+        }
+        EXPECT_TRUE(thrown);
+    }
+}
+
+TEST_CASE(string12)
+{
+    luna::State state;
+    lib::string::RegisterLibString(&state);
+    state.DoString("a, b = string.find('hello world', 'o w')\n"
+                   "c = string.find('a.b', '.', 1, true)\n"
+                   "d = string.match('  trim  ', '^%s*(.-)%s*$')\n"
+                   "e = ''\n"
+                   "for k, v in string.gmatch('a=1, b=2', '(%w+)=(%w+)') do\n"
+                   "    e = e .. k .. v\n"
+                   "end\n"
+                   "f, g = string.gsub('hello world', 'o', '0')\n"
+                   "h = string.gsub('$x and $y', '%$(%w+)', { x = 1, y = 'two' })\n"
+                   "i = string.gsub('abc', '%w', function(c) return c .. c end)\n"
+                   "j = string.gsub('abc', '', '-')\n"
+                   "k = string.format('%d|%5.2f|%-3s|%x', 42, 3.14159, 'a', 255)\n"
+                   "l = string.format('%q %q %q %q', 1 / 0, -1 / 0, 0 / 0, 0.1)\n"
+                   "local inf = 1e9999\n"
+                   "m = inf == 1 / 0 and -1e9999 == -1 / 0\n",
+                   "pattern");
+
+    auto global = state.GetGlobal()->table_;
+    auto get = [&](const char *name) {
+        luna::Value key;
+        key.type_ = luna::ValueT_String;
+        key.str_ = state.GetString(name);
+        return global->GetValue(key);
+    };
+
+    EXPECT_TRUE(get("a").num_ == 5);
+    EXPECT_TRUE(get("b").num_ == 7);
+    EXPECT_TRUE(get("c").num_ == 2);
+    EXPECT_TRUE(get("d").str_->GetStdString() == "trim");
+    EXPECT_TRUE(get("e").str_->GetStdString() == "a1b2");
+    EXPECT_TRUE(get("f").str_->GetStdString() == "hell0 w0rld");
+    EXPECT_TRUE(get("g").num_ == 2);
+    EXPECT_TRUE(get("h").str_->GetStdString() == "1 and two");
+    EXPECT_TRUE(get("i").str_->GetStdString() == "aabbcc");
+    EXPECT_TRUE(get("j").str_->GetStdString() == "-a-b-c-");
+    EXPECT_TRUE(get("k").str_->GetStdString() == "42| 3.14|a  |ff");
+    EXPECT_TRUE(get("l").str_->GetStdString() == "1e9999 -1e9999 (0/0) 0.10000000000000001");
+    EXPECT_TRUE(get("m").bvalue_);
+}
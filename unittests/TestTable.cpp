@@ -1,6 +1,12 @@
 #include "UnitTest.h"
 #include "luna/Table.h"
 #include "luna/String.h"
+#include "luna/GC.h"
+#include "luna/State.h"
+#include "luna/LibBase.h"
+#include "luna/LibTable.h"
+#include "luna/Exception.h"
+#include <set>
 
 TEST_CASE(table1)
 {
@@ -162,3 +168,448 @@ TEST_CASE(table5)
     EXPECT_TRUE(value.type_ == luna::ValueT_Number);
     EXPECT_TRUE(value.num_ == 4);
 }
+
+TEST_CASE(table6)
+{
+    luna::GC gc;
+    auto t = gc.NewTable();
+    auto bytes = gc.GetHeapBytes();
+    EXPECT_TRUE(bytes == t->GetMemorySize());
+
+    luna::Value key;
+    luna::Value value;
+    key.type_ = luna::ValueT_Number;
+    value.type_ = luna::ValueT_Number;
+
+    for (int i = 0; i < 100; ++i)
+    {
+        key.num_ = i + 1;
+        value.num_ = i;
+        t->SetValue(key, value);
+
+        key.num_ = i + 0.5;
+        t->SetValue(key, value);
+    }
+
+    EXPECT_TRUE(gc.GetHeapBytes() > bytes);
+    EXPECT_TRUE(gc.GetHeapBytes() == t->GetMemorySize());
+
+    value.type_ = luna::ValueT_Nil;
+    for (int i = 0; i < 100; ++i)
+    {
+        key.num_ = i + 0.5;
+        t->SetValue(key, value);
+    }
+
+    EXPECT_TRUE(gc.GetHeapBytes() == t->GetMemorySize());
+}
+
+TEST_CASE(table7)
+{
+    luna::GC gc;
+    auto wv = gc.NewTable(luna::GCGen2);
+    auto wk = gc.NewTable(luna::GCGen2);
+    wv->SetMode(luna::TableMode_WeakValue);
+    wk->SetMode(luna::TableMode_WeakKey);
+
+    auto root = [&](luna::GCObjectVisitor *v) {
+        wv->Accept(v);
+        wk->Accept(v);
+    };
+    gc.SetRootTraveller(root, root);
+    gc.SetRootUpdater([] { });
+
+    luna::Value key;
+    luna::Value value;
+    for (int i = 0; i < 10; ++i)
+    {
+        key.type_ = luna::ValueT_Number;
+        key.num_ = i + 1;
+        value.type_ = luna::ValueT_Table;
+        value.table_ = gc.NewTable(luna::GCGen2);
+        wv->SetValue(key, value);
+        wk->SetValue(value, key);
+    }
+
+    // Number values and keys are never collected
+    key.type_ = luna::ValueT_Number;
+    key.num_ = 100;
+    wv->SetValue(key, key);
+    wk->SetValue(key, key);
+
+    gc.FullGC();
+
+    luna::Value k, v, nk;
+    EXPECT_TRUE(wv->FirstKeyValue(k, v));
+    EXPECT_TRUE(k.num_ == 100 && v.num_ == 100);
+    EXPECT_TRUE(!wv->NextKeyValue(k, nk, v));
+
+    EXPECT_TRUE(wk->FirstKeyValue(k, v));
+    EXPECT_TRUE(k.num_ == 100 && v.num_ == 100);
+    EXPECT_TRUE(!wk->NextKeyValue(k, nk, v));
+}
+
+TEST_CASE(table8)
+{
+    luna::GC gc;
+    auto t = gc.NewTable(luna::GCGen2);
+    auto root = [&](luna::GCObjectVisitor *v) { t->Accept(v); };
+    gc.SetRootTraveller(root, root);
+    gc.SetRootUpdater([] { });
+
+    luna::Value key;
+    luna::Value value;
+    for (int i = 0; i < 100; ++i)
+    {
+        key.type_ = luna::ValueT_Table;
+        key.table_ = gc.NewTable(luna::GCGen2);
+        value.type_ = luna::ValueT_Number;
+        value.num_ = i;
+        t->SetValue(key, value);
+    }
+
+    // Assign nil to keys while traversing, all keys are traversed in
+    // insertion order
+    int count = 0;
+    luna::Value nil;
+    bool has = t->FirstKeyValue(key, value);
+    while (has)
+    {
+        EXPECT_TRUE(value.num_ == count);
+        ++count;
+        t->SetValue(key, nil);
+        has = t->NextKeyValue(key, key, value);
+    }
+    EXPECT_TRUE(count == 100);
+    EXPECT_TRUE(!t->FirstKeyValue(key, value));
+
+    // Key objects of dead nodes are collected
+    gc.FullGC();
+    EXPECT_TRUE(gc.GetHeapBytes() == t->GetMemorySize());
+
+    // Unknown key has no next key
+    key.type_ = luna::ValueT_Number;
+    key.num_ = 1.5;
+    value.num_ = 1;
+    t->SetValue(key, value);
+    EXPECT_TRUE(t->NextKeyValue(nil, key, value));
+    EXPECT_TRUE(key.num_ == 1.5);
+    key.num_ = 2.5;
+    EXPECT_TRUE(!t->NextKeyValue(key, key, value));
+}
+
+TEST_CASE(table9)
+{
+    luna::State state;
+    lib::base::RegisterLibBase(&state);
+    state.DoString("local t = {10, 20, 30, x = 1, y = 2}\n"
+                   "isum = 0\n"
+                   "for i, v in ipairs(t) do isum = isum + i * v end\n"
+                   "sum = 0\n"
+                   "for k, v in pairs(t) do sum = sum + v t[k] = nil end\n"
+                   "empty = next(t) == nil\n"
+                   "local function iter(s, c) if c < s then return c + 1 end end\n"
+                   "count = 0\n"
+                   "for i in iter, 5, 0 do count = count + i end\n", "iterate");
+
+    auto global = state.GetGlobal()->table_;
+    auto get = [&](const char *name) {
+        luna::Value key;
+        key.type_ = luna::ValueT_String;
+        key.str_ = state.GetString(name);
+        return global->GetValue(key);
+    };
+
+    EXPECT_TRUE(get("isum").num_ == 10 + 40 + 90);
+    EXPECT_TRUE(get("sum").num_ == 63);
+    EXPECT_TRUE(get("empty").bvalue_);
+    EXPECT_TRUE(get("count").num_ == 15);
+}
+
+TEST_CASE(table10)
+{
+    luna::GC gc;
+    auto t = gc.NewTable();
+    t->Reserve(100, 100);
+    EXPECT_TRUE(gc.GetHeapBytes() == t->GetMemorySize());
+
+    // Filling reserved table does not grow it
+    auto bytes = t->GetMemorySize();
+    luna::Value key;
+    luna::Value value;
+    key.type_ = luna::ValueT_Number;
+    value.type_ = luna::ValueT_Number;
+    for (int i = 0; i < 100; ++i)
+    {
+        key.num_ = i + 1;
+        value.num_ = i;
+        t->SetValue(key, value);
+
+        key.num_ = i + 0.5;
+        t->SetValue(key, value);
+    }
+
+    EXPECT_TRUE(t->ArraySize() == 100);
+    EXPECT_TRUE(t->GetMemorySize() == bytes);
+    EXPECT_TRUE(gc.GetHeapBytes() == t->GetMemorySize());
+
+    key.num_ = 50.5;
+    EXPECT_TRUE(t->GetValue(key).num_ == 50);
+
+    // Huge sizes are clamped
+    auto huge = gc.NewTable();
+    huge->Reserve(static_cast<std::size_t>(-1), static_cast<std::size_t>(-1));
+    EXPECT_TRUE(huge->GetMemorySize() < 256 * 1024 * 1024);
+
+    luna::State state;
+    lib::table::RegisterLibTable(&state);
+    state.DoString("local a = table.new(1e12, 0)\n"
+                   "local b = table.new(1e300, 1e300)\n"
+                   "local c = table.new(1 / 0, -1 / 0)\n"
+                   "local d = table.new(0 / 0, 0 / 0)\n"
+                   "a[1] = 1 b[1] = 2 c[1] = 3 d[1] = 4\n"
+                   "sum = a[1] + b[1] + c[1] + d[1]\n", "new");
+
+    key.type_ = luna::ValueT_String;
+    key.str_ = state.GetString("sum");
+    EXPECT_TRUE(state.GetGlobal()->table_->GetValue(key).num_ == 10);
+}
+
+TEST_CASE(table11)
+{
+    luna::Table t;
+    luna::Value key;
+    luna::Value value;
+    key.type_ = luna::ValueT_Number;
+    value.type_ = luna::ValueT_Number;
+
+    // Keys filled in reverse order are moved to array part, which is
+    // traversed in order of keys
+    for (int i = 100; i > 0; --i)
+    {
+        key.num_ = i;
+        value.num_ = i;
+        t.SetValue(key, value);
+    }
+
+    EXPECT_TRUE(t.ArraySize() == 100);
+
+    int index = 0;
+    bool has = t.FirstKeyValue(key, value);
+    while (has)
+    {
+        EXPECT_TRUE(key.num_ == ++index);
+        has = t.NextKeyValue(key, key, value);
+    }
+    EXPECT_TRUE(index == 100);
+
+    // Border of array with holes
+    key.num_ = 100;
+    t.SetValue(key, luna::Value());
+    EXPECT_TRUE(t.ArraySize() == 99);
+    key.num_ = 50;
+    t.SetValue(key, luna::Value());
+    auto border = t.ArraySize();
+    EXPECT_TRUE(border == 49 || border == 99);
+}
+
+TEST_CASE(table12)
+{
+    luna::GC gc;
+    auto t = gc.NewTable();
+    luna::Value key;
+    luna::Value value;
+    key.type_ = luna::ValueT_Number;
+    value.type_ = luna::ValueT_Number;
+
+    // Array of numbers stores 8 bytes for each number
+    for (int i = 0; i < 1000; ++i)
+    {
+        key.num_ = i + 1;
+        value.num_ = i * 0.5;
+        t->SetValue(key, value);
+    }
+
+    auto bytes = t->GetMemorySize();
+    EXPECT_TRUE(bytes < sizeof(luna::Table) + 1024 * sizeof(luna::Value));
+    EXPECT_TRUE(gc.GetHeapBytes() == bytes);
+
+    // Storing other value converts the array part
+    key.num_ = 10;
+    value.type_ = luna::ValueT_Bool;
+    value.bvalue_ = true;
+    t->SetValue(key, value);
+
+    EXPECT_TRUE(t->GetMemorySize() > bytes);
+    EXPECT_TRUE(gc.GetHeapBytes() == t->GetMemorySize());
+    EXPECT_TRUE(t->ArraySize() == 1000);
+
+    value = t->GetValue(key);
+    EXPECT_TRUE(value.type_ == luna::ValueT_Bool && value.bvalue_);
+    key.num_ = 11;
+    value = t->GetValue(key);
+    EXPECT_TRUE(value.type_ == luna::ValueT_Number && value.num_ == 5);
+}
+
+TEST_CASE(table13)
+{
+    luna::State state;
+    lib::base::RegisterLibBase(&state);
+    lib::table::RegisterLibTable(&state);
+    state.DoString("local function sorted(t, comp)\n"
+                   "    for i = 2, #t do\n"
+                   "        if comp(t[i], t[i - 1]) then return false end\n"
+                   "    end\n"
+                   "    return true\n"
+                   "end\n"
+                   "local less = function(a, b) return a < b end\n"
+                   "local greater = function(a, b) return a > b end\n"
+                   "local n = {}\n"
+                   "for i = 1, 100 do n[i] = (i * 37) % 101 end\n"
+                   "table.sort(n)\n"
+                   "nums = sorted(n, less)\n"
+                   "local s = {'d', 'b', 'a', 'c', 'b'}\n"
+                   "table.sort(s)\n"
+                   "strs = sorted(s, less) and s[1] == 'a' and s[5] == 'd'\n"
+                   "table.sort(n, greater)\n"
+                   "comp = sorted(n, greater) and n[1] == 100\n"
+                   "local h = {}\n"
+                   "for i = 100, 1, -1 do h[i] = tostring((i * 37) % 101) end\n"
+                   "table.sort(h, function(a, b) return #a < #b or (#a == #b and a < b) end)\n"
+                   "hash = #h == 100 and h[1] == '1' and h[100] == '100'\n", "sort");
+
+    auto global = state.GetGlobal()->table_;
+    auto get = [&](const char *name) {
+        luna::Value key;
+        key.type_ = luna::ValueT_String;
+        key.str_ = state.GetString(name);
+        return global->GetValue(key);
+    };
+
+    EXPECT_TRUE(get("nums").bvalue_);
+    EXPECT_TRUE(get("strs").bvalue_);
+    EXPECT_TRUE(get("comp").bvalue_);
+    EXPECT_TRUE(get("hash").bvalue_);
+}
+
+TEST_CASE(table14)
+{
+    luna::State state;
+    lib::base::RegisterLibBase(&state);
+    lib::table::RegisterLibTable(&state);
+    state.DoString("local t = {1, 2.5, 'x', -3, 0.1, 123456789012345}\n"
+                   "all = table.concat(t, ', ')\n"
+                   "part = table.concat(t, '', 2, 3)\n"
+                   "empty = table.concat({}, ',')\n"
+                   "huge = table.concat(t, ',', 5, 2^40)\n"
+                   "negative = table.concat(t, ',', -3, 2)\n"
+                   "reversed = table.concat(t, ',', 3, 2)\n", "concat");
+
+    auto global = state.GetGlobal()->table_;
+    auto get = [&](const char *name) {
+        luna::Value key;
+        key.type_ = luna::ValueT_String;
+        key.str_ = state.GetString(name);
+        return global->GetValue(key);
+    };
+
+    EXPECT_TRUE(get("all").str_->GetStdString() ==
+                "1, 2.5, x, -3, 0.1, 123456789012345");
+    EXPECT_TRUE(get("part").str_->GetStdString() == "2.5x");
+    EXPECT_TRUE(get("empty").str_->GetLength() == 0);
+
+    // Range is clamped to the sequence
+    EXPECT_TRUE(get("huge").str_->GetStdString() == "0.1,123456789012345");
+    EXPECT_TRUE(get("negative").str_->GetStdString() == "1,2.5");
+    EXPECT_TRUE(get("reversed").str_->GetLength() == 0);
+}
+
+TEST_CASE(table15)
+{
+    luna::GC gc;
+    auto t = gc.NewTable(luna::GCGen2);
+    auto root = [&](luna::GCObjectVisitor *v) { t->Accept(v); };
+    gc.SetRootTraveller(root, root);
+    gc.SetRootUpdater([] { });
+
+    // New tables reuse nursery addresses after each minor GC, but their
+    // identity hashes are still different
+    const int kBatches = 10;
+    const int kBatchSize = 1000;
+    luna::Value key;
+    luna::Value value;
+    for (int i = 0; i < kBatches; ++i)
+    {
+        for (int j = 0; j < kBatchSize; ++j)
+        {
+            key.type_ = luna::ValueT_Table;
+            key.table_ = gc.NewTable(luna::GCGen0);
+            value.type_ = luna::ValueT_Number;
+            value.num_ = i * kBatchSize + j;
+            t->SetValue(key, value);
+        }
+        CHECK_BARRIER(gc, t);
+        gc.StepGC();
+    }
+
+    std::set<std::size_t> hashes;
+    int count = 0;
+    luna::Value nil;
+    bool has = t->FirstKeyValue(key, value);
+    while (has)
+    {
+        hashes.insert(key.obj_->GetObjectHash());
+        EXPECT_TRUE(t->GetValue(key).num_ == value.num_);
+        ++count;
+        has = t->NextKeyValue(key, key, value);
+    }
+    EXPECT_TRUE(count == kBatches * kBatchSize);
+    EXPECT_TRUE(hashes.size() == static_cast<std::size_t>(count));
+}
+
+TEST_CASE(table16)
+{
+    // Allocations check heap limit without GC
+    luna::GC gc;
+    gc.SetHeapLimit(1024 * 1024);
+    auto t = gc.NewTable(luna::GCGen2);
+
+    bool oom = false;
+    try
+    {
+        t->Reserve(1024 * 1024, 0);
+    }
+    catch (const luna::OutOfMemory &)
+    {
+        oom = true;
+    }
+    EXPECT_TRUE(oom);
+
+    oom = false;
+    try
+    {
+        gc.NewString(luna::GCGen2, 2 * 1024 * 1024);
+    }
+    catch (const luna::OutOfMemory &)
+    {
+        oom = true;
+    }
+    EXPECT_TRUE(oom);
+
+    // Garbage under heap limit is collected before allocations exceed it
+    luna::State state;
+    lib::table::RegisterLibTable(&state);
+    state.GetGC().SetHeapLimit(state.GetGC().GetHeapBytes() + 1024 * 1024);
+    state.DoString("for i = 1, 10000 do local t = table.new(100, 0) end\n");
+
+    oom = false;
+    try
+    {
+        state.DoString("local t = table.new(1e6, 0)\n");
+    }
+    catch (const luna::OutOfMemory &)
+    {
+        oom = true;
+    }
+    EXPECT_TRUE(oom);
+}